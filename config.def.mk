@@ -19,5 +19,12 @@ CFLAGS+=-Wall -Wextra -Wmissing-prototypes -Wredundant-decls
 CFLAGS+=-fplan9-extensions
 CFLAGS+=-Iinclude
 
-LIBS=${ATOMICKIT_LIBS}
-STATIC=${ATOMICKIT_STATIC}
+CXX?=g++
+CXXFLAGS?=-Og -g3
+CXXFLAGS+=-std=c++17 -Wall -Wextra
+CXXFLAGS+=-Iinclude
+# USDT probes for perf and bpftrace (needs sys/sdt.h, from systemtap)
+#CFLAGS+=-DGLN_SDT
+
+LIBS=${ATOMICKIT_LIBS} -lpthread
+STATIC=${ATOMICKIT_STATIC} -lpthread
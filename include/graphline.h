@@ -25,20 +25,158 @@
 #include <atomickit/atomic-rcp.h>
 #include <atomickit/atomic-queue.h>
 #include <atomickit/atomic-txn.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+enum gln_sched_class {
+    GLN_SCHED_IDLE,
+    GLN_SCHED_NORMAL,
+    GLN_SCHED_REALTIME
+};
+
+#define GLN_SCHED_WEIGHT_DEFAULT 1024
+
+/* What wakes a scheduler's sleeping workers.  A graph holds a
+ * reference while attached, so enqueueing never touches a scheduler
+ * that may be going away. */
+struct gln_sched_bell {
+    struct arcp_region;
+    volatile atomic_uint work_seq;
+    volatile atomic_uint sleepers;
+};
+
+/* Per-graph state of a shared scheduler */
+struct gln_sched_entity {
+    volatile atomic_uintptr_t scheduler;
+    arcp_t bell;
+    volatile atomic_int queued;
+    enum gln_sched_class class;
+    unsigned int weight;
+    unsigned int load;
+    volatile atomic_ullong vruntime;
+    volatile atomic_ullong cpu_time;
+    volatile atomic_ullong nodes_run;
+    volatile atomic_ullong affinity_hits;
+    volatile atomic_ullong affinity_misses;
+};
+
+struct gln_memstat;
+struct gln_node;
+
+/* Called when a node goes over its time budget: by the thread that
+ * ran it, once it finishes, or by a watchdog while it is still
+ * running. */
+typedef void (*gln_overrun_fp_t)(struct gln_node *node, uint64_t elapsed, bool running, void *arg);
+
+/* How a pull runs the producers it needs.  FIFO puts them all on the
+ * processing queue.  DEPTH_FIRST queues all but one, and runs that
+ * one immediately on the pulling thread, so its output is still in
+ * cache when the consumer resumes. */
+enum gln_graph_policy {
+    GLN_POLICY_FIFO,
+    GLN_POLICY_DEPTH_FIRST
+};
+
+/* Where a graph keeps its nodes: slots that are never moved or
+ * copied, in chunks of GLN_REGISTRY_FIRST << n. */
+#define GLN_REGISTRY_FIRST 64
+#define GLN_REGISTRY_CHUNKS 32
+
+struct gln_registry {
+    volatile atomic_uintptr_t chunks[GLN_REGISTRY_CHUNKS];
+    volatile atomic_size_t end;
+    volatile atomic_size_t count;
+    volatile atomic_ullong free;
+};
 
 struct gln_graph {
     struct arcp_region;
-    arcp_t nodes;
+    struct gln_memstat *mem;
+    struct gln_registry nodes;
     aqueue_t proc_queue;
+    arcp_t loaded;
+    struct gln_sched_entity sched;
+    enum gln_graph_policy policy;
+    unsigned int instances;
+    unsigned int flags;
+    struct gln_registry owned;
+    /* nodes removed since the last reset, each holding a reference,
+     * linked through retired_next */
+    volatile atomic_uintptr_t retired;
+    volatile atomic_bool cancelled;
+    volatile atomic_bool reported;
+    arcp_t failed;
+    int failed_errno;
+    /* eventcount for threads waiting on nodes others are running */
+    volatile atomic_uint progress;
+    volatile atomic_uint waiters;
+    /* time budgets */
+    uint64_t timeout;
+    unsigned int quarantine_after;
+    gln_overrun_fp_t overrun;
+    void *overrun_arg;
+    /* see gln_graph_update_latency */
+    unsigned int latency_mark;
 };
 
 int gln_graph_init(struct gln_graph *graph, void (*destroy)(struct gln_graph *));
 void gln_graph_destroy(struct gln_graph *graph);
 struct gln_graph *gln_graph_create(void);
+/* arcp_release, for callers that can't use atomickit's headers */
+void gln_graph_release(struct gln_graph *graph);
 void gln_graph_reset(struct gln_graph *graph);
+void gln_graph_set_policy(struct gln_graph *graph, enum gln_graph_policy policy);
+
+/* Time budgets.  A node with a budget (in ns; 0, the default, is none)
+ * that runs over it is reported to the graph's overrun handler, and
+ * after quarantine_after overruns in a row (0 for never) it is
+ * quarantined: it is no longer run, and its outputs are cleared
+ * instead.  Setting the budget again lifts the quarantine.  With a
+ * timeout, threads waiting on other threads' nodes give up after that
+ * long, cancelling the cycle, and fail with ETIMEDOUT; any node still
+ * running, with or without a budget, is left out of the next reset
+ * until it finishes, so it is never started twice at once. */
+void gln_graph_set_overrun_handler(struct gln_graph *graph, gln_overrun_fp_t overrun, void *arg,
+				   unsigned int quarantine_after);
+void gln_graph_set_timeout(struct gln_graph *graph, uint64_t timeout);
+
+/* An instanced graph runs its topology over several independent
+ * streams at once.  Each node is processed once per cycle for all
+ * instances, with buffers holding one lane per instance (see
+ * gln_alloc_lanes) and per-instance state (see gln_node_state).  Only
+ * change the number of instances between cycles. */
+int gln_graph_set_instances(struct gln_graph *graph, unsigned int instances);
 
 struct gln_node;
 
+/* An owned graph holds a strong reference to each of its nodes, so
+ * processing can follow raw pointers from socket to socket, node and
+ * graph without touching reference counts.  Nodes stay until removed
+ * with gln_graph_remove_node, and are only released at the next
+ * gln_graph_reset, when no cycle is running.  Every node connected to
+ * an owned graph's nodes must belong to it, and connections may only
+ * change between cycles.  Flags must be set before adding nodes. */
+#define GLN_GRAPH_OWNED 0x1
+/* A single-threaded graph is an owned graph that is only ever run by
+ * the thread pulling from it.  Pulls run producers directly instead
+ * of through the processing queue, with no compare-and-swap on node
+ * state and no waiting.  It can't be attached to a scheduler (EINVAL)
+ * or run by a plan of more than one thread, and a dependency cycle
+ * fails the pull with EDEADLK. */
+#define GLN_GRAPH_SINGLE_THREADED 0x2
+
+int gln_graph_set_flags(struct gln_graph *graph, unsigned int flags);
+
+/* The first node to fail cancels the rest of the cycle: nodes still
+ * queued are dropped without being processed, and pulls waiting on
+ * the graph return -1 with errno ECANCELED.  gln_graph_reset starts a
+ * new cycle. */
+void gln_graph_cancel(struct gln_graph *graph);
+/* Returns the node that cancelled this cycle, with a reference, and
+ * the errno it left, or NULL. */
+struct gln_node *gln_graph_failed_node(struct gln_graph *graph, int *error);
+int gln_graph_remove_node(struct gln_graph *graph, struct gln_node *node);
+
 typedef int (*gln_process_fp_t)(struct gln_node *);
 
 enum gln_node_state {
@@ -48,10 +186,58 @@ enum gln_node_state {
     GLNN_FINISHED
 };
 
+struct gln_node_type;
+struct gln_event;
+struct gln_ports;
+
 struct gln_node {
     struct arcp_region;
+    struct gln_memstat *mem;
     struct arcp_weakref *graph;
+    /* the graph, for owned graphs only */
+    struct gln_graph *owner;
+    unsigned int flags;
+    /* where the graph keeps us */
+    size_t slot;
+    size_t owned_slot;
+    /* see gln_graph_remove_node */
+    volatile atomic_bool retiring;
+    struct gln_node *retired_next;
+    /* see gln_node_set_budget */
+    uint64_t budget;
+    volatile atomic_ullong started;
+    volatile atomic_ullong reported;
+    /* in process, budget or no; see gln_graph_reset */
+    volatile atomic_bool running;
+    unsigned int overruns;
+    volatile atomic_bool quarantined;
     gln_process_fp_t process;
+    const struct gln_node_type *type;
+    unsigned int instances;
+    size_t instance_state_size;
+    void *instance_state;
+    /* measured by gln_graph_profile */
+    uint64_t cost;
+    unsigned int profiled;
+    arcp_t deps;
+    /* posted control events, newest first, and those drained but not
+     * yet due */
+    volatile atomic_uintptr_t events;
+    struct gln_event *pending;
+    /* see gln_node_set_ports */
+    struct gln_ports *ports;
+    /* weak references to all our output sockets; see gln_node_skip */
+    arcp_t outputs;
+    /* in frames: our own, and as of gln_graph_update_latency, the
+     * most added on the way to our inputs and outputs */
+    unsigned int latency;
+    unsigned int input_latency;
+    unsigned int path_latency;
+    unsigned int latency_mark;
+    /* the scheduler worker that last ran us, or -1 */
+    volatile atomic_int worker;
+    /* see gln_node_set_memo */
+    arcp_t memo;
 
     volatile atomic_int state;
 };
@@ -59,16 +245,38 @@ struct gln_node {
 int gln_node_init(struct gln_node *node, struct gln_graph *graph, gln_process_fp_t process, void (*destroy)(struct gln_node *));
 void gln_node_destroy(struct gln_node *node);
 struct gln_node *gln_node_create(struct gln_graph *graph, gln_process_fp_t process);
+/* Creates count nodes; on failure, none are left. */
+int gln_node_create_list(struct gln_graph *graph, size_t count, gln_process_fp_t process, struct gln_node **nodes);
+void gln_node_release_list(size_t count, struct gln_node **nodes);
+void gln_node_set_budget(struct gln_node *node, uint64_t budget);
+bool gln_node_quarantined(struct gln_node *node);
+/* Gives the node size bytes of zeroed state for each instance. */
+int gln_node_set_state_size(struct gln_node *node, size_t size);
+/* For bindings that can't embed struct gln_node (see graphline.hpp):
+ * a node carrying size bytes of storage, aligned like a buffer, that
+ * is passed to process, and to finalize as the node is destroyed. */
+struct gln_node *gln_node_create_ext(struct gln_graph *graph, size_t size,
+				     int (*process)(void *data), void (*finalize)(void *data));
+void *gln_node_ext_data(struct gln_node *node);
 
 enum gln_socket_direction {
     GLNS_INPUT,
     GLNS_OUTPUT
 };
 
+struct gln_delay;
+
 struct gln_socket {
     struct arcp_region;
+    struct gln_memstat *mem;
     struct arcp_weakref *node;
     enum gln_socket_direction direction;
+    /* for owned graphs only: the node, and the connected output */
+    struct gln_node *owner;
+    unsigned int flags;
+    volatile atomic_uintptr_t peer;
+    /* inputs only; see gln_graph_update_latency */
+    struct gln_delay *delay;
 
     atxn_t other;
     arcp_t buffer;
@@ -78,6 +286,36 @@ int gln_socket_init(struct gln_socket *socket, struct gln_node *node,
 		    enum gln_socket_direction direction, void (*destroy)(struct gln_socket *));
 void gln_socket_destroy(struct gln_socket *socket);
 struct gln_socket *gln_socket_create(struct gln_node *node, enum gln_socket_direction direction);
+/* Creates count sockets; on failure, none are left. */
+int gln_socket_create_list(struct gln_node *node, enum gln_socket_direction direction,
+			   size_t count, struct gln_socket **sockets);
+void gln_socket_release_list(size_t count, struct gln_socket **sockets);
+/* Declares all of a node's ports at once, in a single array that the
+ * node keeps until it is destroyed, so that pulling a node's inputs
+ * is one scan over adjacent sockets.  Only once per node (EBUSY).
+ * The sockets returned are not references. */
+int gln_node_set_ports(struct gln_node *node, unsigned int ninputs, unsigned int noutputs);
+struct gln_socket *gln_node_input(struct gln_node *node, unsigned int index);
+struct gln_socket *gln_node_output(struct gln_node *node, unsigned int index);
+/* gln_get_buffer_list over all of the node's declared inputs */
+int gln_node_get_inputs(struct gln_node *node, void **buffers);
+
+/* Latency, in frames.  Each node declares what it adds itself (0 by
+ * default).  gln_graph_update_latency works out the most that any
+ * path of nodes adds on the way to each socket, following the
+ * sockets of typed nodes and of nodes with declared ports; other
+ * nodes count as sources.  With frame_size nonzero, it also delays
+ * each input of such a node that is ahead of the node's latest input
+ * by the difference, through a ring of frame_size-byte frames, so
+ * that the node sees its inputs aligned; 0 takes any delays out.
+ * Delayed inputs must be contiguous (EINVAL), and instanced graphs
+ * can't be compensated.  Call it between cycles, after changing
+ * connections or latencies; a cycle fails it with ELOOP. */
+void gln_node_set_latency(struct gln_node *node, unsigned int frames);
+int gln_graph_update_latency(struct gln_graph *graph, size_t frame_size);
+/* As of the last update, including any delay on an input, so that
+ * an I/O layer can report it for its sinks. */
+unsigned int gln_socket_latency(struct gln_socket *socket);
 int gln_socket_connect(struct gln_socket *socket, struct gln_socket *other);
 int gln_socket_disconnect(struct gln_socket *socket);
 
@@ -91,8 +329,58 @@ struct gln_buffer {
 
 void *gln_alloc_buffer(struct gln_socket *socket, size_t size);
 
+/* Lanes of an instanced buffer are size bytes, each starting on a
+ * GLN_BUFFER_ALIGN boundary. */
+#define GLN_LANE_STRIDE(size) (((size) + GLN_BUFFER_ALIGN - 1) & ~((size_t) GLN_BUFFER_ALIGN - 1))
+
+static inline void *gln_alloc_lanes(struct gln_socket *socket, size_t size, unsigned int lanes) {
+    return gln_alloc_buffer(socket, GLN_LANE_STRIDE(size) * lanes);
+}
+
+static inline void *gln_lane(void *buffer, size_t size, unsigned int lane) {
+    return buffer == NULL ? NULL : (uint8_t *) buffer + GLN_LANE_STRIDE(size) * lane;
+}
+
+static inline void *gln_node_state(struct gln_node *node, unsigned int instance) {
+    return (uint8_t *) node->instance_state + GLN_LANE_STRIDE(node->instance_state_size) * instance;
+}
+
 void gln_set_buffer(struct gln_socket *socket, void *buffer);
 
+/* Control events carry data to a node from any thread without locks.
+ * Times are in whatever units the graph counts in (sample frames,
+ * say), on a clock shared by the posting threads and the node. */
+struct gln_event {
+    struct gln_event *next;
+    uint64_t time;
+    size_t size;
+    uint8_t data[] __attribute__((aligned(GLN_BUFFER_ALIGN)));
+};
+
+/* Copies size bytes of data into a new event for the node. */
+int gln_node_post(struct gln_node *node, uint64_t time, const void *data, size_t size);
+/* For use in process: takes the events due before until, in time
+ * order (and in the order posted, for equal times), as a list.  Later
+ * events are kept for later calls.  Free the list with
+ * gln_event_release. */
+struct gln_event *gln_node_events(struct gln_node *node, uint64_t until);
+void gln_event_release(struct gln_node *node, struct gln_event *events);
+
+/* A view is a buffer made of another's memory: length elements,
+ * stride bytes apart, starting offset elements into the source
+ * socket's current buffer (an input's, once it has been pulled).  The
+ * elements of an ordinary buffer are its bytes; offset and stride
+ * within a view count the view's own elements.  The memory stays
+ * alive as long as the view does.  Fails with EINVAL if the view
+ * does not fit.  A view's data cannot be passed to gln_set_buffer;
+ * make another view of it instead. */
+int gln_set_buffer_view(struct gln_socket *socket, struct gln_socket *source,
+			size_t offset, size_t length, size_t stride);
+/* The number of elements in the socket's buffer and the bytes between
+ * them; an ordinary buffer has one element per byte.  Both are zero if
+ * there is no buffer. */
+void gln_get_buffer_shape(struct gln_socket *socket, size_t *length, size_t *stride);
+
 /* use these to initiate processing */
 /* the first is a convenience interface to the second */
 int gln_get_buffers(int count, ...);
@@ -101,4 +389,295 @@ int gln_get_buffer_list(int count, struct gln_socket **sockets, void **buffers);
 /* does some work; returns false if there was no work to be done */
 bool gln_process(struct gln_graph *graph);
 
+/* Transactions retried after a conflict with another thread, since
+ * the program started */
+struct gln_txn_stats {
+    uint64_t connect_retries;
+    uint64_t disconnect_retries;
+    uint64_t pull_retries;
+};
+
+void gln_txn_stats(struct gln_txn_stats *stats);
+
+/* A scheduler is a pool of worker threads shared by any number of
+ * graphs.  Graphs in a higher class are always served first; within a
+ * class, workers go to the graph that has had the least CPU time for
+ * its weight.  load is the share of one worker, in thousandths, the
+ * graph expects to use; attaching fails with EAGAIN once the total
+ * would exceed the number of workers.  A load of 0 is not counted. */
+struct gln_worker;
+
+struct gln_scheduler {
+    struct arcp_region;
+    arcp_t graphs;
+    pthread_t *threads;
+    struct gln_worker *workers;
+    int nthreads;
+    volatile atomic_bool affinity;
+    struct gln_sched_bell *bell;
+    volatile atomic_bool running;
+    volatile atomic_uint load;
+    volatile atomic_ullong vclock;
+};
+
+struct gln_sched_params {
+    enum gln_sched_class class;
+    unsigned int weight;
+    unsigned int load;
+};
+
+struct gln_sched_stats {
+    /* thread CPU time spent by workers on this graph, in ns */
+    uint64_t cpu_time;
+    uint64_t nodes_run;
+    uint64_t vruntime;
+    /* nodes run again by the same worker as last time, and by
+     * another; see gln_scheduler_set_affinity */
+    uint64_t affinity_hits;
+    uint64_t affinity_misses;
+};
+
+struct gln_scheduler *gln_scheduler_create(int nthreads);
+int gln_scheduler_attach(struct gln_scheduler *scheduler, struct gln_graph *graph,
+			 const struct gln_sched_params *params);
+int gln_scheduler_detach(struct gln_scheduler *scheduler, struct gln_graph *graph);
+void gln_graph_sched_stats(struct gln_graph *graph, struct gln_sched_stats *stats);
+/* With affinity, a worker that takes a node last run by another
+ * worker hands it back to that worker, unless it is busy running
+ * something else, so a node's state and buffers stay in one core's
+ * caches from cycle to cycle.  Off by default. */
+void gln_scheduler_set_affinity(struct gln_scheduler *scheduler, bool affinity);
+
+/* A watchdog thread looks over the graph's nodes every period ns and
+ * reports any still running past their budget, once per run, to the
+ * graph's overrun handler.  Release it to stop it. */
+struct gln_watchdog {
+    struct arcp_region;
+    struct arcp_weakref *graph;
+    uint64_t period;
+    pthread_t thread;
+    volatile atomic_uint running;
+};
+
+struct gln_watchdog *gln_watchdog_create(struct gln_graph *graph, uint64_t period);
+
+/* A memo cache keeps the outputs of deterministic nodes, keyed by a
+ * 128-bit hash of what they were given: the process function, a
+ * typed node's saved parameters, and the contents of every input.  A
+ * memoized node whose key is found gets the cached output buffers
+ * instead of being processed.  One cache may serve nodes in any
+ * number of graphs.  It keeps at most capacity bytes of entries and
+ * their buffers, and evicts the least recently used first. */
+struct gln_memo_entry;
+
+struct gln_memo_cache {
+    struct arcp_region;
+    struct gln_memo_entry **buckets;
+    size_t nbuckets;
+    struct gln_memo_entry *newest;
+    struct gln_memo_entry *oldest;
+    size_t capacity;
+    size_t entries;
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bypassed;
+    volatile atomic_uint lock;
+};
+
+struct gln_memo_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    /* runs that couldn't be keyed, and were processed as usual */
+    uint64_t bypassed;
+    size_t entries;
+    size_t bytes;
+};
+
+struct gln_memo_cache *gln_memo_cache_create(size_t capacity);
+void gln_memo_cache_stats(struct gln_memo_cache *cache, struct gln_memo_stats *stats);
+/* Memoizes a typed node through the cache, or stops with NULL.  The
+ * type must save parameters, since they are all that tells two nodes
+ * of it apart; other nodes fail with EINVAL.  Call it between
+ * cycles.  Process must depend on nothing but the inputs and the
+ * saved parameters, and the outputs are new buffers on every run it
+ * makes.  Only heap buffers are cached, and runs that can't be keyed
+ * (a delayed input, see gln_graph_update_latency, or a failed save)
+ * bypass the cache. */
+int gln_node_set_memo(struct gln_node *node, struct gln_memo_cache *cache);
+
+/* A plan runs a graph with a stable topology on a fixed set of
+ * threads, without the processing queue.  gln_graph_profile runs
+ * cycles of the graph on the calling thread, pulling the given
+ * sockets, and records the cost of each node and which nodes it
+ * pulls from.  gln_plan_create then places the profiled nodes on
+ * nthreads threads, earliest finish first (HEFT), giving each thread
+ * an ordered list of nodes and counting the dependencies it has on
+ * other threads.  Each of threads 0 to nthreads - 1 calls
+ * gln_plan_run once per cycle; the graph is reset when all of them
+ * have arrived. */
+struct gln_plan_task;
+
+struct gln_plan {
+    struct arcp_region;
+    struct gln_graph *graph;
+    int nthreads;
+    size_t ntasks;
+    struct gln_plan_task *tasks;
+    size_t *thread_start;
+    size_t *succs;
+    volatile atomic_uint arrived;
+    volatile atomic_uint cycle;
+};
+
+int gln_graph_profile(struct gln_graph *graph, int count, struct gln_socket **sockets, int cycles);
+struct gln_plan *gln_plan_create(struct gln_graph *graph, int nthreads);
+int gln_plan_run(struct gln_plan *plan, int thread);
+/* Returns the index'th node run by thread (no reference), or NULL
+ * when there are no more. */
+struct gln_node *gln_plan_get_node(struct gln_plan *plan, int thread, size_t index);
+
+/* Memory is accounted per socket, per node, and per graph, each
+ * including everything below it.  Buffers are charged to the socket
+ * that allocated them for as long as they live; topology is the node
+ * and connection lists and weak references; queue is posted control
+ * events.  Entries on the processing queue aren't counted: they are
+ * short-lived, and counting them would put shared atomics on every
+ * enqueue.  Sizes of structures owned by atomickit are estimates. */
+enum gln_mem_class {
+    GLN_MEM_BUFFER,
+    GLN_MEM_TOPOLOGY,
+    GLN_MEM_QUEUE,
+    GLN_MEM_NCLASSES
+};
+
+struct gln_mem_usage {
+    size_t live[GLN_MEM_NCLASSES];
+    size_t peak[GLN_MEM_NCLASSES];
+    size_t total;
+    size_t total_peak;
+};
+
+void gln_graph_mem_usage(struct gln_graph *graph, struct gln_mem_usage *usage);
+void gln_node_mem_usage(struct gln_node *node, struct gln_mem_usage *usage);
+void gln_socket_mem_usage(struct gln_socket *socket, struct gln_mem_usage *usage);
+/* Allocations that would take the graph's total over budget bytes
+ * fail with ENOMEM.  0, the default, is unlimited. */
+void gln_graph_set_mem_budget(struct gln_graph *graph, size_t budget);
+
+/* Node types make a node reconstructible from a snapshot. */
+struct gln_node_type {
+    const char *name;
+    /* create a node of this type from saved parameters */
+    struct gln_node *(*create)(struct gln_graph *graph, const void *params, size_t size);
+    /* write up to size bytes of parameters; returns the full size, or
+     * -1 on error.  params may be NULL to query the size. */
+    ssize_t (*save)(struct gln_node *node, void *params, size_t size);
+    /* returns the index'th socket of the node (no reference), or NULL
+     * when there are no more. */
+    struct gln_socket *(*socket)(struct gln_node *node, int index);
+
+    struct gln_node_type *next;
+};
+
+int gln_node_type_register(struct gln_node_type *type);
+struct gln_node_type *gln_node_type_find(const char *name);
+struct gln_node *gln_node_create_typed(struct gln_graph *graph, const char *name,
+				       const void *params, size_t size);
+
+/* Snapshots are a versioned, native-endian binary image of the typed
+ * nodes in a graph, their parameters and sockets, the connections
+ * between them, and a topological processing order.  Untyped nodes,
+ * and connections to them, are left out. */
+int gln_graph_save(struct gln_graph *graph, const char *path);
+/* Nodes created by the loader are owned by the returned graph. */
+struct gln_graph *gln_graph_load_mmap(const char *path);
+/* Returns the index'th node of a loaded snapshot, with a reference,
+ * or NULL. */
+struct gln_node *gln_graph_get_node(struct gln_graph *graph, size_t index);
+
+/* A capture records the buffers on chosen output sockets, once per
+ * cycle, along with how long the cycle's pull took, for replay
+ * against a snapshot of the graph saved at the same time.  The inputs
+ * are the sockets whose data comes from outside (capture every output
+ * of each such node); the outputs are checked on replay.  Bracket
+ * each cycle's pull with gln_capture_begin, just before it, and
+ * gln_capture_cycle, after it and before the reset (EINVAL without
+ * the begin).  Buffers must be contiguous. */
+struct gln_capture;
+
+struct gln_capture *gln_capture_create(struct gln_graph *graph, const char *snapshot_path, const char *path,
+				       int ninputs, struct gln_socket **inputs,
+				       int noutputs, struct gln_socket **outputs);
+void gln_capture_begin(struct gln_capture *capture);
+int gln_capture_cycle(struct gln_capture *capture);
+/* Flushes the file; check for errors here. */
+int gln_capture_close(struct gln_capture *capture);
+
+struct gln_replay_stats {
+    unsigned long cycles;
+    /* cycles where some output differed from the recording */
+    unsigned long mismatches;
+    /* time spent in the pulls: as captured, and in replay, where the
+     * input nodes are not run */
+    uint64_t recorded_ns;
+    uint64_t recorded_max_ns;
+    uint64_t replayed_ns;
+    uint64_t replayed_max_ns;
+};
+
+/* Loads the snapshot (its node types must be registered) and runs
+ * every recorded cycle: the input nodes are not run, their recorded
+ * buffers are used instead, and the outputs are compared with the
+ * recording.  With nthreads > 0 a scheduler with that many threads
+ * is attached; otherwise everything runs on the calling thread. */
+int gln_replay(const char *snapshot_path, const char *path, int nthreads, struct gln_replay_stats *stats);
+
+/* Shared memory arenas carry buffers between processes without
+ * copying.  An arena is a memfd holding a fixed number of equally
+ * sized buffer slots and a single handoff ring from one sender to one
+ * receiver.  Map the same arena in another process with
+ * gln_shm_arena_open() on (a duplicate of) its fd.  Each process keeps
+ * its own buffer headers in its mapping, so a mapping is used for
+ * sending or for receiving, never both (EINVAL): a receiver in the
+ * sender's process needs its own mapping from gln_shm_arena_open(). */
+struct gln_shm_control;
+
+struct gln_shm_arena {
+    struct arcp_region;
+    int fd;
+    struct gln_shm_control *control;
+    size_t control_size;
+    uint8_t *slots;
+    size_t slot_size;
+    size_t stride;
+    uint32_t nslots;
+    /* sending or receiving, as first used */
+    volatile atomic_int role;
+};
+
+struct gln_shm_arena *gln_shm_arena_create(size_t nslots, size_t slot_size);
+struct gln_shm_arena *gln_shm_arena_open(int fd);
+
+/* Like gln_alloc_buffer, but the buffer lives in the arena and can be
+ * sent without a copy.  A fresh slot is taken on every call. */
+void *gln_shm_alloc_buffer(struct gln_socket *socket, struct gln_shm_arena *arena, size_t size);
+
+/* Pulls the input socket and hands its buffer to the receiving side.
+ * Buffers that are not already in the arena are copied into it;
+ * strided views cannot be sent.  Blocks while the ring is full. */
+int gln_shm_send(struct gln_shm_arena *arena, struct gln_socket *socket);
+
+/* A node that outputs whatever the sending side sent next, blocking
+ * until something arrives. */
+struct gln_shm_receiver {
+    struct gln_node;
+    struct gln_socket *out;
+    arcp_t arena;
+};
+
+struct gln_shm_receiver *gln_shm_receiver_create(struct gln_graph *graph, struct gln_shm_arena *arena);
+
 #endif /* ! GRAPHLINE_H */
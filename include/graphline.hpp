@@ -0,0 +1,276 @@
+/*
+ * graphline.hpp
+ * 
+ * Copyright 2013 Evan Buswell
+ * 
+ * This file is part of Graphline.
+ * 
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ * 
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRAPHLINE_HPP
+#define GRAPHLINE_HPP
+
+#ifdef __cplusplus
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <utility>
+
+extern "C" {
+#endif
+    /* graphline.h needs C11 atomics and plan9 extensions, so C++
+     * sees graphline through opaque handles and these declarations.
+     * Included from C after graphline.h, as src/test.c does, they
+     * are checked against it. */
+    struct gln_graph;
+    struct gln_node;
+    struct gln_socket;
+
+#ifndef GRAPHLINE_H
+    enum gln_socket_direction {
+	GLNS_INPUT = 0,
+	GLNS_OUTPUT = 1
+    };
+#else
+    _Static_assert(GLNS_INPUT == 0 && GLNS_OUTPUT == 1, "gln_socket_direction differs from graphline.h");
+#endif
+
+    struct gln_graph *gln_graph_create(void);
+    void gln_graph_release(struct gln_graph *graph);
+    void gln_graph_reset(struct gln_graph *graph);
+    struct gln_node *gln_node_create_ext(struct gln_graph *graph, size_t size,
+					 int (*process)(void *data), void (*finalize)(void *data));
+    void *gln_node_ext_data(struct gln_node *node);
+    void gln_node_release_list(size_t count, struct gln_node **nodes);
+    struct gln_socket *gln_socket_create(struct gln_node *node, enum gln_socket_direction direction);
+    void gln_socket_release_list(size_t count, struct gln_socket **sockets);
+    int gln_socket_connect(struct gln_socket *socket, struct gln_socket *other);
+    int gln_socket_disconnect(struct gln_socket *socket);
+    void *gln_alloc_buffer(struct gln_socket *socket, size_t size);
+    int gln_set_buffer_view(struct gln_socket *socket, struct gln_socket *source,
+			    size_t offset, size_t length, size_t stride);
+    void gln_get_buffer_shape(struct gln_socket *socket, size_t *length, size_t *stride);
+    int gln_get_buffer_list(int count, struct gln_socket **sockets, void **buffers);
+#ifdef __cplusplus
+}
+
+namespace gln {
+
+    template<typename... T> struct Inputs {};
+    template<typename... T> struct Outputs {};
+
+    template<typename Derived, typename In, typename Out> class Node;
+
+    /* A socket carrying contiguous arrays of T */
+    template<typename T>
+    class Input {
+    public:
+	struct gln_socket *socket() const { return socket_; }
+	/* Elements in the buffer last pulled */
+	size_t size() const {
+	    size_t length, stride;
+	    gln_get_buffer_shape(socket_, &length, &stride);
+	    return length / sizeof(T);
+	}
+	/* False for a strided view, which can't be read as a T array */
+	bool contiguous() const {
+	    size_t length, stride;
+	    gln_get_buffer_shape(socket_, &length, &stride);
+	    return stride <= 1;
+	}
+    private:
+	template<typename, typename, typename> friend class Node;
+	struct gln_socket *socket_ = nullptr;
+    };
+
+    template<typename T>
+    class Output {
+    public:
+	struct gln_socket *socket() const { return socket_; }
+	T *alloc(size_t count) {
+	    return static_cast<T *>(gln_alloc_buffer(socket_, count * sizeof(T)));
+	}
+    private:
+	template<typename, typename, typename> friend class Node;
+	struct gln_socket *socket_ = nullptr;
+    };
+
+    /* Only ports of the same element type connect. */
+    template<typename T>
+    inline int connect(Output<T> &output, Input<T> &input) {
+	return gln_socket_connect(output.socket(), input.socket());
+    }
+
+    /* Pulls the inputs from outside the graph, as gln_get_buffers
+     * does; fails with EINVAL if any of them is a strided view. */
+    template<typename... T>
+    inline int pull(std::tuple<const T *...> &buffers, Input<T> &...inputs) {
+	std::array<struct gln_socket *, sizeof...(T)> sockets = {{ inputs.socket()... }};
+	std::array<void *, sizeof...(T)> data;
+	int r = gln_get_buffer_list(sizeof...(T), sockets.data(), data.data());
+	if(r != 0) {
+	    return r;
+	}
+	if(!(inputs.contiguous() && ...)) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	buffers = std::apply([](auto... p) { return std::tuple<const T *...>(static_cast<const T *>(p)...); }, data);
+	return 0;
+    }
+
+    /* Holds the reference to a node made by Node::create; releasing
+     * it takes the node out of an owned graph. */
+    template<typename T>
+    class Ref {
+    public:
+	Ref() = default;
+	explicit Ref(struct gln_node *node) : node_(node) {}
+	Ref(Ref &&other) : node_(other.node_) { other.node_ = nullptr; }
+	Ref &operator=(Ref &&other) {
+	    std::swap(node_, other.node_);
+	    return *this;
+	}
+	Ref(const Ref &) = delete;
+	Ref &operator=(const Ref &) = delete;
+	~Ref() { reset(); }
+
+	void reset() {
+	    if(node_ != nullptr) {
+		gln_node_release_list(1, &node_);
+		node_ = nullptr;
+	    }
+	}
+	struct gln_node *node() const { return node_; }
+	T *get() const { return node_ == nullptr ? nullptr : static_cast<T *>(gln_node_ext_data(node_)); }
+	T *operator->() const { return get(); }
+	T &operator*() const { return *get(); }
+	explicit operator bool() const { return node_ != nullptr; }
+    private:
+	struct gln_node *node_ = nullptr;
+    };
+
+    /* Base for nodes with compile-time ports:
+     *
+     *   struct Gain : gln::Node<Gain, gln::Inputs<float>, gln::Outputs<float>> {
+     *       float gain;
+     *       Gain(float gain) : gain(gain) {}
+     *       int process(const float *in) { ... output<0>().alloc(n) ... }
+     *   };
+     *   auto gain = Gain::create(graph, 0.5f);
+     *
+     * The inputs are pulled straight into process's arguments, which
+     * may be NULL if an input is unconnected; a strided view on an
+     * input fails the run with EINVAL.  process returns 0, or -1 with
+     * errno set, like any other node's; an exception escaping it
+     * fails the run with ECANCELED (ENOMEM for std::bad_alloc), as it
+     * can't unwind through the C that calls it. */
+    template<typename Derived, typename... I, typename... O>
+    class Node<Derived, Inputs<I...>, Outputs<O...>> {
+    public:
+	Node() = default;
+	Node(const Node &) = delete;
+	Node &operator=(const Node &) = delete;
+	~Node() {
+	    std::apply([](auto &...input) { (release(input.socket_), ...); }, inputs_);
+	    std::apply([](auto &...output) { (release(output.socket_), ...); }, outputs_);
+	}
+
+	struct gln_node *node() const { return node_; }
+	template<size_t K> auto &input() { return std::get<K>(inputs_); }
+	template<size_t K> auto &output() { return std::get<K>(outputs_); }
+
+	/* Makes a Derived node in graph from args.  Returns an empty Ref,
+	 * with errno set, on failure. */
+	template<typename... Args>
+	static Ref<Derived> create(struct gln_graph *graph, Args &&...args) {
+	    static_assert(alignof(Derived) <= 16, "node storage is only aligned like a buffer");
+	    Ref<Derived> ref(gln_node_create_ext(graph, sizeof(Derived) + 1, trampoline, finalize));
+	    if(!ref) {
+		return ref;
+	    }
+	    Derived *self = new(gln_node_ext_data(ref.node())) Derived(std::forward<Args>(args)...);
+	    live(self) = true;
+	    self->node_ = ref.node();
+	    bool ok = true;
+	    std::apply([&](auto &...input) { ((ok = ok && make(input.socket_, self->node_, GLNS_INPUT)), ...); },
+		       self->inputs_);
+	    std::apply([&](auto &...output) { ((ok = ok && make(output.socket_, self->node_, GLNS_OUTPUT)), ...); },
+		       self->outputs_);
+	    if(!ok) {
+		ref.reset();
+	    }
+	    return ref;
+	}
+
+    private:
+	struct gln_node *node_ = nullptr;
+	std::tuple<Input<I>...> inputs_;
+	std::tuple<Output<O>...> outputs_;
+
+	/* Set once Derived is constructed, so a throwing constructor
+	 * isn't followed by a destructor */
+	static bool &live(void *data) {
+	    return *(static_cast<bool *>(data) + sizeof(Derived));
+	}
+
+	static bool make(struct gln_socket *&socket, struct gln_node *node, enum gln_socket_direction direction) {
+	    socket = gln_socket_create(node, direction);
+	    return socket != nullptr;
+	}
+
+	static void release(struct gln_socket *socket) {
+	    if(socket != nullptr) {
+		gln_socket_release_list(1, &socket);
+	    }
+	}
+
+	template<size_t... K>
+	int run(std::index_sequence<K...>) {
+	    std::array<struct gln_socket *, sizeof...(I)> sockets = {{ std::get<K>(inputs_).socket_... }};
+	    std::array<void *, sizeof...(I)> buffers = {};
+	    if(sizeof...(I) != 0 && gln_get_buffer_list(sizeof...(I), sockets.data(), buffers.data()) != 0) {
+		return -1;
+	    }
+	    if(!(std::get<K>(inputs_).contiguous() && ...)) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    return static_cast<Derived *>(this)->process(static_cast<const I *>(buffers[K])...);
+	}
+
+	static int trampoline(void *data) noexcept {
+	    try {
+		return static_cast<Derived *>(data)->run(std::index_sequence_for<I...>());
+	    } catch(const std::bad_alloc &) {
+		errno = ENOMEM;
+	    } catch(...) {
+		errno = ECANCELED;
+	    }
+	    return -1;
+	}
+
+	static void finalize(void *data) {
+	    if(live(data)) {
+		static_cast<Derived *>(data)->~Derived();
+	    }
+	}
+    };
+
+}
+#endif
+
+#endif /* ! GRAPHLINE_HPP */
@@ -0,0 +1,400 @@
+/*
+ * capture.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+
+/* Capture layout, native-endian like snapshots:
+ *
+ *   header
+ *   sockets           struct gln_capture_socket[ninputs + noutputs]
+ *   cycles            each: uint64_t pull_ns, then for each socket
+ *                     uint64_t length (GLN_CAPTURE_NULL for none) and
+ *                     that many bytes of data
+ */
+
+#define GLN_CAPTURE_MAGIC "GLNCAPT"
+#define GLN_CAPTURE_VERSION 1
+#define GLN_CAPTURE_BYTEORDER 0x01020304
+#define GLN_CAPTURE_NULL UINT64_MAX
+
+struct gln_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t ninputs;
+    uint32_t noutputs;
+};
+
+/* A socket by its place in the snapshot */
+struct gln_capture_socket {
+    uint32_t node;
+    uint32_t socket;
+};
+
+struct gln_capture {
+    FILE *file;
+    int nsockets;
+    struct gln_socket **sockets;
+    /* see gln_capture_begin; 0 outside a cycle */
+    uint64_t start;
+};
+
+struct gln_capture *gln_capture_create(struct gln_graph *graph, const char *snapshot_path, const char *path,
+				       int ninputs, struct gln_socket **inputs,
+				       int noutputs, struct gln_socket **outputs) {
+    int i;
+    struct gln_capture *capture = malloc(sizeof(struct gln_capture));
+    if(capture == NULL) {
+	goto undo0;
+    }
+    capture->nsockets = ninputs + noutputs;
+    capture->sockets = malloc(sizeof(struct gln_socket *) * (capture->nsockets + 1));
+    if(capture->sockets == NULL) {
+	goto undo1;
+    }
+    struct gln_capture_socket *records = malloc(sizeof(struct gln_capture_socket) * (capture->nsockets + 1));
+    if(records == NULL) {
+	goto undo2;
+    }
+    for(i = 0; i < capture->nsockets; i++) {
+	struct gln_socket *socket = i < ninputs ? inputs[i] : outputs[i - ninputs];
+	if(socket->direction != GLNS_OUTPUT) {
+	    errno = EINVAL;
+	    goto undo3;
+	}
+	capture->sockets[i] = socket;
+    }
+
+    if(gln_graph_save(graph, snapshot_path) != 0) {
+	goto undo3;
+    }
+    for(i = 0; i < capture->nsockets; i++) {
+	if(gln_snapshot_locate(graph, capture->sockets[i], &records[i].node, &records[i].socket) != 0) {
+	    goto undo3;
+	}
+    }
+
+    capture->file = fopen(path, "wb");
+    if(capture->file == NULL) {
+	goto undo3;
+    }
+    struct gln_capture_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GLN_CAPTURE_MAGIC, sizeof(GLN_CAPTURE_MAGIC));
+    header.version = GLN_CAPTURE_VERSION;
+    header.byteorder = GLN_CAPTURE_BYTEORDER;
+    header.ninputs = ninputs;
+    header.noutputs = noutputs;
+    if(fwrite(&header, sizeof(header), 1, capture->file) != 1
+       || fwrite(records, sizeof(struct gln_capture_socket), capture->nsockets, capture->file)
+	  != (size_t) capture->nsockets) {
+	goto undo4;
+    }
+    free(records);
+
+    /* Keep the sockets until we're done */
+    for(i = 0; i < capture->nsockets; i++) {
+	gln_acquire(capture->sockets[i]);
+    }
+    capture->start = 0;
+    return capture;
+
+undo4:
+    fclose(capture->file);
+undo3:
+    free(records);
+undo2:
+    free(capture->sockets);
+undo1:
+    free(capture);
+undo0:
+    return NULL;
+}
+
+void gln_capture_begin(struct gln_capture *capture) {
+    capture->start = gln_now();
+}
+
+int gln_capture_cycle(struct gln_capture *capture) {
+    int i;
+    if(capture->start == 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    uint64_t elapsed = gln_now() - capture->start;
+    capture->start = 0;
+    if(fwrite(&elapsed, sizeof(uint64_t), 1, capture->file) != 1) {
+	return -1;
+    }
+    for(i = 0; i < capture->nsockets; i++) {
+	struct gln_buffer *buffer = gln_socket_buffer(capture->sockets[i]);
+	uint64_t length = GLN_CAPTURE_NULL;
+	const uint8_t *data = NULL;
+	if(buffer != NULL) {
+	    struct gln_view_buffer *view = gln_buffer_view(buffer);
+	    if(view != NULL && view->stride != 1) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    data = gln_buffer_data(buffer);
+	    length = view != NULL ? view->length : buffer->size - GLN_BUFFER_OVERHEAD;
+	}
+	if(fwrite(&length, sizeof(uint64_t), 1, capture->file) != 1
+	   || (data != NULL && fwrite(data, 1, length, capture->file) != length)) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+int gln_capture_close(struct gln_capture *capture) {
+    int i;
+    int r = fclose(capture->file);
+    for(i = 0; i < capture->nsockets; i++) {
+	arcp_release(capture->sockets[i]);
+    }
+    free(capture->sockets);
+    free(capture);
+    return r == 0 ? 0 : -1;
+}
+
+/* Replay */
+
+struct gln_replay {
+    FILE *file;
+    int ninputs;
+    int noutputs;
+    struct gln_socket **sockets;
+    /* input sockets on an untyped node, connected to the outputs */
+    struct gln_node *sink;
+    struct gln_socket **sink_sockets;
+    void **buffers;
+    uint8_t *scratch;
+    size_t scratch_size;
+};
+
+/* Reads one recorded buffer into the scratch space; *length is
+ * GLN_CAPTURE_NULL for none. */
+static int gln_replay_read(struct gln_replay *replay, uint64_t *length) {
+    if(fread(length, sizeof(uint64_t), 1, replay->file) != 1) {
+	errno = EINVAL;
+	return -1;
+    }
+    if(*length == GLN_CAPTURE_NULL) {
+	return 0;
+    }
+    if(*length > replay->scratch_size) {
+	uint8_t *scratch = realloc(replay->scratch, *length);
+	if(scratch == NULL) {
+	    return -1;
+	}
+	replay->scratch = scratch;
+	replay->scratch_size = *length;
+    }
+    if(fread(replay->scratch, 1, *length, replay->file) != *length) {
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+/* Runs one recorded cycle; returns 1 when there are no more. */
+static int gln_replay_cycle(struct gln_replay *replay, struct gln_graph *graph, struct gln_replay_stats *stats) {
+    int i;
+    uint64_t recorded;
+    uint64_t length;
+    if(fread(&recorded, sizeof(uint64_t), 1, replay->file) != 1) {
+	if(feof(replay->file)) {
+	    return 1;
+	}
+	return -1;
+    }
+
+    for(i = 0; i < replay->ninputs; i++) {
+	struct gln_socket *socket = replay->sockets[i];
+	if(gln_replay_read(replay, &length) != 0) {
+	    return -1;
+	}
+	if(length == GLN_CAPTURE_NULL) {
+	    arcp_store(&socket->buffer, NULL);
+	} else {
+	    void *buffer = gln_alloc_buffer(socket, length);
+	    if(buffer == NULL) {
+		return -1;
+	    }
+	    memcpy(buffer, replay->scratch, length);
+	}
+	/* Stand in for the node */
+	struct gln_node *node = (struct gln_node *) arcp_weakref_load(socket->node);
+	if(node != NULL) {
+	    atomic_store_explicit(&node->state, GLNN_FINISHED, memory_order_release);
+	    arcp_release(node);
+	}
+    }
+    /* Time the pull alone, as gln_capture_begin does */
+    uint64_t start = gln_now();
+    if(replay->noutputs > 0
+       && gln_get_buffer_list(replay->noutputs, replay->sink_sockets, replay->buffers) != 0) {
+	return -1;
+    }
+    uint64_t elapsed = gln_now() - start;
+
+    bool mismatch = false;
+    for(i = 0; i < replay->noutputs; i++) {
+	if(gln_replay_read(replay, &length) != 0) {
+	    return -1;
+	}
+	size_t replayed_length;
+	size_t stride;
+	gln_get_buffer_shape(replay->sink_sockets[i], &replayed_length, &stride);
+	if(length == GLN_CAPTURE_NULL) {
+	    mismatch = mismatch || replay->buffers[i] != NULL;
+	} else if(replay->buffers[i] == NULL || stride != 1 || replayed_length != length
+		  || memcmp(replay->buffers[i], replay->scratch, length) != 0) {
+	    mismatch = true;
+	}
+    }
+    gln_graph_reset(graph);
+
+    stats->cycles++;
+    if(mismatch) {
+	stats->mismatches++;
+    }
+    stats->recorded_ns += recorded;
+    if(recorded > stats->recorded_max_ns) {
+	stats->recorded_max_ns = recorded;
+    }
+    stats->replayed_ns += elapsed;
+    if(elapsed > stats->replayed_max_ns) {
+	stats->replayed_max_ns = elapsed;
+    }
+    return 0;
+}
+
+int gln_replay(const char *snapshot_path, const char *path, int nthreads, struct gln_replay_stats *stats) {
+    int r = -1;
+    int i, error;
+    struct gln_replay replay;
+    struct gln_scheduler *scheduler = NULL;
+    memset(&replay, 0, sizeof(replay));
+    memset(stats, 0, sizeof(struct gln_replay_stats));
+
+    struct gln_graph *graph = gln_graph_load_mmap(snapshot_path);
+    if(graph == NULL) {
+	return -1;
+    }
+    replay.file = fopen(path, "rb");
+    if(replay.file == NULL) {
+	goto out;
+    }
+    struct gln_capture_header header;
+    if(fread(&header, sizeof(header), 1, replay.file) != 1
+       || memcmp(header.magic, GLN_CAPTURE_MAGIC, sizeof(GLN_CAPTURE_MAGIC)) != 0
+       || header.byteorder != GLN_CAPTURE_BYTEORDER) {
+	errno = EINVAL;
+	goto out;
+    }
+    if(header.version != GLN_CAPTURE_VERSION) {
+	errno = ENOTSUP;
+	goto out;
+    }
+    replay.ninputs = header.ninputs;
+    replay.noutputs = header.noutputs;
+    int nsockets = replay.ninputs + replay.noutputs;
+    replay.sockets = calloc(nsockets + 1, sizeof(struct gln_socket *));
+    replay.sink_sockets = calloc(replay.noutputs + 1, sizeof(struct gln_socket *));
+    replay.buffers = malloc(sizeof(void *) * (replay.noutputs + 1));
+    replay.sink = gln_node_create(graph, NULL);
+    if(replay.sockets == NULL || replay.sink_sockets == NULL || replay.buffers == NULL || replay.sink == NULL) {
+	goto out;
+    }
+    for(i = 0; i < nsockets; i++) {
+	struct gln_capture_socket record;
+	if(fread(&record, sizeof(record), 1, replay.file) != 1) {
+	    errno = EINVAL;
+	    goto out;
+	}
+	struct gln_node *node = gln_graph_get_node(graph, record.node);
+	if(node == NULL) {
+	    errno = EINVAL;
+	    goto out;
+	}
+	replay.sockets[i] = gln_node_socket(node, record.socket);
+	arcp_release(node);
+	if(replay.sockets[i] == NULL || replay.sockets[i]->direction != GLNS_OUTPUT) {
+	    errno = EINVAL;
+	    goto out;
+	}
+    }
+    for(i = 0; i < replay.noutputs; i++) {
+	replay.sink_sockets[i] = gln_socket_create(replay.sink, GLNS_INPUT);
+	if(replay.sink_sockets[i] == NULL
+	   || gln_socket_connect(replay.sockets[replay.ninputs + i], replay.sink_sockets[i]) != 0) {
+	    goto out;
+	}
+    }
+
+    if(nthreads > 0) {
+	scheduler = gln_scheduler_create(nthreads);
+	if(scheduler == NULL) {
+	    goto out;
+	}
+	if(gln_scheduler_attach(scheduler, graph, NULL) != 0) {
+	    arcp_release(scheduler);
+	    scheduler = NULL;
+	    goto out;
+	}
+    }
+
+    while((r = gln_replay_cycle(&replay, graph, stats)) == 0) {
+	continue;
+    }
+    if(r == 1) {
+	r = 0;
+    }
+
+out:
+    error = errno;
+    if(scheduler != NULL) {
+	gln_scheduler_detach(scheduler, graph);
+	arcp_release(scheduler);
+    }
+    if(replay.sink_sockets != NULL) {
+	for(i = 0; i < replay.noutputs; i++) {
+	    arcp_release(replay.sink_sockets[i]);
+	}
+    }
+    arcp_release(replay.sink);
+    free(replay.sink_sockets);
+    free(replay.sockets);
+    free(replay.buffers);
+    free(replay.scratch);
+    if(replay.file != NULL) {
+	fclose(replay.file);
+    }
+    arcp_release(graph);
+    errno = error;
+    return r;
+}
@@ -0,0 +1,43 @@
+/*
+ * futex.h
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLN_FUTEX_H
+#define GLN_FUTEX_H
+
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <atomickit/atomic.h>
+
+/* Blocks while *addr == val.  shared must be true for words that live
+ * in memory mapped by more than one process. */
+static inline int gln_futex_wait(volatile atomic_uint *addr, unsigned int val, bool shared,
+				 const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,
+		   val, timeout, NULL, 0);
+}
+
+static inline int gln_futex_wake(volatile atomic_uint *addr, int count, bool shared) {
+    return syscall(SYS_futex, addr, shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,
+		   count, NULL, NULL, 0);
+}
+
+#endif /* ! GLN_FUTEX_H */
@@ -19,30 +19,103 @@
  */
 #include <errno.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <alloca.h>
+#include <time.h>
+#include <limits.h>
 #include <atomickit/atomic-array.h>
 #include <atomickit/atomic-rcp.h>
 #include <atomickit/atomic-queue.h>
 #include "graphline.h"
+#include "private.h"
+#include "futex.h"
+#include "probes.h"
+
+__thread bool gln_profiling = false;
+
+/* The node being profiled on this thread, and the time it has spent
+ * waiting on its inputs. */
+struct gln_profile_frame {
+    struct gln_node *node;
+    uint64_t pulled;
+    struct gln_profile_frame *up;
+};
+
+static __thread struct gln_profile_frame *gln_profile_top = NULL;
+
+/* Transactions retried after a conflict */
+static volatile atomic_ullong gln_connect_retries;
+static volatile atomic_ullong gln_disconnect_retries;
+static volatile atomic_ullong gln_pull_retries;
+
+uint64_t gln_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Releases the nodes retired from an owned graph */
+static void gln_graph_release_retired(struct gln_graph *graph) {
+    struct gln_node *node = (struct gln_node *) atomic_exchange_explicit(&graph->retired, 0, memory_order_acquire);
+    while(node != NULL) {
+	struct gln_node *next = node->retired_next;
+	arcp_release(node);
+	node = next;
+    }
+}
 
 void gln_graph_destroy(struct gln_graph *graph) {
-    arcp_store(&graph->nodes, NULL);
+    arcp_store(&graph->failed, NULL);
+    gln_registry_destroy(&graph->owned);
+    gln_graph_release_retired(graph);
+    arcp_store(&graph->loaded, NULL);
+    gln_registry_destroy(&graph->nodes);
     aqueue_destroy(&graph->proc_queue);
+    arcp_store(&graph->sched.bell, NULL);
+    gln_memstat_release(graph->mem);
 }
 
 static void __gln_graph_destroy(struct gln_graph *graph) {
     gln_graph_destroy(graph);
-    afree(graph, sizeof(struct gln_graph *));
+    afree(graph, sizeof(struct gln_graph));
 }
 
 int gln_graph_init(struct gln_graph *graph, void (*destroy)(struct gln_graph *)) {
     int r = -1;
-    struct aary *empty_array = aary_create(0);
-    if(empty_array == NULL) {
+    graph->mem = gln_memstat_create(NULL);
+    if(graph->mem == NULL) {
 	goto undo0;
     }
-    arcp_init(&graph->nodes, empty_array);
-    arcp_release(empty_array);
+    gln_registry_init(&graph->nodes);
+    arcp_init(&graph->loaded, NULL);
+    atomic_init(&graph->sched.scheduler, 0);
+    arcp_init(&graph->sched.bell, NULL);
+    atomic_init(&graph->sched.queued, 0);
+    graph->sched.class = GLN_SCHED_NORMAL;
+    graph->sched.weight = GLN_SCHED_WEIGHT_DEFAULT;
+    graph->sched.load = 0;
+    atomic_init(&graph->sched.vruntime, 0);
+    atomic_init(&graph->sched.cpu_time, 0);
+    atomic_init(&graph->sched.nodes_run, 0);
+    atomic_init(&graph->sched.affinity_hits, 0);
+    atomic_init(&graph->sched.affinity_misses, 0);
+    graph->policy = GLN_POLICY_FIFO;
+    graph->instances = 1;
+    graph->flags = 0;
+    gln_registry_init(&graph->owned);
+    atomic_init(&graph->retired, 0);
+    atomic_init(&graph->cancelled, false);
+    atomic_init(&graph->reported, false);
+    arcp_init(&graph->failed, NULL);
+    graph->failed_errno = 0;
+    atomic_init(&graph->progress, 0);
+    atomic_init(&graph->waiters, 0);
+    graph->timeout = 0;
+    graph->quarantine_after = 0;
+    graph->overrun = NULL;
+    graph->overrun_arg = NULL;
+    graph->latency_mark = 0;
     r = aqueue_init(&graph->proc_queue);
     if(r != 0) {
 	goto undo1;
@@ -57,7 +130,7 @@ int gln_graph_init(struct gln_graph *graph, void (*destroy)(struct gln_graph *))
 undo2:
     aqueue_destroy(&graph->proc_queue);
 undo1:
-    arcp_store(&graph->nodes, NULL);
+    gln_memstat_release(graph->mem);
 undo0:
     return r;
 }
@@ -79,39 +152,142 @@ struct gln_graph *gln_graph_create() {
     return ret;
 }
 
+void gln_graph_release(struct gln_graph *graph) {
+    arcp_release(graph);
+}
+
+/* Owned graphs keep their nodes alive, so there's no need for weak
+ * references; anything retired since the last reset is released
+ * now. */
+static void gln_graph_reset_owned(struct gln_graph *graph) {
+    size_t end = gln_registry_end(&graph->owned);
+    size_t i;
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = (struct gln_node *) gln_registry_load_phantom(&graph->owned, i);
+	/* A node left running past a timeout stays out of this cycle */
+	if(node != NULL && !atomic_load_explicit(&node->running, memory_order_acquire)) {
+	    atomic_store_explicit(&node->state, GLNN_READY, memory_order_relaxed);
+	}
+    }
+    atomic_thread_fence(memory_order_release);
+    gln_graph_release_retired(graph);
+}
+
 void gln_graph_reset(struct gln_graph *graph) {
-    struct aary *node_array = (struct aary *) arcp_load(&graph->nodes);
+    GLN_PROBE1(graph_reset, graph);
+    if(atomic_load_explicit(&graph->cancelled, memory_order_acquire)) {
+	/* Drop whatever the cancelled cycle left queued */
+	struct gln_node *node;
+	while((node = gln_graph_dequeue(graph)) != NULL) {
+	    arcp_release(node);
+	}
+	arcp_store(&graph->failed, NULL);
+	atomic_store(&graph->reported, false);
+	atomic_store(&graph->cancelled, false);
+    }
+    if(graph->flags & GLN_GRAPH_OWNED) {
+	gln_graph_reset_owned(graph);
+	return;
+    }
+    size_t end = gln_registry_end(&graph->nodes);
     size_t i;
-    for(i = 0; i < aary_length(node_array); i++) {
-	struct gln_node *node = (struct gln_node *) arcp_weakref_load((struct arcp_weakref *) aary_load_phantom(node_array, i));
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
 	if(node == NULL) {
 	    continue;
 	}
-	atomic_store(&node->state, GLNN_READY);
+	if(!atomic_load_explicit(&node->running, memory_order_acquire)) {
+	    atomic_store(&node->state, GLNN_READY);
+	}
 	arcp_release(node);
     }
-    arcp_release(node_array);
 }
 
+struct gln_node *gln_graph_load_node(struct gln_graph *graph, size_t index) {
+    struct arcp_weakref *weakref = (struct arcp_weakref *) gln_registry_load(&graph->nodes, index);
+    if(weakref == NULL) {
+	return NULL;
+    }
+    struct gln_node *node = (struct gln_node *) arcp_weakref_load(weakref);
+    arcp_release(weakref);
+    return node;
+}
+
+void gln_graph_set_policy(struct gln_graph *graph, enum gln_graph_policy policy) {
+    graph->policy = policy;
+}
+
+void gln_graph_set_overrun_handler(struct gln_graph *graph, gln_overrun_fp_t overrun, void *arg,
+				   unsigned int quarantine_after) {
+    graph->overrun = overrun;
+    graph->overrun_arg = arg;
+    graph->quarantine_after = quarantine_after;
+}
+
+void gln_graph_set_timeout(struct gln_graph *graph, uint64_t timeout) {
+    graph->timeout = timeout;
+}
+
+int gln_graph_set_flags(struct gln_graph *graph, unsigned int flags) {
+    if(gln_registry_count(&graph->nodes) != 0) {
+	errno = EBUSY;
+	return -1;
+    }
+    if(flags & GLN_GRAPH_SINGLE_THREADED) {
+	flags |= GLN_GRAPH_OWNED;
+    }
+    graph->flags = flags;
+    return 0;
+}
+
+int gln_graph_remove_node(struct gln_graph *graph, struct gln_node *node) {
+    if(!(graph->flags & GLN_GRAPH_OWNED)) {
+	errno = EINVAL;
+	return -1;
+    }
+    if(atomic_exchange_explicit(&node->retiring, true, memory_order_relaxed)) {
+	/* Already removed */
+	return 0;
+    }
+    /* Retire first, so the node is never without a reference.  The
+     * list is only ever pushed to and taken whole, so there's no
+     * ABA. */
+    gln_acquire(node);
+    uintptr_t head = atomic_load_explicit(&graph->retired, memory_order_relaxed);
+    do {
+	node->retired_next = (struct gln_node *) head;
+    } while(!atomic_compare_exchange_weak_explicit(&graph->retired, &head, (uintptr_t) node,
+						   memory_order_release, memory_order_relaxed));
+    gln_registry_remove(&graph->owned, node->owned_slot, (struct arcp_region *) node);
+    return 0;
+}
+
+static void gln_ports_release(struct gln_ports *ports);
+
 void gln_node_destroy(struct gln_node *node) {
+    if(node->ports != NULL) {
+	gln_ports_release(node->ports);
+	node->ports = NULL;
+    }
+    gln_event_release(node, (struct gln_event *) atomic_exchange(&node->events, 0));
+    gln_event_release(node, node->pending);
+    node->pending = NULL;
+    arcp_store(&node->memo, NULL);
+    arcp_store(&node->outputs, NULL);
+    if(node->instance_state != NULL) {
+	afree(node->instance_state, GLN_LANE_STRIDE(node->instance_state_size) * node->instances);
+	node->instance_state = NULL;
+    }
+    arcp_store(&node->deps, NULL);
+    gln_mem_credit(node->mem, GLN_MEM_TOPOLOGY, GLN_MEM_WEAKREF + GLN_MEM_LIST_ENTRY);
+    gln_memstat_release(node->mem);
     /* Try and remove our weak reference from the associated graph */
     struct gln_graph *graph = (struct gln_graph *) arcp_weakref_load(node->graph);
     arcp_release(node->graph);
     if(graph == NULL) {
 	return;
     }
-    struct arcp_weakref *weakref = arcp_weakref_phantom(node);
-    struct aary *node_list;
-    struct aary *new_node_list;
-    do {
-	node_list = (struct aary *) arcp_load(&graph->nodes);
-	new_node_list = aary_dup_set_remove(node_list, weakref);
-	if(new_node_list == NULL) {
-	    /* Give up */
-	    arcp_release(node_list);
-	    break;
-	}
-    } while(!arcp_compare_store_release(&graph->nodes, node_list, new_node_list));
+    gln_registry_remove(&graph->nodes, node->slot, (struct arcp_region *) arcp_weakref_phantom(node));
     arcp_release(graph);
 }
 
@@ -121,34 +297,79 @@ static void __gln_node_destroy(struct gln_node *node) {
 }
 
 int gln_node_init(struct gln_node *node, struct gln_graph *graph, gln_process_fp_t process, void (*destroy)(struct gln_node *)) {
-    int r;
+    int r = -1;
+    node->mem = gln_memstat_create(graph->mem);
+    if(node->mem == NULL) {
+	goto undo0;
+    }
+    r = gln_mem_charge(node->mem, GLN_MEM_TOPOLOGY, GLN_MEM_WEAKREF + GLN_MEM_LIST_ENTRY);
+    if(r != 0) {
+	goto undo1;
+    }
     node->graph = arcp_weakref(graph);
+    node->owner = graph;
+    node->flags = graph->flags;
     node->process = process;
+    node->type = NULL;
+    node->instances = graph->instances;
+    node->instance_state_size = 0;
+    node->instance_state = NULL;
+    node->cost = 0;
+    node->profiled = 0;
+    arcp_init(&node->deps, NULL);
+    atomic_init(&node->events, 0);
+    node->pending = NULL;
+    node->ports = NULL;
+    arcp_init(&node->outputs, NULL);
+    node->latency = 0;
+    node->input_latency = 0;
+    node->path_latency = 0;
+    node->latency_mark = 0;
+    atomic_init(&node->worker, -1);
+    atomic_init(&node->retiring, false);
+    node->retired_next = NULL;
+    arcp_init(&node->memo, NULL);
+    node->budget = 0;
+    atomic_init(&node->started, 0);
+    atomic_init(&node->running, false);
+    atomic_init(&node->reported, 0);
+    node->overruns = 0;
+    atomic_init(&node->quarantined, false);
     atomic_init(&node->state, GLNN_READY);
     arcp_region_init(node, (void (*)(struct arcp_region *)) destroy);
     r = arcp_region_init_weakref(node);
     if(r != 0) {
-	goto undo1;
+	goto undo2;
     }
     struct arcp_weakref *weakref = arcp_weakref_phantom(node);
-    struct aary *node_list;
-    struct aary *new_node_list;
-    do {
-	node_list = (struct aary *) arcp_load(&graph->nodes);
-	new_node_list = aary_dup_set_add(node_list, weakref);
-	if(new_node_list == NULL) {
-	    arcp_release(node_list);
+    ssize_t slot = gln_registry_add(&graph->nodes, (struct arcp_region *) weakref);
+    if(slot < 0) {
+	r = -1;
+	goto undo3;
+    }
+    node->slot = slot;
+
+    if(node->flags & GLN_GRAPH_OWNED) {
+	slot = gln_registry_add(&graph->owned, (struct arcp_region *) node);
+	if(slot < 0) {
 	    r = -1;
-	    goto undo2;
+	    goto undo4;
 	}
-    } while(!arcp_compare_store_release(&graph->nodes, node_list, new_node_list));
+	node->owned_slot = slot;
+    }
 
     return 0;
 
-undo2:
+undo4:
+    gln_registry_remove(&graph->nodes, node->slot, (struct arcp_region *) weakref);
+undo3:
     arcp_region_destroy_weakref(node);
-undo1:
+undo2:
     arcp_release(node->graph);
+    gln_mem_credit(node->mem, GLN_MEM_TOPOLOGY, GLN_MEM_WEAKREF + GLN_MEM_LIST_ENTRY);
+undo1:
+    gln_memstat_release(node->mem);
+undo0:
     return r;
 }
 
@@ -169,12 +390,326 @@ struct gln_node *gln_node_create(struct gln_graph *graph, gln_process_fp_t proce
     return ret;
 }
 
+int gln_node_create_list(struct gln_graph *graph, size_t count, gln_process_fp_t process, struct gln_node **nodes) {
+    size_t i;
+    for(i = 0; i < count; i++) {
+	nodes[i] = gln_node_create(graph, process);
+	if(nodes[i] == NULL) {
+	    gln_node_release_list(i, nodes);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+void gln_node_release_list(size_t count, struct gln_node **nodes) {
+    size_t i;
+    for(i = 0; i < count; i++) {
+	if(nodes[i]->flags & GLN_GRAPH_OWNED) {
+	    gln_graph_remove_node(nodes[i]->owner, nodes[i]);
+	}
+	arcp_release(nodes[i]);
+    }
+}
+
+struct gln_ext_node {
+    struct gln_node;
+    int (*ext_process)(void *data);
+    void (*finalize)(void *data);
+    size_t size;
+    uint8_t data[] __attribute__((aligned(GLN_BUFFER_ALIGN)));
+};
+
+static int gln_ext_node_process(struct gln_ext_node *node) {
+    return node->ext_process(node->data);
+}
+
+static void __gln_ext_node_destroy(struct gln_ext_node *node) {
+    if(node->finalize != NULL) {
+	node->finalize(node->data);
+    }
+    gln_node_destroy(node);
+    afree(node, sizeof(struct gln_ext_node) + node->size);
+}
+
+struct gln_node *gln_node_create_ext(struct gln_graph *graph, size_t size,
+				     int (*process)(void *data), void (*finalize)(void *data)) {
+    struct gln_ext_node *ret = amalloc(sizeof(struct gln_ext_node) + size);
+    if(ret == NULL) {
+	return NULL;
+    }
+    ret->ext_process = process;
+    /* Nothing to finalize until the node is made */
+    ret->finalize = NULL;
+    ret->size = size;
+    memset(ret->data, 0, size);
+    if(gln_node_init(ret, graph, (gln_process_fp_t) gln_ext_node_process,
+		     (void (*)(struct gln_node *)) __gln_ext_node_destroy) != 0) {
+	afree(ret, sizeof(struct gln_ext_node) + size);
+	return NULL;
+    }
+    ret->finalize = finalize;
+    return ret;
+}
+
+void *gln_node_ext_data(struct gln_node *node) {
+    return ((struct gln_ext_node *) node)->data;
+}
+
+uintptr_t gln_node_transform(struct gln_node *node) {
+    if(node->process == (gln_process_fp_t) gln_ext_node_process) {
+	return (uintptr_t) ((struct gln_ext_node *) node)->ext_process;
+    }
+    return (uintptr_t) node->process;
+}
+
+int gln_node_post(struct gln_node *node, uint64_t time, const void *data, size_t size) {
+    size_t event_size = sizeof(struct gln_event) + size;
+    if(gln_mem_charge(node->mem, GLN_MEM_QUEUE, event_size) != 0) {
+	return -1;
+    }
+    struct gln_event *event = amalloc(event_size);
+    if(event == NULL) {
+	gln_mem_credit(node->mem, GLN_MEM_QUEUE, event_size);
+	return -1;
+    }
+    event->time = time;
+    event->size = size;
+    memcpy(event->data, data, size);
+    uintptr_t head = atomic_load_explicit(&node->events, memory_order_relaxed);
+    do {
+	event->next = (struct gln_event *) head;
+    } while(!atomic_compare_exchange_weak_explicit(&node->events, &head, (uintptr_t) event,
+						   memory_order_release, memory_order_relaxed));
+    return 0;
+}
+
+/* Stable merge sort by time. */
+static struct gln_event *gln_event_sort(struct gln_event *list) {
+    if(list == NULL || list->next == NULL) {
+	return list;
+    }
+    struct gln_event *slow = list;
+    struct gln_event *fast = list->next;
+    while(fast != NULL && fast->next != NULL) {
+	slow = slow->next;
+	fast = fast->next->next;
+    }
+    struct gln_event *b = gln_event_sort(slow->next);
+    slow->next = NULL;
+    struct gln_event *a = gln_event_sort(list);
+    struct gln_event *head = NULL;
+    struct gln_event **tail = &head;
+    while(a != NULL && b != NULL) {
+	if(b->time < a->time) {
+	    *tail = b;
+	    b = b->next;
+	} else {
+	    *tail = a;
+	    a = a->next;
+	}
+	tail = &(*tail)->next;
+    }
+    *tail = a != NULL ? a : b;
+    return head;
+}
+
+struct gln_event *gln_node_events(struct gln_node *node, uint64_t until) {
+    struct gln_event *posted = (struct gln_event *) atomic_exchange_explicit(&node->events, 0, memory_order_acquire);
+    if(posted != NULL) {
+	/* Newest first; put them back in posting order */
+	struct gln_event *reversed = NULL;
+	while(posted != NULL) {
+	    struct gln_event *next = posted->next;
+	    posted->next = reversed;
+	    reversed = posted;
+	    posted = next;
+	}
+	/* Anything still pending was posted earlier, so it goes first
+	 * among equals */
+	struct gln_event **tail = &node->pending;
+	while(*tail != NULL) {
+	    tail = &(*tail)->next;
+	}
+	*tail = reversed;
+	node->pending = gln_event_sort(node->pending);
+    }
+
+    struct gln_event *due = node->pending;
+    struct gln_event **tail = &due;
+    while(*tail != NULL && (*tail)->time < until) {
+	tail = &(*tail)->next;
+    }
+    node->pending = *tail;
+    *tail = NULL;
+    return due;
+}
+
+void gln_event_release(struct gln_node *node, struct gln_event *events) {
+    while(events != NULL) {
+	struct gln_event *next = events->next;
+	size_t event_size = sizeof(struct gln_event) + events->size;
+	gln_mem_credit(node->mem, GLN_MEM_QUEUE, event_size);
+	afree(events, event_size);
+	events = next;
+    }
+}
+
+void gln_node_set_budget(struct gln_node *node, uint64_t budget) {
+    node->budget = budget;
+    node->overruns = 0;
+    atomic_store_explicit(&node->quarantined, false, memory_order_release);
+}
+
+bool gln_node_quarantined(struct gln_node *node) {
+    return atomic_load_explicit(&node->quarantined, memory_order_acquire);
+}
+
+int gln_node_set_state_size(struct gln_node *node, size_t size) {
+    void *state = NULL;
+    if(size != 0) {
+	state = amalloc(GLN_LANE_STRIDE(size) * node->instances);
+	if(state == NULL) {
+	    return -1;
+	}
+	memset(state, 0, GLN_LANE_STRIDE(size) * node->instances);
+    }
+    if(node->instance_state != NULL) {
+	afree(node->instance_state, GLN_LANE_STRIDE(node->instance_state_size) * node->instances);
+    }
+    node->instance_state = state;
+    node->instance_state_size = size;
+    return 0;
+}
+
+int gln_graph_set_instances(struct gln_graph *graph, unsigned int instances) {
+    if(instances == 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    size_t count = gln_registry_end(&graph->nodes);
+    struct gln_node **nodes = malloc(sizeof(struct gln_node *) * (count + 1));
+    void **states = malloc(sizeof(void *) * (count + 1));
+    size_t i;
+    int r = -1;
+    if(nodes == NULL || states == NULL) {
+	free(nodes);
+	free(states);
+	return -1;
+    }
+
+    /* Allocate everything first, so failure leaves the graph as it
+     * was. */
+    for(i = 0; i < count; i++) {
+	nodes[i] = gln_graph_load_node(graph, i);
+	states[i] = NULL;
+	if(nodes[i] == NULL || nodes[i]->instance_state == NULL) {
+	    continue;
+	}
+	size_t stride = GLN_LANE_STRIDE(nodes[i]->instance_state_size);
+	states[i] = amalloc(stride * instances);
+	if(states[i] == NULL) {
+	    count = i + 1;
+	    goto undo;
+	}
+	if(instances > nodes[i]->instances) {
+	    memcpy(states[i], nodes[i]->instance_state, stride * nodes[i]->instances);
+	    memset((uint8_t *) states[i] + stride * nodes[i]->instances, 0, stride * (instances - nodes[i]->instances));
+	} else {
+	    memcpy(states[i], nodes[i]->instance_state, stride * instances);
+	}
+    }
+
+    for(i = 0; i < count; i++) {
+	if(nodes[i] == NULL) {
+	    continue;
+	}
+	if(states[i] != NULL) {
+	    afree(nodes[i]->instance_state, GLN_LANE_STRIDE(nodes[i]->instance_state_size) * nodes[i]->instances);
+	    nodes[i]->instance_state = states[i];
+	    states[i] = NULL;
+	}
+	nodes[i]->instances = instances;
+    }
+    graph->instances = instances;
+    r = 0;
+
+undo:
+    for(i = 0; i < count; i++) {
+	if(states[i] != NULL) {
+	    afree(states[i], GLN_LANE_STRIDE(nodes[i]->instance_state_size) * instances);
+	}
+	arcp_release(nodes[i]);
+    }
+    free(nodes);
+    free(states);
+    return r;
+}
+
+/* Output sockets are listed on their node, whatever created them, so
+ * that a skipped node can clear them all. */
+static int gln_node_add_output(struct gln_node *node, struct gln_socket *socket) {
+    struct arcp_region *weakref = (struct arcp_region *) arcp_weakref_phantom(socket);
+    struct aary *outputs;
+    struct aary *new_outputs;
+    do {
+	outputs = (struct aary *) arcp_load(&node->outputs);
+	if(outputs == NULL) {
+	    struct aary *empty_array = aary_create(0);
+	    if(empty_array == NULL) {
+		return -1;
+	    }
+	    new_outputs = aary_dup_set_add(empty_array, weakref);
+	    arcp_release(empty_array);
+	} else {
+	    new_outputs = aary_dup_set_add(outputs, weakref);
+	}
+	if(new_outputs == NULL) {
+	    arcp_release(outputs);
+	    return -1;
+	}
+    } while(!arcp_compare_store_release(&node->outputs, outputs, new_outputs));
+    return 0;
+}
+
+static void gln_node_remove_output(struct gln_node *node, struct gln_socket *socket) {
+    struct arcp_region *weakref = (struct arcp_region *) arcp_weakref_phantom(socket);
+    struct aary *outputs;
+    struct aary *new_outputs;
+    do {
+	outputs = (struct aary *) arcp_load(&node->outputs);
+	if(outputs == NULL) {
+	    return;
+	}
+	new_outputs = aary_dup_set_remove(outputs, weakref);
+	if(new_outputs == NULL) {
+	    /* Left listed; its weak reference just won't load */
+	    arcp_release(outputs);
+	    return;
+	}
+    } while(!arcp_compare_store_release(&node->outputs, outputs, new_outputs));
+}
+
 void gln_socket_destroy(struct gln_socket *socket) {
+    if(socket->direction == GLNS_OUTPUT) {
+	struct gln_node *node = (struct gln_node *) arcp_weakref_load(socket->node);
+	if(node != NULL) {
+	    gln_node_remove_output(node, socket);
+	    arcp_release(node);
+	}
+    }
     arcp_release(socket->node);
     arcp_store(&socket->buffer, NULL);
     /* try and remove ourselves from any other's lists. */
     gln_socket_disconnect(socket); /* ignore errors */
     atxn_destroy(&socket->other);
+    if(socket->delay != NULL) {
+	gln_delay_destroy(socket->delay);
+	socket->delay = NULL;
+    }
+    /* Whatever topology is still charged to us was ours alone */
+    gln_mem_credit(socket->mem, GLN_MEM_TOPOLOGY, gln_mem_live(socket->mem, GLN_MEM_TOPOLOGY));
+    gln_memstat_release(socket->mem);
 }
 
 static void __gln_socket_destroy(struct gln_socket *socket) {
@@ -185,34 +720,66 @@ static void __gln_socket_destroy(struct gln_socket *socket) {
 int gln_socket_init(struct gln_socket *socket, struct gln_node *node,
 		    enum gln_socket_direction direction, void (*destroy)(struct gln_socket *)) {
     int r = -1;
+    socket->mem = gln_memstat_create(node->mem);
+    if(socket->mem == NULL) {
+	goto undo0;
+    }
+    r = gln_mem_charge(socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_WEAKREF);
+    if(r != 0) {
+	goto undo1;
+    }
+    r = -1;
     if(direction == GLNS_OUTPUT) {
 	struct aary *empty_array = aary_create(0);
 	if(empty_array == NULL) {
-	    goto undo0;
+	    goto undo2;
 	}
 	r = atxn_init(&socket->other, empty_array);
 	if(r != 0) {
 	    arcp_release(empty_array);
-	    goto undo0;
+	    goto undo2;
 	}
     } else {
 	r = atxn_init(&socket->other, NULL);
 	if(r != 0) {
-	    goto undo0;
+	    goto undo2;
 	}
     }
     socket->node = arcp_weakref(node);
     socket->direction = direction;
+    socket->owner = node;
+    socket->flags = node->flags;
+    atomic_init(&socket->peer, 0);
+    socket->delay = NULL;
     arcp_init(&socket->buffer, NULL);
     arcp_region_init(socket, (void (*)(struct arcp_region *)) destroy);
     r = arcp_region_init_weakref(socket);
     if(r != 0) {
-	goto undo1;
+	goto undo3;
+    }
+    if(direction == GLNS_OUTPUT) {
+	r = gln_mem_charge(socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY);
+	if(r != 0) {
+	    goto undo4;
+	}
+	r = gln_node_add_output(node, socket);
+	if(r != 0) {
+	    goto undo5;
+	}
     }
     return 0;
 
-undo1:
+undo5:
+    gln_mem_credit(socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY);
+undo4:
+    arcp_region_destroy_weakref(socket);
+undo3:
     arcp_release(socket->node);
+    atxn_destroy(&socket->other);
+undo2:
+    gln_mem_credit(socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_WEAKREF);
+undo1:
+    gln_memstat_release(socket->mem);
 undo0:
     return r;
 }
@@ -234,22 +801,140 @@ struct gln_socket *gln_socket_create(struct gln_node *node, enum gln_socket_dire
     return ret;
 }
 
-int gln_socket_connect(struct gln_socket *socket, struct gln_socket *other) {
-    if(socket->direction != GLNS_OUTPUT) {
-	if(other->direction != GLNS_OUTPUT) {
-	    errno = EINVAL;
+int gln_socket_create_list(struct gln_node *node, enum gln_socket_direction direction,
+			   size_t count, struct gln_socket **sockets) {
+    size_t i;
+    for(i = 0; i < count; i++) {
+	sockets[i] = gln_socket_create(node, direction);
+	if(sockets[i] == NULL) {
+	    gln_socket_release_list(i, sockets);
 	    return -1;
 	}
-	struct gln_socket *tmp = socket;
-	socket = other;
-	other = tmp;
+    }
+    return 0;
+}
+
+void gln_socket_release_list(size_t count, struct gln_socket **sockets) {
+    size_t i;
+    for(i = 0; i < count; i++) {
+	arcp_release(sockets[i]);
+    }
+}
+
+/* Ports are sockets in one block, inputs first, followed by pointers
+ * to the inputs for gln_get_buffer_list.  The block goes when the last
+ * of its sockets does. */
+struct gln_port {
+    struct gln_socket;
+    struct gln_ports *ports;
+};
+
+struct gln_ports {
+    volatile atomic_uint live;
+    unsigned int ninputs;
+    unsigned int noutputs;
+    struct gln_socket **inputs;
+    struct gln_port sockets[];
+};
+
+static inline size_t gln_ports_size(unsigned int ninputs, unsigned int noutputs) {
+    return sizeof(struct gln_ports) + sizeof(struct gln_port) * (ninputs + noutputs)
+	+ sizeof(struct gln_socket *) * ninputs;
+}
+
+static void __gln_port_destroy(struct gln_port *port) {
+    struct gln_ports *ports = port->ports;
+    gln_socket_destroy(port);
+    if(atomic_fetch_sub_explicit(&ports->live, 1, memory_order_acq_rel) == 1) {
+	afree(ports, gln_ports_size(ports->ninputs, ports->noutputs));
+    }
+}
+
+static void gln_ports_release(struct gln_ports *ports) {
+    unsigned int count = ports->ninputs + ports->noutputs;
+    unsigned int i;
+    /* The last of these may free the block */
+    struct gln_port *sockets = ports->sockets;
+    for(i = 0; i < count; i++) {
+	arcp_release(&sockets[i]);
+    }
+}
+
+int gln_node_set_ports(struct gln_node *node, unsigned int ninputs, unsigned int noutputs) {
+    unsigned int i;
+    if(node->ports != NULL) {
+	errno = EBUSY;
+	return -1;
+    }
+    struct gln_ports *ports = amalloc(gln_ports_size(ninputs, noutputs));
+    if(ports == NULL) {
+	return -1;
+    }
+    atomic_init(&ports->live, 0);
+    ports->ninputs = ninputs;
+    ports->noutputs = noutputs;
+    ports->inputs = (struct gln_socket **) &ports->sockets[ninputs + noutputs];
+    for(i = 0; i < ninputs + noutputs; i++) {
+	struct gln_port *port = &ports->sockets[i];
+	port->ports = ports;
+	if(gln_socket_init(port, node, i < ninputs ? GLNS_INPUT : GLNS_OUTPUT,
+			   (void (*)(struct gln_socket *)) __gln_port_destroy) != 0) {
+	    goto undo;
+	}
+	atomic_fetch_add_explicit(&ports->live, 1, memory_order_relaxed);
+	if(i < ninputs) {
+	    ports->inputs[i] = port;
+	}
+    }
+    node->ports = ports;
+    return 0;
+
+undo:
+    if(i == 0) {
+	afree(ports, gln_ports_size(ninputs, noutputs));
     } else {
-	if(other->direction != GLNS_INPUT) {
-	    errno = EINVAL;
-	    return -1;
+	/* The last of those that made it frees the block */
+	unsigned int j;
+	for(j = 0; j < i; j++) {
+	    arcp_release(&ports->sockets[j]);
 	}
     }
+    return -1;
+}
+
+struct gln_socket *gln_node_input(struct gln_node *node, unsigned int index) {
+    if(node->ports == NULL || index >= node->ports->ninputs) {
+	return NULL;
+    }
+    return &node->ports->sockets[index];
+}
+
+struct gln_socket *gln_node_output(struct gln_node *node, unsigned int index) {
+    if(node->ports == NULL || index >= node->ports->noutputs) {
+	return NULL;
+    }
+    return &node->ports->sockets[node->ports->ninputs + index];
+}
 
+struct gln_socket *gln_node_socket(struct gln_node *node, int index) {
+    if(node->ports != NULL) {
+	return (unsigned int) index < node->ports->ninputs + node->ports->noutputs
+	    ? &node->ports->sockets[index] : NULL;
+    }
+    if(node->type != NULL) {
+	return node->type->socket(node, index);
+    }
+    return NULL;
+}
+
+int gln_node_get_inputs(struct gln_node *node, void **buffers) {
+    if(node->ports == NULL) {
+	return 0;
+    }
+    return gln_get_buffer_list(node->ports->ninputs, node->ports->inputs, buffers);
+}
+
+static int gln_socket_connect_txn(struct gln_socket *socket, struct gln_socket *other, bool *was_connected) {
     struct arcp_weakref *socket_weakref = arcp_weakref_phantom(socket);
     struct arcp_weakref *other_weakref = arcp_weakref_phantom(other);
     enum atxn_status r;
@@ -257,8 +942,14 @@ int gln_socket_connect(struct gln_socket *socket, struct gln_socket *other) {
     struct arcp_weakref *connected_weakref;
     struct gln_socket *connected_socket;
     struct aary *connection_list;
+    bool retried = false;
 
 retry_connect:
+    if(retried) {
+	atomic_fetch_add_explicit(&gln_connect_retries, 1, memory_order_relaxed);
+	GLN_PROBE1(connect_retry, socket);
+    }
+    retried = true;
     handle = atxn_start();
     if(handle == NULL) {
 	return -1;
@@ -273,6 +964,7 @@ retry_connect:
 	atxn_abort(handle);
 	return -1;
     }
+    *was_connected = connected_weakref != NULL;
 
     /* See if we were connected */
     if(connected_weakref == socket_weakref) {
@@ -357,6 +1049,37 @@ retry_connect:
     return 0;
 }
 
+int gln_socket_connect(struct gln_socket *socket, struct gln_socket *other) {
+    if(socket->direction != GLNS_OUTPUT) {
+	if(other->direction != GLNS_OUTPUT) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	struct gln_socket *tmp = socket;
+	socket = other;
+	other = tmp;
+    } else {
+	if(other->direction != GLNS_INPUT) {
+	    errno = EINVAL;
+	    return -1;
+	}
+    }
+
+    /* The input side is charged for its entry in the output's list */
+    bool was_connected = false;
+    if(gln_mem_charge(other->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY) != 0) {
+	return -1;
+    }
+    int r = gln_socket_connect_txn(socket, other, &was_connected);
+    if(r != 0 || was_connected) {
+	gln_mem_credit(other->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY);
+    }
+    if(r == 0) {
+	atomic_store_explicit(&other->peer, (uintptr_t) socket, memory_order_release);
+    }
+    return r;
+}
+
 int gln_socket_disconnect(struct gln_socket *socket) {
     struct arcp_weakref *socket_weakref = arcp_weakref_phantom(socket);
     enum atxn_status r;
@@ -364,10 +1087,16 @@ int gln_socket_disconnect(struct gln_socket *socket) {
     struct arcp_weakref *connected_weakref;
     struct gln_socket *connected_socket;
     struct aary *connection_list;
+    bool retried = false;
 
     if(socket->direction == GLNS_INPUT) {
 
     retry_disconnect_input:
+	if(retried) {
+	    atomic_fetch_add_explicit(&gln_disconnect_retries, 1, memory_order_relaxed);
+	    GLN_PROBE1(disconnect_retry, socket);
+	}
+	retried = true;
 	handle = atxn_start();
 	if(handle == NULL) {
 	    return -1;
@@ -435,9 +1164,19 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 	} else if(r != ATXN_SUCCESS) {
 	    return -1;
 	}
+	atomic_store_explicit(&socket->peer, 0, memory_order_release);
+	gln_mem_credit(socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY);
     } else {
+	/* Keep the old list, to credit each socket after commit */
+	arcp_t disconnected;
+	arcp_init(&disconnected, NULL);
 
     retry_disconnect_output:
+	if(retried) {
+	    atomic_fetch_add_explicit(&gln_disconnect_retries, 1, memory_order_relaxed);
+	    GLN_PROBE1(disconnect_retry, socket);
+	}
+	retried = true;
 	handle = atxn_start();
 	if(handle == NULL) {
 	    return -1;
@@ -450,14 +1189,16 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 	    goto retry_disconnect_output;
 	} else if(r != ATXN_SUCCESS) {
 	    atxn_abort(handle);
-	    return -1;
+	    goto fail_disconnect_output;
 	}
 
 	/* See if we're already disconnected */
 	if(aary_length(connection_list) == 0) {
 	    atxn_abort(handle);
+	    arcp_store(&disconnected, NULL);
 	    return 0;
 	}
+	arcp_store(&disconnected, connection_list);
 
 	/* Disconnect each socket */
 	size_t i;
@@ -470,7 +1211,7 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 		goto retry_disconnect_output;
 	    } else if(r != ATXN_SUCCESS) {
 		atxn_abort(handle);
-		return -1;
+		goto fail_disconnect_output;
 	    }
 	}
 
@@ -478,7 +1219,7 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 	connection_list = aary_create(0);
 	if(connection_list == NULL) {
 	    atxn_abort(handle);
-	    return -1;
+	    goto fail_disconnect_output;
 	}
 	r = atxn_store(handle, &socket->other, connection_list);
 	arcp_release(connection_list);
@@ -487,7 +1228,7 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 	    goto retry_disconnect_output;
 	} else if(r != ATXN_SUCCESS) {
 	    atxn_abort(handle);
-	    return -1;
+	    goto fail_disconnect_output;
 	}
 
 	/* commit */
@@ -495,34 +1236,80 @@ int gln_socket_disconnect(struct gln_socket *socket) {
 	if(r == ATXN_FAILURE) {
 	    goto retry_disconnect_output;
 	} else if(r != ATXN_SUCCESS) {
-	    return -1;
+	    goto fail_disconnect_output;
 	}
+
+	connection_list = (struct aary *) arcp_load_phantom(&disconnected);
+	for(i = 0; i < aary_length(connection_list); i++) {
+	    connected_socket = (struct gln_socket *) arcp_weakref_load((struct arcp_weakref *) aary_load_phantom(connection_list, i));
+	    if(connected_socket != NULL) {
+		atomic_store_explicit(&connected_socket->peer, 0, memory_order_release);
+		gln_mem_credit(connected_socket->mem, GLN_MEM_TOPOLOGY, GLN_MEM_LIST_ENTRY);
+		arcp_release(connected_socket);
+	    }
+	}
+	arcp_store(&disconnected, NULL);
+	return 0;
+
+    fail_disconnect_output:
+	arcp_store(&disconnected, NULL);
+	return -1;
     }
     return 0;
 }
 
-#define GLN_BUFFER_OVERHEAD (offsetof(struct gln_buffer, data))
-
-static void __destroy_gln_buffer(struct gln_buffer *buffer) {
-    afree(buffer, buffer->size);
+/* Buffers from gln_alloc_buffer remember who paid for them. */
+struct gln_heap_buffer {
+    struct gln_memstat *mem;
+    struct gln_buffer buffer;
+};
+
+#define GLN_HEAP_BUFFER_OVERHEAD (offsetof(struct gln_heap_buffer, buffer))
+
+static void __destroy_gln_buffer(struct gln_buffer *buffer) {
+    struct gln_heap_buffer *heapbuf = (struct gln_heap_buffer *) ((uint8_t *) buffer - GLN_HEAP_BUFFER_OVERHEAD);
+    size_t size = buffer->size + GLN_HEAP_BUFFER_OVERHEAD;
+    gln_mem_credit(heapbuf->mem, GLN_MEM_BUFFER, size);
+    gln_memstat_release(heapbuf->mem);
+    afree(heapbuf, size);
+}
+
+struct gln_buffer *gln_buffer_create(struct gln_memstat *mem, size_t size) {
+    size += GLN_BUFFER_OVERHEAD;
+    if(gln_mem_charge(mem, GLN_MEM_BUFFER, size + GLN_HEAP_BUFFER_OVERHEAD) != 0) {
+	return NULL;
+    }
+    struct gln_heap_buffer *heapbuf = amalloc(size + GLN_HEAP_BUFFER_OVERHEAD);
+    if(heapbuf == NULL) {
+	gln_mem_credit(mem, GLN_MEM_BUFFER, size + GLN_HEAP_BUFFER_OVERHEAD);
+	return NULL;
+    }
+    heapbuf->mem = gln_memstat_acquire(mem);
+    struct gln_buffer *buffer = &heapbuf->buffer;
+    buffer->size = size;
+    arcp_region_init(buffer, (void (*)(struct arcp_region *)) __destroy_gln_buffer);
+    return buffer;
+}
+
+bool gln_buffer_heap(struct gln_buffer *buffer) {
+    return buffer->destroy == (void (*)(struct arcp_region *)) __destroy_gln_buffer;
 }
 
 void *gln_alloc_buffer(struct gln_socket *socket, size_t size) {
-    size += GLN_BUFFER_OVERHEAD;
     struct gln_buffer *buffer = (struct gln_buffer *) arcp_load_phantom(&socket->buffer);
     if(buffer != NULL
        && buffer->destroy == (void (*)(struct arcp_region *)) __destroy_gln_buffer
-       && buffer->size == size) {
+       && buffer->size == size + GLN_BUFFER_OVERHEAD) {
+	GLN_PROBE2(buffer_reuse, socket, size);
 	return &buffer->data;
     }
-    buffer = amalloc(size);
+    buffer = gln_buffer_create(socket->mem, size);
     if(buffer == NULL) {
 	return NULL;
     }
-    buffer->size = size;
-    arcp_region_init(buffer, (void (*)(struct arcp_region *)) __destroy_gln_buffer);
     arcp_store(&socket->buffer, buffer);
     arcp_release(buffer);
+    GLN_PROBE2(buffer_alloc, socket, size);
     return &buffer->data;
 }
 
@@ -531,6 +1318,309 @@ void gln_set_buffer(struct gln_socket *socket, void *buffer) {
     arcp_store(&socket->buffer, glnbuffer);
 }
 
+struct gln_buffer *gln_socket_buffer(struct gln_socket *socket) {
+    struct gln_buffer *buffer = (struct gln_buffer *) arcp_load_phantom(&socket->buffer);
+    if(buffer == NULL && socket->direction == GLNS_INPUT && (socket->flags & GLN_GRAPH_OWNED)) {
+	struct gln_socket *peer = (struct gln_socket *) atomic_load_explicit(&socket->peer, memory_order_acquire);
+	if(peer != NULL) {
+	    buffer = (struct gln_buffer *) arcp_load_phantom(&peer->buffer);
+	}
+    }
+    return buffer;
+}
+
+void __gln_view_buffer_destroy(struct gln_buffer *buffer) {
+    struct gln_view_buffer *view = gln_buffer_view(buffer);
+    arcp_release(view->parent);
+    gln_mem_credit(view->mem, GLN_MEM_BUFFER, sizeof(struct gln_view_buffer));
+    gln_memstat_release(view->mem);
+    afree(view, sizeof(struct gln_view_buffer));
+}
+
+int gln_set_buffer_view(struct gln_socket *socket, struct gln_socket *source,
+			size_t offset, size_t length, size_t stride) {
+    struct gln_buffer *parent = gln_socket_buffer(source);
+    if(parent == NULL) {
+	arcp_store(&socket->buffer, NULL);
+	return 0;
+    }
+    uint8_t *data = parent->data;
+    size_t parent_length = parent->size - GLN_BUFFER_OVERHEAD;
+    size_t parent_stride = 1;
+    struct gln_view_buffer *parent_view = gln_buffer_view(parent);
+    if(parent_view != NULL) {
+	data = parent_view->data;
+	parent_length = parent_view->length;
+	parent_stride = parent_view->stride;
+	parent = parent_view->parent;
+    }
+    if(length == 0 || stride == 0 || offset >= parent_length
+       || (length - 1) > (parent_length - 1 - offset) / stride) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    if(gln_mem_charge(socket->mem, GLN_MEM_BUFFER, sizeof(struct gln_view_buffer)) != 0) {
+	return -1;
+    }
+    struct gln_view_buffer *view = amalloc(sizeof(struct gln_view_buffer));
+    if(view == NULL) {
+	gln_mem_credit(socket->mem, GLN_MEM_BUFFER, sizeof(struct gln_view_buffer));
+	return -1;
+    }
+    view->mem = gln_memstat_acquire(socket->mem);
+    view->parent = (struct gln_buffer *) gln_acquire(parent);
+    view->data = data + offset * parent_stride;
+    view->length = length;
+    view->stride = stride * parent_stride;
+    view->buffer.size = GLN_BUFFER_OVERHEAD;
+    arcp_region_init(&view->buffer, (void (*)(struct arcp_region *)) __gln_view_buffer_destroy);
+    arcp_store(&socket->buffer, &view->buffer);
+    arcp_release(&view->buffer);
+    return 0;
+}
+
+void gln_get_buffer_shape(struct gln_socket *socket, size_t *length, size_t *stride) {
+    struct gln_buffer *buffer = gln_socket_buffer(socket);
+    struct gln_view_buffer *view;
+    if(buffer == NULL) {
+	*length = 0;
+	*stride = 0;
+    } else if((view = gln_buffer_view(buffer)) != NULL) {
+	*length = view->length;
+	*stride = view->stride;
+    } else {
+	*length = buffer->size - GLN_BUFFER_OVERHEAD;
+	*stride = 1;
+    }
+}
+
+int gln_graph_enqueue(struct gln_graph *graph, struct gln_node *node) {
+    int r = aqueue_enq(&graph->proc_queue, node);
+    if(r != 0) {
+	return r;
+    }
+    atomic_fetch_add_explicit(&graph->sched.queued, 1, memory_order_relaxed);
+    GLN_PROBE2(node_enqueue, graph, node);
+    gln_graph_signal(graph);
+    struct gln_sched_bell *bell = (struct gln_sched_bell *) arcp_load(&graph->sched.bell);
+    if(bell != NULL) {
+	gln_sched_bell_ring(bell);
+	arcp_release(bell);
+    }
+    return 0;
+}
+
+struct gln_node *gln_graph_dequeue(struct gln_graph *graph) {
+    struct gln_node *node = (struct gln_node *) aqueue_deq(&graph->proc_queue);
+    if(node != NULL) {
+	atomic_fetch_sub_explicit(&graph->sched.queued, 1, memory_order_relaxed);
+	GLN_PROBE2(node_dequeue, graph, node);
+    }
+    return node;
+}
+
+/* Records that node pulled from dep. */
+static void gln_profile_dep(struct gln_node *node, struct gln_node *dep) {
+    struct arcp_weakref *weakref = arcp_weakref_phantom(dep);
+    struct aary *deps;
+    struct aary *new_deps;
+    size_t i;
+    do {
+	deps = (struct aary *) arcp_load(&node->deps);
+	if(deps == NULL) {
+	    struct aary *empty_array = aary_create(0);
+	    if(empty_array == NULL) {
+		return;
+	    }
+	    new_deps = aary_dup_set_add(empty_array, weakref);
+	    arcp_release(empty_array);
+	} else {
+	    for(i = 0; i < aary_length(deps); i++) {
+		if(aary_load_phantom(deps, i) == (struct arcp_region *) weakref) {
+		    arcp_release(deps);
+		    return;
+		}
+	    }
+	    new_deps = aary_dup_set_add(deps, weakref);
+	}
+	if(new_deps == NULL) {
+	    arcp_release(deps);
+	    return;
+	}
+    } while(!arcp_compare_store_release(&node->deps, deps, new_deps));
+}
+
+/* Runs the node, keeping a running mean of the time it takes, not
+ * counting time spent pulling its inputs. */
+static int gln_node_process_profiled(struct gln_node *node) {
+    struct gln_profile_frame frame = { node, 0, gln_profile_top };
+    gln_profile_top = &frame;
+    uint64_t start = gln_now();
+    int r = node->process(node);
+    uint64_t elapsed = gln_now() - start;
+    gln_profile_top = frame.up;
+    elapsed = elapsed > frame.pulled ? elapsed - frame.pulled : 0;
+    node->cost = (node->cost * node->profiled + elapsed) / (node->profiled + 1);
+    node->profiled++;
+    return r;
+}
+
+void gln_node_run(struct gln_node *node) {
+    int r;
+    /* gln_graph_reset leaves the node be until its final state is in */
+    atomic_store_explicit(&node->running, true, memory_order_relaxed);
+    struct gln_memo_cache *memo = (struct gln_memo_cache *) arcp_load_phantom(&node->memo);
+    struct gln_memo_key key;
+    if(memo != NULL && gln_memo_lookup(memo, node, &key)) {
+	atomic_store_explicit(&node->state, GLNN_FINISHED, memory_order_release);
+	atomic_store_explicit(&node->running, false, memory_order_release);
+	return;
+    }
+    GLN_PROBE1(process_begin, node);
+    if(gln_profiling) {
+	r = gln_node_process_profiled(node);
+    } else {
+	r = node->process(node);
+    }
+    if(r != 0) {
+	atomic_store_explicit(&node->state, GLNN_ERROR, memory_order_release);
+	GLN_PROBE2(process_end, node, GLNN_ERROR);
+    } else {
+	if(memo != NULL) {
+	    gln_memo_store(memo, node, &key);
+	}
+	atomic_store_explicit(&node->state, GLNN_FINISHED, memory_order_release);
+	GLN_PROBE2(process_end, node, GLNN_FINISHED);
+    }
+    atomic_store_explicit(&node->running, false, memory_order_release);
+}
+
+void gln_graph_signal(struct gln_graph *graph) {
+    atomic_fetch_add(&graph->progress, 1);
+    if(atomic_load(&graph->waiters) != 0) {
+	gln_futex_wake(&graph->progress, INT_MAX, false);
+    }
+}
+
+int gln_graph_wait(struct gln_graph *graph, struct gln_node *node, uint64_t *deadline) {
+    int r = 0;
+    atomic_fetch_add(&graph->waiters, 1);
+    unsigned int seq = atomic_load(&graph->progress);
+    /* Anything that changes after this bumps progress, so the wait
+     * returns at once. */
+    if(atomic_load_explicit(&node->state, memory_order_acquire) == GLNN_PENDING
+       && atomic_load_explicit(&graph->sched.queued, memory_order_relaxed) <= 0
+       && !atomic_load_explicit(&graph->cancelled, memory_order_acquire)) {
+	GLN_PROBE1(wait_park, node);
+	if(deadline == NULL || graph->timeout == 0) {
+	    gln_futex_wait(&graph->progress, seq, false, NULL);
+	} else {
+	    uint64_t now = gln_now();
+	    if(*deadline == 0) {
+		*deadline = now + graph->timeout;
+	    }
+	    if(now >= *deadline) {
+		gln_graph_cancel(graph);
+		errno = ETIMEDOUT;
+		r = -1;
+	    } else {
+		uint64_t left = *deadline - now;
+		struct timespec timeout = {
+		    .tv_sec = left / 1000000000,
+		    .tv_nsec = left % 1000000000
+		};
+		gln_futex_wait(&graph->progress, seq, false, &timeout);
+	    }
+	}
+    }
+    atomic_fetch_sub(&graph->waiters, 1);
+    return r;
+}
+
+void gln_graph_cancel(struct gln_graph *graph) {
+    atomic_store_explicit(&graph->cancelled, true, memory_order_release);
+    gln_graph_signal(graph);
+}
+
+static void gln_graph_fail(struct gln_graph *graph, struct gln_node *node, int error) {
+    bool expected = false;
+    if(atomic_compare_exchange_strong(&graph->reported, &expected, true)) {
+	graph->failed_errno = error;
+	arcp_store(&graph->failed, node);
+    }
+    gln_graph_cancel(graph);
+}
+
+struct gln_node *gln_graph_failed_node(struct gln_graph *graph, int *error) {
+    struct gln_node *node = (struct gln_node *) arcp_load(&graph->failed);
+    if(node != NULL && error != NULL) {
+	*error = graph->failed_errno;
+    }
+    return node;
+}
+
+/* A quarantined node isn't run; whatever it would have produced
+ * reads as nothing. */
+static void gln_node_skip(struct gln_node *node) {
+    size_t i;
+    struct gln_socket *socket;
+    struct aary *outputs = (struct aary *) arcp_load(&node->outputs);
+    if(outputs != NULL) {
+	for(i = 0; i < aary_length(outputs); i++) {
+	    socket = (struct gln_socket *) arcp_weakref_load((struct arcp_weakref *) aary_load_phantom(outputs, i));
+	    if(socket != NULL) {
+		arcp_store(&socket->buffer, NULL);
+		arcp_release(socket);
+	    }
+	}
+	arcp_release(outputs);
+    }
+    atomic_store_explicit(&node->state, GLNN_FINISHED, memory_order_release);
+}
+
+static void gln_node_run_budgeted(struct gln_graph *graph, struct gln_node *node) {
+    uint64_t start = gln_now();
+    atomic_store_explicit(&node->started, start, memory_order_relaxed);
+    gln_node_run(node);
+    uint64_t elapsed = gln_now() - start;
+    atomic_store_explicit(&node->started, 0, memory_order_release);
+    if(elapsed <= node->budget) {
+	node->overruns = 0;
+	return;
+    }
+    node->overruns++;
+    if(graph->overrun != NULL) {
+	graph->overrun(node, elapsed, false, graph->overrun_arg);
+    }
+    if(graph->quarantine_after != 0 && node->overruns >= graph->quarantine_after) {
+	atomic_store_explicit(&node->quarantined, true, memory_order_release);
+    }
+}
+
+/* gln_graph_run, without waking anybody */
+static void gln_graph_exec(struct gln_graph *graph, struct gln_node *node) {
+    if(atomic_load_explicit(&graph->cancelled, memory_order_acquire)) {
+	atomic_store_explicit(&node->state, GLNN_ERROR, memory_order_release);
+	return;
+    }
+    if(atomic_load_explicit(&node->quarantined, memory_order_acquire)) {
+	gln_node_skip(node);
+    } else if(node->budget != 0) {
+	gln_node_run_budgeted(graph, node);
+    } else {
+	gln_node_run(node);
+    }
+    if(atomic_load_explicit(&node->state, memory_order_relaxed) == GLNN_ERROR) {
+	gln_graph_fail(graph, node, errno);
+    }
+}
+
+void gln_graph_run(struct gln_graph *graph, struct gln_node *node) {
+    gln_graph_exec(graph, node);
+    gln_graph_signal(graph);
+}
+
 int gln_get_buffers(int count, ...) {
     int i, r;
 
@@ -555,16 +1645,206 @@ int gln_get_buffers(int count, ...) {
     return r;
 }
 
-int gln_get_buffer_list(int count, struct gln_socket **sockets, void **buffers) {
+/* gln_pull_buffers for owned graphs: everything is kept alive by the
+ * graph, so follow pointers without taking references. */
+static int gln_pull_buffers_owned(int count, struct gln_socket **sockets, void **buffers) {
+    int i;
+    struct gln_socket **connected_sockets = alloca(sizeof(struct gln_socket *) * count);
+    struct gln_node **nodes = alloca(sizeof(struct gln_node *) * count);
+    int node_count = 0;
+    /* the producer to run ourselves, under DEPTH_FIRST */
+    struct gln_node *deferred = NULL;
+
+    for(i = 0; i < count; i++) {
+	connected_sockets[i] = (struct gln_socket *) atomic_load_explicit(&sockets[i]->peer, memory_order_acquire);
+	if(connected_sockets[i] == NULL) {
+	    continue;
+	}
+	struct gln_node *node = connected_sockets[i]->owner;
+	if(gln_profile_top != NULL) {
+	    gln_profile_dep(gln_profile_top->node, node);
+	}
+
+	int lo = 0;
+	int hi = node_count;
+	int j;
+	while(lo < hi) {
+	    j = (lo + hi) / 2;
+	    if(node < nodes[j]) {
+		hi = j;
+	    } else if(node > nodes[j]) {
+		lo = j + 1;
+	    } else {
+		goto next_socket;
+	    }
+	}
+	j = lo;
+
+	enum gln_node_state state = GLNN_READY;
+	if(atomic_compare_exchange_strong_explicit(&node->state, (int *) &state, GLNN_PENDING,
+						   memory_order_acq_rel, memory_order_relaxed)) {
+	    struct gln_node *queued = node;
+	    if(node->owner->policy == GLN_POLICY_DEPTH_FIRST) {
+		/* Run the latest ourselves; queue the one before it */
+		queued = deferred;
+		deferred = node;
+	    }
+	    if(queued != NULL && gln_graph_enqueue(queued->owner, queued) != 0) {
+		atomic_store_explicit(&queued->state, GLNN_READY, memory_order_release);
+		goto abort;
+	    }
+	} else if(state == GLNN_FINISHED) {
+	    goto next_socket;
+	} else if(state == GLNN_ERROR) {
+	    goto abort;
+	}
+	memmove(&nodes[j + 1], &nodes[j], sizeof(struct gln_node *) * (node_count - j));
+	nodes[j] = node;
+	node_count++;
+
+    next_socket:
+	continue;
+    }
+
+    if(deferred != NULL) {
+	gln_graph_run(deferred->owner, deferred);
+    }
+
+    for(i = 0; i < node_count; i++) {
+	struct gln_node *node = nodes[i];
+	int spins = 0;
+	uint64_t deadline = 0;
+	for(;;) {
+	    enum gln_node_state state = atomic_load_explicit(&node->state, memory_order_acquire);
+	    if(state == GLNN_FINISHED) {
+		break;
+	    } else if(state == GLNN_ERROR) {
+		return -1;
+	    } else if(state == GLNN_READY) {
+		if(atomic_compare_exchange_strong_explicit(&node->state, (int *) &state, GLNN_PENDING,
+							   memory_order_acq_rel, memory_order_relaxed)
+		   && gln_graph_enqueue(node->owner, node) != 0) {
+		    atomic_store_explicit(&node->state, GLNN_READY, memory_order_release);
+		    return -1;
+		}
+		continue;
+	    }
+	    if(atomic_load_explicit(&node->owner->cancelled, memory_order_acquire)) {
+		errno = ECANCELED;
+		return -1;
+	    }
+	    struct gln_node *next = gln_graph_dequeue(node->owner);
+	    if(next == NULL) {
+		if(spins++ < GLN_WAIT_SPINS) {
+		    GLN_PROBE1(wait_spin, node);
+		    cpu_yield();
+		} else if(gln_graph_wait(node->owner, node, &deadline) != 0) {
+		    return -1;
+		}
+		continue;
+	    }
+	    gln_graph_run(node->owner, next);
+	    arcp_release(next);
+	}
+    }
+
+    for(i = 0; i < count; i++) {
+	if(connected_sockets[i] == NULL) {
+	    buffers[i] = NULL;
+	} else {
+	    struct gln_buffer *buf = (struct gln_buffer *) arcp_load_phantom(&connected_sockets[i]->buffer);
+	    if(sockets[i]->delay != NULL) {
+		if(gln_delay_apply(sockets[i], &buf) != 0) {
+		    return -1;
+		}
+		arcp_store(&sockets[i]->buffer, buf);
+	    }
+	    if(buf == NULL) {
+		buffers[i] = NULL;
+	    } else {
+		gln_prefetch_buffer(buf);
+		buffers[i] = gln_buffer_data(buf);
+	    }
+	}
+    }
+    return 0;
+
+abort:
+    if(deferred != NULL) {
+	atomic_store_explicit(&deferred->state, GLNN_READY, memory_order_release);
+    }
+    return -1;
+}
+
+/* gln_pull_buffers for single-threaded graphs: nobody else touches
+ * node state, so producers run here and now, one pull nested inside
+ * the next, and a node found pending is one of our own callers. */
+static int gln_pull_buffers_single(int count, struct gln_socket **sockets, void **buffers) {
+    int i;
+    for(i = 0; i < count; i++) {
+	struct gln_socket *peer = (struct gln_socket *) atomic_load_explicit(&sockets[i]->peer, memory_order_relaxed);
+	if(peer == NULL) {
+	    buffers[i] = NULL;
+	    continue;
+	}
+	struct gln_node *node = peer->owner;
+	if(gln_profile_top != NULL) {
+	    gln_profile_dep(gln_profile_top->node, node);
+	}
+	switch(atomic_load_explicit(&node->state, memory_order_relaxed)) {
+	case GLNN_READY:
+	    atomic_store_explicit(&node->state, GLNN_PENDING, memory_order_relaxed);
+	    gln_graph_exec(node->owner, node);
+	    if(atomic_load_explicit(&node->state, memory_order_relaxed) == GLNN_ERROR) {
+		return -1;
+	    }
+	    break;
+	case GLNN_PENDING:
+	    errno = EDEADLK;
+	    return -1;
+	case GLNN_ERROR:
+	    return -1;
+	}
+	struct gln_buffer *buf = (struct gln_buffer *) arcp_load_phantom(&peer->buffer);
+	if(sockets[i]->delay != NULL) {
+	    if(gln_delay_apply(sockets[i], &buf) != 0) {
+		return -1;
+	    }
+	    arcp_store(&sockets[i]->buffer, buf);
+	}
+	if(buf == NULL) {
+	    buffers[i] = NULL;
+	} else {
+	    gln_prefetch_buffer(buf);
+	    buffers[i] = gln_buffer_data(buf);
+	}
+    }
+    return 0;
+}
+
+static int gln_pull_buffers(int count, struct gln_socket **sockets, void **buffers) {
     int i, r;
 
+    if(count > 0 && (sockets[0]->flags & GLN_GRAPH_SINGLE_THREADED)) {
+	return gln_pull_buffers_single(count, sockets, buffers);
+    }
+    if(count > 0 && (sockets[0]->flags & GLN_GRAPH_OWNED)) {
+	return gln_pull_buffers_owned(count, sockets, buffers);
+    }
+
     /* Get all connected sockets */
     struct atxn_handle *handle;
     struct arcp_weakref *connected_weakref;
     struct gln_socket **connected_sockets = alloca(sizeof(struct gln_socket *) * count);
     enum atxn_status status;
+    bool retried = false;
 
 retry_acquire_connections:
+    if(retried) {
+	atomic_fetch_add_explicit(&gln_pull_retries, 1, memory_order_relaxed);
+	GLN_PROBE1(pull_retry, count);
+    }
+    retried = true;
     handle = atxn_start();
     for(i = 0; i < count; i++) {
 	status = atxn_load(handle, &sockets[i]->other, (struct arcp_region **) &connected_weakref);
@@ -586,6 +1866,9 @@ retry_acquire_connections:
      * needed. */
     struct gln_node **nodes = alloca(sizeof(struct gln_node *) * count);
     int node_count = 0;
+    /* the producer to run ourselves, under DEPTH_FIRST */
+    struct gln_node *deferred = NULL;
+    struct gln_graph *deferred_graph = NULL;
 
     for(i = 0; i < count; i++) {
 	if(connected_sockets[i] == NULL) {
@@ -597,22 +1880,26 @@ retry_acquire_connections:
 	    arcp_store(&connected_sockets[i]->buffer, NULL);
 	    goto next_socket;
 	}
+	if(gln_profile_top != NULL) {
+	    gln_profile_dep(gln_profile_top->node, node);
+	}
 
 	int lo = 0;
 	int hi = node_count;
-	int j = 0;
+	int j;
 	while(lo < hi) {
 	    j = (lo + hi) / 2;
 	    if(node < nodes[j]) {
 		hi = j;
 	    } else if(node > nodes[j]) {
-		lo = ++i;
+		lo = j + 1;
 	    } else {
 		/* Already present */
 		arcp_release(node);
 		goto next_socket;
 	    }
 	}
+	j = lo;
 
 	enum gln_node_state state = GLNN_READY;
 	/* Add it to the queue */
@@ -622,12 +1909,29 @@ retry_acquire_connections:
 	    if(graph == NULL) {
 		atomic_store_explicit(&node->state, GLNN_READY, memory_order_release);
 	    } else {
-		r = aqueue_enq(&graph->proc_queue, node);
-		arcp_release(graph);
-		if(r != 0) {
-		    atomic_store_explicit(&node->state, GLNN_READY, memory_order_release);
-		    arcp_release(node);
-		    goto abort;
+		struct gln_node *queued = node;
+		if(graph->policy == GLN_POLICY_DEPTH_FIRST) {
+		    /* Run the latest ourselves; queue the one before it */
+		    struct gln_graph *tmp = deferred_graph;
+		    queued = deferred;
+		    deferred = node;
+		    deferred_graph = graph;
+		    graph = tmp;
+		}
+		if(queued != NULL) {
+		    r = gln_graph_enqueue(graph, queued);
+		    arcp_release(graph);
+		    if(r != 0) {
+			atomic_store_explicit(&queued->state, GLNN_READY, memory_order_release);
+			if(queued != node) {
+			    /* node was deferred, but isn't listed yet */
+			    atomic_store_explicit(&node->state, GLNN_READY, memory_order_release);
+			    arcp_release(deferred_graph);
+			    deferred = NULL;
+			}
+			arcp_release(node);
+			goto abort;
+		    }
 		}
 	    }
 	} else if(state == GLNN_FINISHED) {
@@ -646,9 +1950,17 @@ retry_acquire_connections:
 	continue;
     }
 
+    if(deferred != NULL) {
+	gln_graph_run(deferred_graph, deferred);
+	arcp_release(deferred_graph);
+	deferred = NULL;
+    }
+
     /* Process stuff until the nodes we're waiting on have been processed. */
     for(i = 0; i < node_count; i++) {
 	struct gln_node *node = nodes[i];
+	int spins = 0;
+	uint64_t deadline = 0;
 
 	for(;;) {
 	    /* check on the state of the node */
@@ -668,14 +1980,9 @@ retry_acquire_connections:
 		    if(graph == NULL) {
 			/* No queue to add this to. Process it
 			 * directly. */
-			r = node->process(node);
-			if(r != 0) {
-			    atomic_store_explicit(&node->state, GLNN_ERROR, memory_order_release);
-			} else {
-			    atomic_store_explicit(&node->state, GLNN_FINISHED, memory_order_release);
-			}
+			gln_node_run(node);
 		    } else {
-			r = aqueue_enq(&graph->proc_queue, node);
+			r = gln_graph_enqueue(graph, node);
 			arcp_release(graph);
 			if(r != 0) {
 			    atomic_store_explicit(&node->state, GLNN_READY, memory_order_release);
@@ -693,19 +2000,30 @@ retry_acquire_connections:
 		r = -1;
 		goto abort;
 	    }
+	    if(atomic_load_explicit(&graph->cancelled, memory_order_acquire)) {
+		arcp_release(graph);
+		errno = ECANCELED;
+		r = -1;
+		goto abort;
+	    }
 
-	    struct gln_node *next = (struct gln_node *) aqueue_deq(&graph->proc_queue);
+	    struct gln_node *next = gln_graph_dequeue(graph);
 	    if(next == NULL) {
-		/* This becomes a spinlock waiting on other threads to finish processing... */
-		cpu_yield();
+		/* Another thread is running it; spin a little, then
+		 * park until something happens. */
+		if(spins++ < GLN_WAIT_SPINS) {
+		    GLN_PROBE1(wait_spin, node);
+		    cpu_yield();
+		} else if(gln_graph_wait(graph, node, &deadline) != 0) {
+		    arcp_release(graph);
+		    r = -1;
+		    goto abort;
+		}
+		arcp_release(graph);
 		continue;
 	    }
-	    r = next->process(next);
-	    if(r != 0) {
-		atomic_store_explicit(&next->state, GLNN_ERROR, memory_order_release);
-	    } else {
-		atomic_store_explicit(&next->state, GLNN_FINISHED, memory_order_release);
-	    }
+	    gln_graph_run(graph, next);
+	    arcp_release(graph);
 	    arcp_release(next);
 	}
     }
@@ -715,21 +2033,37 @@ retry_acquire_connections:
     }
 
     /* Now we can load up our buffers */
+    bool failed = false;
     for(i = 0; i < count; i++) {
 	if(connected_sockets[i] == NULL) {
 	    buffers[i] = NULL;
 	    arcp_store(&sockets[i]->buffer, NULL);
 	} else {
 	    struct gln_buffer *buf = (struct gln_buffer *) arcp_load_phantom(&connected_sockets[i]->buffer);
-	    buffers[i] = buf->data;
+	    if(sockets[i]->delay != NULL && gln_delay_apply(sockets[i], &buf) != 0) {
+		/* Carry on, to let go of the rest */
+		failed = true;
+		buf = NULL;
+	    }
+	    if(buf == NULL) {
+		/* e.g. a quarantined producer */
+		buffers[i] = NULL;
+	    } else {
+		gln_prefetch_buffer(buf);
+		buffers[i] = gln_buffer_data(buf);
+	    }
 	    arcp_store(&sockets[i]->buffer, buf);
 	    arcp_release(connected_sockets[i]);
 	}
     }
 
-    return 0;
+    return failed ? -1 : 0;
 
 abort:
+    if(deferred != NULL) {
+	atomic_store_explicit(&deferred->state, GLNN_READY, memory_order_release);
+	arcp_release(deferred_graph);
+    }
     for(i = 0; i < node_count; i++) {
 	arcp_release(nodes[i]);
     }
@@ -741,18 +2075,30 @@ abort:
     return r;
 }
 
+int gln_get_buffer_list(int count, struct gln_socket **sockets, void **buffers) {
+    struct gln_profile_frame *frame = gln_profile_top;
+    if(frame == NULL) {
+	return gln_pull_buffers(count, sockets, buffers);
+    }
+    /* Time spent pulling isn't the node's own */
+    uint64_t start = gln_now();
+    int r = gln_pull_buffers(count, sockets, buffers);
+    frame->pulled += gln_now() - start;
+    return r;
+}
+
+void gln_txn_stats(struct gln_txn_stats *stats) {
+    stats->connect_retries = atomic_load_explicit(&gln_connect_retries, memory_order_relaxed);
+    stats->disconnect_retries = atomic_load_explicit(&gln_disconnect_retries, memory_order_relaxed);
+    stats->pull_retries = atomic_load_explicit(&gln_pull_retries, memory_order_relaxed);
+}
+
 bool gln_process(struct gln_graph *graph) {
-    int r;
-    struct gln_node *next = (struct gln_node *) aqueue_deq(&graph->proc_queue);
+    struct gln_node *next = gln_graph_dequeue(graph);
     if(next == NULL) {
 	return false;
     }
-    r = next->process(next);
-    if(r != 0) {
-	atomic_store_explicit(&next->state, GLNN_ERROR, memory_order_release);
-    } else {
-	atomic_store_explicit(&next->state, GLNN_FINISHED, memory_order_release);
-    }
+    gln_graph_run(graph, next);
     arcp_release(next);
     return true;
 }
@@ -0,0 +1,213 @@
+/*
+ * latency.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomickit/atomic.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+
+/* The bytes still owed to the input sit in a ring, oldest first from
+ * pos; each cycle's data goes out through it.  The output buffer is
+ * kept for the next cycle of the same length. */
+struct gln_delay {
+    arcp_t buffer;
+    unsigned int frames;
+    size_t size;
+    size_t pos;
+    uint8_t ring[];
+};
+
+static struct gln_delay *gln_delay_create(unsigned int frames, size_t size) {
+    struct gln_delay *delay = amalloc(sizeof(struct gln_delay) + size);
+    if(delay == NULL) {
+	return NULL;
+    }
+    arcp_init(&delay->buffer, NULL);
+    delay->frames = frames;
+    delay->size = size;
+    delay->pos = 0;
+    /* Whatever came before the first cycle was silence */
+    memset(delay->ring, 0, size);
+    return delay;
+}
+
+void gln_delay_destroy(struct gln_delay *delay) {
+    arcp_store(&delay->buffer, NULL);
+    afree(delay, sizeof(struct gln_delay) + delay->size);
+}
+
+int gln_delay_apply(struct gln_socket *socket, struct gln_buffer **in) {
+    struct gln_delay *delay = socket->delay;
+    if(*in == NULL) {
+	return 0;
+    }
+    size_t length = (*in)->size - GLN_BUFFER_OVERHEAD;
+    struct gln_view_buffer *view = gln_buffer_view(*in);
+    if(view != NULL) {
+	if(view->stride != 1) {
+	    errno = EINVAL;
+	    return -1;
+	}
+	length = view->length;
+    }
+    const uint8_t *data = gln_buffer_data(*in);
+    struct gln_buffer *out = (struct gln_buffer *) arcp_load_phantom(&delay->buffer);
+    if(out == NULL || out->size != length + GLN_BUFFER_OVERHEAD) {
+	out = gln_buffer_create(socket->mem, length);
+	if(out == NULL) {
+	    return -1;
+	}
+	arcp_store(&delay->buffer, out);
+	arcp_release(out);
+    }
+    size_t done = 0;
+    while(done < length) {
+	size_t chunk = delay->size - delay->pos;
+	if(chunk > length - done) {
+	    chunk = length - done;
+	}
+	memcpy(out->data + done, delay->ring + delay->pos, chunk);
+	memcpy(delay->ring + delay->pos, data + done, chunk);
+	done += chunk;
+	delay->pos += chunk;
+	if(delay->pos == delay->size) {
+	    delay->pos = 0;
+	}
+    }
+    *in = out;
+    return 0;
+}
+
+void gln_node_set_latency(struct gln_node *node, unsigned int frames) {
+    node->latency = frames;
+}
+
+static struct gln_node *gln_socket_peer_node(struct gln_socket *socket) {
+    struct gln_socket *peer = (struct gln_socket *) atomic_load_explicit(&socket->peer, memory_order_acquire);
+    return peer == NULL ? NULL : peer->owner;
+}
+
+/* Depth first from the node back to its sources.  A node marked one
+ * less than the pass is on the way. */
+static int gln_latency_visit(struct gln_node *node, unsigned int mark) {
+    if(node->latency_mark == mark) {
+	return 0;
+    } else if(node->latency_mark == mark - 1) {
+	errno = ELOOP;
+	return -1;
+    }
+    node->latency_mark = mark - 1;
+    unsigned int latency = 0;
+    struct gln_socket *socket;
+    int i;
+    for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	if(socket->direction != GLNS_INPUT) {
+	    continue;
+	}
+	struct gln_node *up = gln_socket_peer_node(socket);
+	if(up == NULL) {
+	    continue;
+	}
+	if(gln_latency_visit(up, mark) != 0) {
+	    return -1;
+	}
+	if(up->path_latency > latency) {
+	    latency = up->path_latency;
+	}
+    }
+    node->input_latency = latency;
+    node->path_latency = latency + node->latency;
+    node->latency_mark = mark;
+    return 0;
+}
+
+static int gln_latency_compensate(struct gln_node *node, size_t frame_size) {
+    struct gln_socket *socket;
+    int i;
+    for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	if(socket->direction != GLNS_INPUT) {
+	    continue;
+	}
+	struct gln_node *up = gln_socket_peer_node(socket);
+	unsigned int frames = up == NULL || frame_size == 0 ? 0 : node->input_latency - up->path_latency;
+	if(socket->delay != NULL
+	   && socket->delay->frames == frames && socket->delay->size == frames * frame_size) {
+	    continue;
+	}
+	struct gln_delay *delay = NULL;
+	if(frames != 0) {
+	    delay = gln_delay_create(frames, frames * frame_size);
+	    if(delay == NULL) {
+		return -1;
+	    }
+	}
+	if(socket->delay != NULL) {
+	    gln_delay_destroy(socket->delay);
+	    /* Don't leave the old delay's output for the next pull */
+	    arcp_store(&socket->buffer, NULL);
+	}
+	socket->delay = delay;
+    }
+    return 0;
+}
+
+int gln_graph_update_latency(struct gln_graph *graph, size_t frame_size) {
+    if(frame_size != 0 && graph->instances > 1) {
+	errno = EINVAL;
+	return -1;
+    }
+    /* Marks step by two: one for on the way, one for done */
+    graph->latency_mark += 2;
+    if(graph->latency_mark == 0) {
+	graph->latency_mark = 2;
+    }
+    unsigned int mark = graph->latency_mark;
+    size_t end = gln_registry_end(&graph->nodes);
+    size_t i;
+    int r = 0;
+    for(i = 0; i < end && r == 0; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node != NULL) {
+	    r = gln_latency_visit(node, mark);
+	    arcp_release(node);
+	}
+    }
+    for(i = 0; i < end && r == 0; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node != NULL) {
+	    r = gln_latency_compensate(node, frame_size);
+	    arcp_release(node);
+	}
+    }
+    return r;
+}
+
+unsigned int gln_socket_latency(struct gln_socket *socket) {
+    if(socket->direction == GLNS_OUTPUT) {
+	return socket->owner->path_latency;
+    }
+    struct gln_node *up = gln_socket_peer_node(socket);
+    if(up == NULL) {
+	return 0;
+    }
+    return up->path_latency + (socket->delay == NULL ? 0 : socket->delay->frames);
+}
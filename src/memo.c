@@ -0,0 +1,518 @@
+/*
+ * memo.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alloca.h>
+#include <atomickit/atomic.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+#include "futex.h"
+#include "probes.h"
+
+/* The key is built with four independent 64-bit multiply-rotate
+ * lanes over 32-byte stripes, the same shape as xxHash64, so the
+ * multiplies pipeline without any vector instructions.  The lanes
+ * are folded two different ways for 128 bits. */
+#define GLN_HASH_P1 0x9e3779b185ebca87ull
+#define GLN_HASH_P2 0xc2b2ae3d27d4eb4full
+#define GLN_HASH_P3 0x165667b19e3779f9ull
+#define GLN_HASH_P4 0x85ebca77c2b2ae63ull
+#define GLN_HASH_P5 0x27d4eb2f165667c5ull
+#define GLN_HASH_STRIPE 32
+
+struct gln_hash {
+    uint64_t lane[4];
+    uint64_t length;
+    size_t fill;
+    uint8_t tail[GLN_HASH_STRIPE];
+};
+
+static inline uint64_t gln_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t gln_hash_round(uint64_t acc, uint64_t input) {
+    return gln_rotl(acc + input * GLN_HASH_P2, 31) * GLN_HASH_P1;
+}
+
+static inline uint64_t gln_hash_avalanche(uint64_t x) {
+    x ^= x >> 33;
+    x *= GLN_HASH_P2;
+    x ^= x >> 29;
+    x *= GLN_HASH_P3;
+    x ^= x >> 32;
+    return x;
+}
+
+static inline void gln_hash_stripe(struct gln_hash *hash, const uint8_t *data) {
+    uint64_t word[4];
+    memcpy(word, data, GLN_HASH_STRIPE);
+    hash->lane[0] = gln_hash_round(hash->lane[0], word[0]);
+    hash->lane[1] = gln_hash_round(hash->lane[1], word[1]);
+    hash->lane[2] = gln_hash_round(hash->lane[2], word[2]);
+    hash->lane[3] = gln_hash_round(hash->lane[3], word[3]);
+}
+
+static void gln_hash_init(struct gln_hash *hash) {
+    hash->lane[0] = GLN_HASH_P1 + GLN_HASH_P2;
+    hash->lane[1] = GLN_HASH_P2;
+    hash->lane[2] = 0;
+    hash->lane[3] = -GLN_HASH_P1;
+    hash->length = 0;
+    hash->fill = 0;
+}
+
+static void gln_hash_update(struct gln_hash *hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    hash->length += size;
+    if(hash->fill != 0) {
+	size_t n = GLN_HASH_STRIPE - hash->fill;
+	if(n > size) {
+	    n = size;
+	}
+	memcpy(hash->tail + hash->fill, p, n);
+	hash->fill += n;
+	p += n;
+	size -= n;
+	if(hash->fill < GLN_HASH_STRIPE) {
+	    return;
+	}
+	gln_hash_stripe(hash, hash->tail);
+	hash->fill = 0;
+    }
+    while(size >= GLN_HASH_STRIPE) {
+	gln_hash_stripe(hash, p);
+	p += GLN_HASH_STRIPE;
+	size -= GLN_HASH_STRIPE;
+    }
+    memcpy(hash->tail, p, size);
+    hash->fill = size;
+}
+
+static inline void gln_hash_word(struct gln_hash *hash, uint64_t word) {
+    gln_hash_update(hash, &word, sizeof(word));
+}
+
+static void gln_hash_final(struct gln_hash *hash, uint64_t key[2]) {
+    if(hash->fill != 0) {
+	/* The length tells a zero-padded tail from real zeroes */
+	memset(hash->tail + hash->fill, 0, GLN_HASH_STRIPE - hash->fill);
+	gln_hash_stripe(hash, hash->tail);
+    }
+    uint64_t *lane = hash->lane;
+    uint64_t a = gln_rotl(lane[0], 1) + gln_rotl(lane[1], 7) + gln_rotl(lane[2], 12) + gln_rotl(lane[3], 18);
+    uint64_t b = hash->length * GLN_HASH_P5;
+    b = gln_hash_round(b, lane[3]) ^ GLN_HASH_P4;
+    b = gln_hash_round(b, lane[2]) ^ GLN_HASH_P4;
+    b = gln_hash_round(b, lane[1]) ^ GLN_HASH_P4;
+    b = gln_hash_round(b, lane[0]);
+    key[0] = gln_hash_avalanche(a ^ hash->length);
+    key[1] = gln_hash_avalanche(b);
+}
+
+/* Entries are chained in their bucket and on the LRU list, most
+ * recently used first.  bytes is what the entry holds, buffers and
+ * all, against the capacity. */
+struct gln_memo_entry {
+    struct gln_memo_entry *chain;
+    struct gln_memo_entry *newer;
+    struct gln_memo_entry *older;
+    uint64_t key[2];
+    size_t bytes;
+    int noutputs;
+    struct gln_buffer *outputs[];
+};
+
+#define GLN_MEMO_BUCKETS 64
+
+static void gln_memo_lock(struct gln_memo_cache *cache) {
+    unsigned int c = 0;
+    if(atomic_compare_exchange_strong_explicit(&cache->lock, &c, 1, memory_order_acquire, memory_order_relaxed)) {
+	return;
+    }
+    /* 2 means somebody may be parked */
+    if(c != 2) {
+	c = atomic_exchange_explicit(&cache->lock, 2, memory_order_acquire);
+    }
+    while(c != 0) {
+	gln_futex_wait(&cache->lock, 2, false, NULL);
+	c = atomic_exchange_explicit(&cache->lock, 2, memory_order_acquire);
+    }
+}
+
+static void gln_memo_unlock(struct gln_memo_cache *cache) {
+    if(atomic_exchange_explicit(&cache->lock, 0, memory_order_release) == 2) {
+	gln_futex_wake(&cache->lock, 1, false);
+    }
+}
+
+static void gln_memo_entry_free(struct gln_memo_entry *entry) {
+    int i;
+    for(i = 0; i < entry->noutputs; i++) {
+	if(entry->outputs[i] != NULL) {
+	    arcp_release(entry->outputs[i]);
+	}
+    }
+    afree(entry, sizeof(struct gln_memo_entry) + sizeof(struct gln_buffer *) * entry->noutputs);
+}
+
+static struct gln_memo_entry **gln_memo_bucket(struct gln_memo_cache *cache, const uint64_t key[2]) {
+    return &cache->buckets[key[0] & (cache->nbuckets - 1)];
+}
+
+static struct gln_memo_entry *gln_memo_find(struct gln_memo_cache *cache, const uint64_t key[2]) {
+    struct gln_memo_entry *entry;
+    for(entry = *gln_memo_bucket(cache, key); entry != NULL; entry = entry->chain) {
+	if(entry->key[0] == key[0] && entry->key[1] == key[1]) {
+	    return entry;
+	}
+    }
+    return NULL;
+}
+
+static void gln_memo_unlink(struct gln_memo_cache *cache, struct gln_memo_entry *entry) {
+    if(entry->newer != NULL) {
+	entry->newer->older = entry->older;
+    } else {
+	cache->newest = entry->older;
+    }
+    if(entry->older != NULL) {
+	entry->older->newer = entry->newer;
+    } else {
+	cache->oldest = entry->newer;
+    }
+}
+
+static void gln_memo_push(struct gln_memo_cache *cache, struct gln_memo_entry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if(cache->newest != NULL) {
+	cache->newest->newer = entry;
+    } else {
+	cache->oldest = entry;
+    }
+    cache->newest = entry;
+}
+
+/* Doubles the table once it averages two entries a bucket; if that
+ * can't be had, chains just get longer. */
+static void gln_memo_grow(struct gln_memo_cache *cache) {
+    size_t i;
+    if(cache->entries <= cache->nbuckets * 2) {
+	return;
+    }
+    size_t nbuckets = cache->nbuckets * 2;
+    struct gln_memo_entry **buckets = amalloc(sizeof(struct gln_memo_entry *) * nbuckets);
+    if(buckets == NULL) {
+	return;
+    }
+    memset(buckets, 0, sizeof(struct gln_memo_entry *) * nbuckets);
+    for(i = 0; i < cache->nbuckets; i++) {
+	struct gln_memo_entry *entry = cache->buckets[i];
+	while(entry != NULL) {
+	    struct gln_memo_entry *next = entry->chain;
+	    struct gln_memo_entry **bucket = &buckets[entry->key[0] & (nbuckets - 1)];
+	    entry->chain = *bucket;
+	    *bucket = entry;
+	    entry = next;
+	}
+    }
+    afree(cache->buckets, sizeof(struct gln_memo_entry *) * cache->nbuckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+/* Takes the oldest entry out of the table and the list */
+static struct gln_memo_entry *gln_memo_evict(struct gln_memo_cache *cache) {
+    struct gln_memo_entry *entry = cache->oldest;
+    struct gln_memo_entry **p = gln_memo_bucket(cache, entry->key);
+    while(*p != entry) {
+	p = &(*p)->chain;
+    }
+    *p = entry->chain;
+    gln_memo_unlink(cache, entry);
+    cache->entries--;
+    cache->bytes -= entry->bytes;
+    cache->evictions++;
+    return entry;
+}
+
+static void __gln_memo_cache_destroy(struct gln_memo_cache *cache) {
+    while(cache->oldest != NULL) {
+	gln_memo_entry_free(gln_memo_evict(cache));
+    }
+    afree(cache->buckets, sizeof(struct gln_memo_entry *) * cache->nbuckets);
+    afree(cache, sizeof(struct gln_memo_cache));
+}
+
+struct gln_memo_cache *gln_memo_cache_create(size_t capacity) {
+    struct gln_memo_cache *cache = amalloc(sizeof(struct gln_memo_cache));
+    if(cache == NULL) {
+	goto undo0;
+    }
+    cache->nbuckets = GLN_MEMO_BUCKETS;
+    cache->buckets = amalloc(sizeof(struct gln_memo_entry *) * cache->nbuckets);
+    if(cache->buckets == NULL) {
+	goto undo1;
+    }
+    memset(cache->buckets, 0, sizeof(struct gln_memo_entry *) * cache->nbuckets);
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->capacity = capacity;
+    cache->entries = 0;
+    cache->bytes = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->bypassed = 0;
+    atomic_init(&cache->lock, 0);
+    arcp_region_init(cache, (void (*)(struct arcp_region *)) __gln_memo_cache_destroy);
+    return cache;
+
+undo1:
+    afree(cache, sizeof(struct gln_memo_cache));
+undo0:
+    return NULL;
+}
+
+void gln_memo_cache_stats(struct gln_memo_cache *cache, struct gln_memo_stats *stats) {
+    gln_memo_lock(cache);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->bypassed = cache->bypassed;
+    stats->entries = cache->entries;
+    stats->bytes = cache->bytes;
+    gln_memo_unlock(cache);
+}
+
+/* gln_alloc_buffer would write a new result over the last one, which
+ * may be cached */
+static void gln_memo_clear_outputs(struct gln_node *node) {
+    int i;
+    struct gln_socket *socket;
+    for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	if(socket->direction == GLNS_OUTPUT) {
+	    arcp_store(&socket->buffer, NULL);
+	}
+    }
+}
+
+int gln_node_set_memo(struct gln_node *node, struct gln_memo_cache *cache) {
+    /* Without saved parameters, nodes sharing a process function
+     * can't be told apart */
+    if(cache != NULL && (node->type == NULL || node->type->save == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+    if(arcp_load_phantom(&node->memo) != NULL) {
+	gln_memo_clear_outputs(node);
+    }
+    arcp_store(&node->memo, cache);
+    return 0;
+}
+
+static void gln_hash_buffer(struct gln_hash *hash, struct gln_buffer *buffer) {
+    if(buffer == NULL) {
+	gln_hash_word(hash, UINT64_MAX);
+	return;
+    }
+    struct gln_view_buffer *view = gln_buffer_view(buffer);
+    if(view == NULL) {
+	gln_hash_word(hash, buffer->size - GLN_BUFFER_OVERHEAD);
+	gln_hash_update(hash, buffer->data, buffer->size - GLN_BUFFER_OVERHEAD);
+	return;
+    }
+    gln_hash_word(hash, view->length);
+    if(view->stride == 1) {
+	gln_hash_update(hash, view->data, view->length);
+    } else {
+	size_t i;
+	for(i = 0; i < view->length; i++) {
+	    gln_hash_update(hash, view->data + i * view->stride, 1);
+	}
+    }
+}
+
+/* Hashes what the node does and what it has been given.  Fails, and
+ * the cache is bypassed, if an input is delayed (pulling it again
+ * would move the delay on), or the inputs or parameters can't be
+ * had. */
+static int gln_memo_key(struct gln_node *node, uint64_t key[2]) {
+    int i, ninputs = 0, nsockets = 0;
+    struct gln_socket *socket;
+    struct gln_hash hash;
+    while((socket = gln_node_socket(node, nsockets)) != NULL) {
+	if(socket->direction == GLNS_INPUT) {
+	    if(socket->delay != NULL) {
+		return -1;
+	    }
+	    ninputs++;
+	}
+	nsockets++;
+    }
+    struct gln_socket **inputs = alloca(sizeof(struct gln_socket *) * (ninputs + 1));
+    void **buffers = alloca(sizeof(void *) * (ninputs + 1));
+    ninputs = 0;
+    for(i = 0; i < nsockets; i++) {
+	socket = gln_node_socket(node, i);
+	if(socket->direction == GLNS_INPUT) {
+	    inputs[ninputs++] = socket;
+	}
+    }
+
+    gln_hash_init(&hash);
+    gln_hash_word(&hash, gln_node_transform(node));
+    gln_hash_word(&hash, (uintptr_t) node->type);
+    gln_hash_word(&hash, node->instances);
+    ssize_t size = node->type->save(node, NULL, 0);
+    if(size < 0) {
+	return -1;
+    }
+    void *params = malloc(size + 1);
+    if(params == NULL) {
+	return -1;
+    }
+    if(node->type->save(node, params, size) != size) {
+	free(params);
+	return -1;
+    }
+    gln_hash_word(&hash, size);
+    gln_hash_update(&hash, params, size);
+    free(params);
+    if(gln_get_buffer_list(ninputs, inputs, buffers) != 0) {
+	return -1;
+    }
+    for(i = 0; i < ninputs; i++) {
+	gln_hash_buffer(&hash, gln_socket_buffer(inputs[i]));
+    }
+    gln_hash_final(&hash, key);
+    return 0;
+}
+
+bool gln_memo_lookup(struct gln_memo_cache *cache, struct gln_node *node, struct gln_memo_key *key) {
+    int i, noutputs = 0;
+    struct gln_socket *socket;
+    if(gln_memo_key(node, key->hash) != 0) {
+	key->valid = false;
+	gln_memo_lock(cache);
+	cache->bypassed++;
+	gln_memo_unlock(cache);
+	gln_memo_clear_outputs(node);
+	return false;
+    }
+    key->valid = true;
+    gln_memo_lock(cache);
+    struct gln_memo_entry *entry = gln_memo_find(cache, key->hash);
+    if(entry != NULL) {
+	cache->hits++;
+	gln_memo_unlink(cache, entry);
+	gln_memo_push(cache, entry);
+	for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	    if(socket->direction == GLNS_OUTPUT) {
+		arcp_store(&socket->buffer, noutputs < entry->noutputs ? entry->outputs[noutputs] : NULL);
+		noutputs++;
+	    }
+	}
+	gln_memo_unlock(cache);
+	GLN_PROBE1(memo_hit, node);
+	return true;
+    }
+    cache->misses++;
+    gln_memo_unlock(cache);
+    gln_memo_clear_outputs(node);
+    return false;
+}
+
+void gln_memo_store(struct gln_memo_cache *cache, struct gln_node *node, const struct gln_memo_key *key) {
+    int i, noutputs = 0;
+    struct gln_socket *socket;
+    if(!key->valid) {
+	return;
+    }
+    for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	if(socket->direction == GLNS_OUTPUT) {
+	    noutputs++;
+	}
+    }
+    size_t entry_size = sizeof(struct gln_memo_entry) + sizeof(struct gln_buffer *) * noutputs;
+    struct gln_memo_entry *entry = amalloc(entry_size);
+    if(entry == NULL) {
+	return;
+    }
+    entry->key[0] = key->hash[0];
+    entry->key[1] = key->hash[1];
+    entry->bytes = entry_size;
+    entry->noutputs = noutputs;
+    memset(entry->outputs, 0, sizeof(struct gln_buffer *) * noutputs);
+    noutputs = 0;
+    for(i = 0; (socket = gln_node_socket(node, i)) != NULL; i++) {
+	if(socket->direction != GLNS_OUTPUT) {
+	    continue;
+	}
+	struct gln_buffer *buffer = (struct gln_buffer *) arcp_load(&socket->buffer);
+	entry->outputs[noutputs++] = buffer;
+	/* Views and foreign buffers can be written over by whoever
+	 * owns the memory; only our own heap buffers are kept. */
+	if(buffer != NULL && !gln_buffer_heap(buffer)) {
+	    gln_memo_entry_free(entry);
+	    return;
+	}
+	if(buffer != NULL) {
+	    entry->bytes += buffer->size;
+	}
+    }
+    if(entry->bytes > cache->capacity) {
+	gln_memo_entry_free(entry);
+	return;
+    }
+
+    struct gln_memo_entry *evicted = NULL;
+    gln_memo_lock(cache);
+    if(gln_memo_find(cache, entry->key) != NULL) {
+	/* Somebody else made the same thing meanwhile */
+	gln_memo_unlock(cache);
+	gln_memo_entry_free(entry);
+	return;
+    }
+    while(cache->bytes + entry->bytes > cache->capacity) {
+	struct gln_memo_entry *old = gln_memo_evict(cache);
+	old->chain = evicted;
+	evicted = old;
+    }
+    struct gln_memo_entry **bucket = gln_memo_bucket(cache, entry->key);
+    entry->chain = *bucket;
+    *bucket = entry;
+    gln_memo_push(cache, entry);
+    cache->entries++;
+    cache->bytes += entry->bytes;
+    gln_memo_grow(cache);
+    gln_memo_unlock(cache);
+
+    /* Buffers are released outside the lock */
+    while(evicted != NULL) {
+	struct gln_memo_entry *next = evicted->chain;
+	gln_memo_entry_free(evicted);
+	evicted = next;
+    }
+}
@@ -0,0 +1,146 @@
+/*
+ * memory.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <atomickit/atomic.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+
+/* Memory statistics form a chain from socket to node to graph; every
+ * charge is counted at each level.  Things that hold memory after
+ * their owner is gone (buffers, mostly) keep a reference to the
+ * statistics they were charged to. */
+struct gln_memstat {
+    struct arcp_region;
+    struct gln_memstat *parent;
+    volatile atomic_size_t live[GLN_MEM_NCLASSES];
+    volatile atomic_size_t peak[GLN_MEM_NCLASSES];
+    volatile atomic_size_t total;
+    volatile atomic_size_t total_peak;
+    volatile atomic_size_t budget;
+};
+
+static void __gln_memstat_destroy(struct gln_memstat *stat) {
+    arcp_release(stat->parent);
+    afree(stat, sizeof(struct gln_memstat));
+}
+
+struct gln_memstat *gln_memstat_create(struct gln_memstat *parent) {
+    int i;
+    struct gln_memstat *stat = amalloc(sizeof(struct gln_memstat));
+    if(stat == NULL) {
+	return NULL;
+    }
+    stat->parent = parent == NULL ? NULL : gln_memstat_acquire(parent);
+    for(i = 0; i < GLN_MEM_NCLASSES; i++) {
+	atomic_init(&stat->live[i], 0);
+	atomic_init(&stat->peak[i], 0);
+    }
+    atomic_init(&stat->total, 0);
+    atomic_init(&stat->total_peak, 0);
+    atomic_init(&stat->budget, 0);
+    arcp_region_init(stat, (void (*)(struct arcp_region *)) __gln_memstat_destroy);
+    return stat;
+}
+
+struct gln_memstat *gln_memstat_acquire(struct gln_memstat *stat) {
+    return (struct gln_memstat *) gln_acquire(stat);
+}
+
+void gln_memstat_release(struct gln_memstat *stat) {
+    arcp_release(stat);
+}
+
+static inline void gln_mem_peak(volatile atomic_size_t *peak, size_t value) {
+    size_t old = atomic_load_explicit(peak, memory_order_relaxed);
+    while(value > old) {
+	if(atomic_compare_exchange_weak_explicit(peak, &old, value,
+						 memory_order_relaxed, memory_order_relaxed)) {
+	    break;
+	}
+    }
+}
+
+static void gln_mem_uncharge(struct gln_memstat *stat, struct gln_memstat *end,
+			     enum gln_mem_class class, size_t size) {
+    for(; stat != end; stat = stat->parent) {
+	atomic_fetch_sub_explicit(&stat->live[class], size, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&stat->total, size, memory_order_relaxed);
+    }
+}
+
+/* Charges the levels above first, so that peaks are only recorded
+ * once every budget on the way up has taken the charge. */
+int gln_mem_charge(struct gln_memstat *stat, enum gln_mem_class class, size_t size) {
+    if(stat == NULL) {
+	return 0;
+    }
+    size_t live = atomic_fetch_add_explicit(&stat->live[class], size, memory_order_relaxed) + size;
+    size_t total = atomic_fetch_add_explicit(&stat->total, size, memory_order_relaxed) + size;
+    size_t budget = atomic_load_explicit(&stat->budget, memory_order_relaxed);
+    if(budget != 0 && total > budget) {
+	errno = ENOMEM;
+	goto undo;
+    }
+    if(gln_mem_charge(stat->parent, class, size) != 0) {
+	goto undo;
+    }
+    gln_mem_peak(&stat->peak[class], live);
+    gln_mem_peak(&stat->total_peak, total);
+    return 0;
+
+undo:
+    gln_mem_uncharge(stat, stat->parent, class, size);
+    return -1;
+}
+
+void gln_mem_credit(struct gln_memstat *stat, enum gln_mem_class class, size_t size) {
+    gln_mem_uncharge(stat, NULL, class, size);
+}
+
+size_t gln_mem_live(struct gln_memstat *stat, enum gln_mem_class class) {
+    return atomic_load_explicit(&stat->live[class], memory_order_relaxed);
+}
+
+static void gln_memstat_usage(struct gln_memstat *stat, struct gln_mem_usage *usage) {
+    int i;
+    for(i = 0; i < GLN_MEM_NCLASSES; i++) {
+	usage->live[i] = atomic_load_explicit(&stat->live[i], memory_order_relaxed);
+	usage->peak[i] = atomic_load_explicit(&stat->peak[i], memory_order_relaxed);
+    }
+    usage->total = atomic_load_explicit(&stat->total, memory_order_relaxed);
+    usage->total_peak = atomic_load_explicit(&stat->total_peak, memory_order_relaxed);
+}
+
+void gln_graph_mem_usage(struct gln_graph *graph, struct gln_mem_usage *usage) {
+    gln_memstat_usage(graph->mem, usage);
+}
+
+void gln_node_mem_usage(struct gln_node *node, struct gln_mem_usage *usage) {
+    gln_memstat_usage(node->mem, usage);
+}
+
+void gln_socket_mem_usage(struct gln_socket *socket, struct gln_mem_usage *usage) {
+    gln_memstat_usage(socket->mem, usage);
+}
+
+void gln_graph_set_mem_budget(struct gln_graph *graph, size_t budget) {
+    atomic_store_explicit(&graph->mem->budget, budget, memory_order_relaxed);
+}
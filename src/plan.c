@@ -0,0 +1,492 @@
+/*
+ * plan.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomickit/atomic-array.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+#include "futex.h"
+#include "probes.h"
+
+/* Rough cost, in ns, of handing a result to another thread */
+#define GLN_PLAN_SYNC_COST 2000
+/* Times to yield before sleeping on a dependency */
+#define GLN_PLAN_SPINS 64
+
+struct gln_plan_task {
+    struct gln_node *node;
+    /* dependencies on other threads left this cycle */
+    volatile atomic_uint pending;
+    unsigned int remote_preds;
+    /* tasks on other threads that depend on this one */
+    size_t *succs;
+    size_t nsuccs;
+};
+
+int gln_graph_profile(struct gln_graph *graph, int count, struct gln_socket **sockets, int cycles) {
+    size_t end = gln_registry_end(&graph->nodes);
+    size_t i;
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node == NULL) {
+	    continue;
+	}
+	node->cost = 0;
+	node->profiled = 0;
+	arcp_store(&node->deps, NULL);
+	arcp_release(node);
+    }
+
+    void **buffers = malloc(sizeof(void *) * (count + 1));
+    if(buffers == NULL) {
+	return -1;
+    }
+    int r = 0;
+    int c;
+    gln_profiling = true;
+    for(c = 0; c < cycles; c++) {
+	gln_graph_reset(graph);
+	r = gln_get_buffer_list(count, sockets, buffers);
+	if(r != 0) {
+	    break;
+	}
+    }
+    gln_profiling = false;
+    free(buffers);
+    return r;
+}
+
+struct gln_plan_weakref {
+    struct arcp_weakref *weakref;
+    size_t index;
+};
+
+static int gln_plan_weakref_cmp(const void *a, const void *b) {
+    const struct gln_plan_weakref *wa = a;
+    const struct gln_plan_weakref *wb = b;
+    return wa->weakref < wb->weakref ? -1 : wa->weakref > wb->weakref;
+}
+
+struct gln_plan_rank {
+    uint64_t rank;
+    size_t topo;
+    size_t index;
+};
+
+static int gln_plan_rank_cmp(const void *a, const void *b) {
+    const struct gln_plan_rank *ra = a;
+    const struct gln_plan_rank *rb = b;
+    if(ra->rank != rb->rank) {
+	return ra->rank > rb->rank ? -1 : 1;
+    }
+    return ra->topo < rb->topo ? -1 : ra->topo > rb->topo;
+}
+
+static void __gln_plan_destroy(struct gln_plan *plan) {
+    size_t i;
+    for(i = 0; i < plan->ntasks; i++) {
+	arcp_release(plan->tasks[i].node);
+    }
+    arcp_release(plan->graph);
+    free(plan->tasks);
+    free(plan->thread_start);
+    free(plan->succs);
+    afree(plan, sizeof(struct gln_plan));
+}
+
+/* Working state for gln_plan_create, indexed by profiled node. */
+struct gln_plan_work {
+    size_t n;
+    struct gln_node **nodes;
+    /* predecessors of i are preds[pred_first[i]..pred_first[i + 1]] */
+    size_t *pred_first;
+    size_t *preds;
+    size_t *succ_first;
+    size_t *succs;
+    size_t *topo;
+    struct gln_plan_rank *ranks;
+    int *thread;
+    uint64_t *finish;
+    size_t *position;
+};
+
+static void gln_plan_work_free(struct gln_plan_work *w) {
+    size_t i;
+    for(i = 0; i < w->n; i++) {
+	arcp_release(w->nodes[i]);
+    }
+    free(w->nodes);
+    free(w->pred_first);
+    free(w->preds);
+    free(w->succ_first);
+    free(w->succs);
+    free(w->topo);
+    free(w->ranks);
+    free(w->thread);
+    free(w->finish);
+    free(w->position);
+}
+
+/* Finds the profiled nodes and the edges between them. */
+static int gln_plan_edges(struct gln_graph *graph, struct gln_plan_work *w) {
+    size_t count = gln_registry_end(&graph->nodes);
+    size_t i, j;
+    struct gln_plan_weakref *lookup = NULL;
+    int r = -1;
+
+    w->nodes = malloc(sizeof(struct gln_node *) * (count + 1));
+    if(w->nodes == NULL) {
+	goto out;
+    }
+    for(i = 0; i < count; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node == NULL) {
+	    continue;
+	}
+	if(node->profiled == 0) {
+	    arcp_release(node);
+	    continue;
+	}
+	w->nodes[w->n++] = node;
+    }
+
+    lookup = malloc(sizeof(struct gln_plan_weakref) * (w->n + 1));
+    w->pred_first = calloc(w->n + 1, sizeof(size_t));
+    w->succ_first = calloc(w->n + 1, sizeof(size_t));
+    if(lookup == NULL || w->pred_first == NULL || w->succ_first == NULL) {
+	goto out;
+    }
+    for(i = 0; i < w->n; i++) {
+	lookup[i].weakref = arcp_weakref_phantom(w->nodes[i]);
+	lookup[i].index = i;
+    }
+    qsort(lookup, w->n, sizeof(struct gln_plan_weakref), gln_plan_weakref_cmp);
+
+    /* Two passes: count, then fill. */
+    int pass;
+    for(pass = 0; pass < 2; pass++) {
+	size_t *pred_fill = NULL;
+	size_t *succ_fill = NULL;
+	if(pass == 1) {
+	    for(i = 0; i < w->n; i++) {
+		w->pred_first[i + 1] += w->pred_first[i];
+		w->succ_first[i + 1] += w->succ_first[i];
+	    }
+	    w->preds = malloc(sizeof(size_t) * (w->pred_first[w->n] + 1));
+	    w->succs = malloc(sizeof(size_t) * (w->succ_first[w->n] + 1));
+	    pred_fill = calloc(w->n + 1, sizeof(size_t));
+	    succ_fill = calloc(w->n + 1, sizeof(size_t));
+	    if(w->preds == NULL || w->succs == NULL || pred_fill == NULL || succ_fill == NULL) {
+		free(pred_fill);
+		free(succ_fill);
+		goto out;
+	    }
+	}
+	for(i = 0; i < w->n; i++) {
+	    struct aary *deps = (struct aary *) arcp_load(&w->nodes[i]->deps);
+	    if(deps == NULL) {
+		continue;
+	    }
+	    for(j = 0; j < aary_length(deps); j++) {
+		struct gln_plan_weakref key = { (struct arcp_weakref *) aary_load_phantom(deps, j), 0 };
+		struct gln_plan_weakref *found = bsearch(&key, lookup, w->n, sizeof(struct gln_plan_weakref),
+							 gln_plan_weakref_cmp);
+		if(found == NULL) {
+		    continue;
+		}
+		if(pass == 0) {
+		    w->pred_first[i + 1]++;
+		    w->succ_first[found->index + 1]++;
+		} else {
+		    w->preds[w->pred_first[i] + pred_fill[i]++] = found->index;
+		    w->succs[w->succ_first[found->index] + succ_fill[found->index]++] = i;
+		}
+	    }
+	    arcp_release(deps);
+	}
+	free(pred_fill);
+	free(succ_fill);
+    }
+    r = 0;
+
+out:
+    free(lookup);
+    return r;
+}
+
+/* Topological order, then upward ranks: a node's cost plus the most
+ * expensive path from it to the end of the cycle. */
+static int gln_plan_rank(struct gln_plan_work *w) {
+    size_t i, j;
+    size_t *indegree = calloc(w->n + 1, sizeof(size_t));
+    w->topo = malloc(sizeof(size_t) * (w->n + 1));
+    w->ranks = malloc(sizeof(struct gln_plan_rank) * (w->n + 1));
+    if(indegree == NULL || w->topo == NULL || w->ranks == NULL) {
+	free(indegree);
+	return -1;
+    }
+    size_t head = 0, tail = 0;
+    for(i = 0; i < w->n; i++) {
+	indegree[i] = w->pred_first[i + 1] - w->pred_first[i];
+	if(indegree[i] == 0) {
+	    w->topo[tail++] = i;
+	}
+    }
+    while(head < tail) {
+	size_t n = w->topo[head++];
+	for(j = w->succ_first[n]; j < w->succ_first[n + 1]; j++) {
+	    if(--indegree[w->succs[j]] == 0) {
+		w->topo[tail++] = w->succs[j];
+	    }
+	}
+    }
+    free(indegree);
+    if(tail < w->n) {
+	/* Nodes that pulled from each other; there's no order to
+	 * give them. */
+	errno = EINVAL;
+	return -1;
+    }
+
+    for(i = w->n; i > 0; i--) {
+	size_t n = w->topo[i - 1];
+	uint64_t longest = 0;
+	for(j = w->succ_first[n]; j < w->succ_first[n + 1]; j++) {
+	    uint64_t path = GLN_PLAN_SYNC_COST + w->ranks[w->succs[j]].rank;
+	    if(path > longest) {
+		longest = path;
+	    }
+	}
+	w->ranks[n].rank = w->nodes[n]->cost + longest;
+	w->ranks[n].topo = i - 1;
+	w->ranks[n].index = n;
+    }
+    /* Every node ranks above anything that depends on it, so this is
+     * also a dependency order. */
+    qsort(w->ranks, w->n, sizeof(struct gln_plan_rank), gln_plan_rank_cmp);
+    return 0;
+}
+
+/* Puts each node, in rank order, on the thread where it would finish
+ * first. */
+static int gln_plan_assign(struct gln_plan_work *w, int nthreads, size_t *thread_count) {
+    size_t i, j;
+    int t;
+    uint64_t *available = calloc(nthreads, sizeof(uint64_t));
+    w->thread = malloc(sizeof(int) * (w->n + 1));
+    w->finish = malloc(sizeof(uint64_t) * (w->n + 1));
+    w->position = malloc(sizeof(size_t) * (w->n + 1));
+    if(available == NULL || w->thread == NULL || w->finish == NULL || w->position == NULL) {
+	free(available);
+	return -1;
+    }
+    for(i = 0; i < w->n; i++) {
+	size_t n = w->ranks[i].index;
+	int best = 0;
+	uint64_t best_finish = UINT64_MAX;
+	for(t = 0; t < nthreads; t++) {
+	    uint64_t start = available[t];
+	    for(j = w->pred_first[n]; j < w->pred_first[n + 1]; j++) {
+		size_t p = w->preds[j];
+		uint64_t ready = w->finish[p] + (w->thread[p] == t ? 0 : GLN_PLAN_SYNC_COST);
+		if(ready > start) {
+		    start = ready;
+		}
+	    }
+	    if(start + w->nodes[n]->cost < best_finish) {
+		best = t;
+		best_finish = start + w->nodes[n]->cost;
+	    }
+	}
+	w->thread[n] = best;
+	w->finish[n] = best_finish;
+	available[best] = best_finish;
+	thread_count[best]++;
+    }
+    free(available);
+    return 0;
+}
+
+struct gln_plan *gln_plan_create(struct gln_graph *graph, int nthreads) {
+    size_t i, j;
+    int t;
+    if(nthreads <= 0 || (nthreads > 1 && (graph->flags & GLN_GRAPH_SINGLE_THREADED))) {
+	errno = EINVAL;
+	return NULL;
+    }
+    struct gln_plan_work w;
+    memset(&w, 0, sizeof(struct gln_plan_work));
+    struct gln_plan *plan = amalloc(sizeof(struct gln_plan));
+    if(plan == NULL) {
+	return NULL;
+    }
+    plan->thread_start = calloc(nthreads + 1, sizeof(size_t));
+    if(plan->thread_start == NULL) {
+	goto undo0;
+    }
+    if(gln_plan_edges(graph, &w) != 0
+       || gln_plan_rank(&w) != 0
+       || gln_plan_assign(&w, nthreads, plan->thread_start + 1) != 0) {
+	goto undo1;
+    }
+
+    plan->tasks = calloc(w.n + 1, sizeof(struct gln_plan_task));
+    plan->succs = malloc(sizeof(size_t) * (w.succ_first[w.n] + 1));
+    if(plan->tasks == NULL || plan->succs == NULL) {
+	goto undo2;
+    }
+
+    /* Each thread's tasks are in the order they were placed. */
+    for(t = 0; t < nthreads; t++) {
+	plan->thread_start[t + 1] += plan->thread_start[t];
+    }
+    size_t *fill = calloc(nthreads, sizeof(size_t));
+    if(fill == NULL) {
+	goto undo2;
+    }
+    for(i = 0; i < w.n; i++) {
+	size_t n = w.ranks[i].index;
+	t = w.thread[n];
+	w.position[n] = plan->thread_start[t] + fill[t]++;
+    }
+    free(fill);
+
+    size_t nsuccs = 0;
+    for(i = 0; i < w.n; i++) {
+	struct gln_plan_task *task = &plan->tasks[w.position[i]];
+	task->node = w.nodes[i];
+	w.nodes[i] = NULL;
+	task->succs = plan->succs + nsuccs;
+	for(j = w.succ_first[i]; j < w.succ_first[i + 1]; j++) {
+	    size_t s = w.succs[j];
+	    if(w.thread[s] != w.thread[i]) {
+		task->succs[task->nsuccs++] = w.position[s];
+		nsuccs++;
+	    }
+	}
+	for(j = w.pred_first[i]; j < w.pred_first[i + 1]; j++) {
+	    if(w.thread[w.preds[j]] != w.thread[i]) {
+		task->remote_preds++;
+	    }
+	}
+	atomic_init(&task->pending, task->remote_preds);
+    }
+
+    plan->ntasks = w.n;
+    plan->nthreads = nthreads;
+    plan->graph = (struct gln_graph *) gln_acquire(graph);
+    atomic_init(&plan->arrived, 0);
+    atomic_init(&plan->cycle, 0);
+    gln_plan_work_free(&w);
+    arcp_region_init(plan, (void (*)(struct arcp_region *)) __gln_plan_destroy);
+    return plan;
+
+undo2:
+    free(plan->tasks);
+    free(plan->succs);
+undo1:
+    gln_plan_work_free(&w);
+    free(plan->thread_start);
+undo0:
+    afree(plan, sizeof(struct gln_plan));
+    return NULL;
+}
+
+/* Waits for every thread to arrive; the last one in starts the next
+ * cycle. */
+static void gln_plan_barrier(struct gln_plan *plan) {
+    size_t i;
+    unsigned int cycle = atomic_load(&plan->cycle);
+    if(atomic_fetch_add(&plan->arrived, 1) + 1 == (unsigned int) plan->nthreads) {
+	gln_graph_reset(plan->graph);
+	for(i = 0; i < plan->ntasks; i++) {
+	    atomic_store_explicit(&plan->tasks[i].pending, plan->tasks[i].remote_preds, memory_order_relaxed);
+	}
+	atomic_store(&plan->arrived, 0);
+	atomic_fetch_add(&plan->cycle, 1);
+	gln_futex_wake(&plan->cycle, INT_MAX, false);
+	return;
+    }
+    while(atomic_load(&plan->cycle) == cycle) {
+	gln_futex_wait(&plan->cycle, cycle, false, NULL);
+    }
+}
+
+int gln_plan_run(struct gln_plan *plan, int thread) {
+    size_t i, j;
+    int r = 0;
+    if(thread < 0 || thread >= plan->nthreads) {
+	errno = EINVAL;
+	return -1;
+    }
+    gln_plan_barrier(plan);
+
+    for(i = plan->thread_start[thread]; i < plan->thread_start[thread + 1]; i++) {
+	struct gln_plan_task *task = &plan->tasks[i];
+	unsigned int pending;
+	int spins = 0;
+	while((pending = atomic_load_explicit(&task->pending, memory_order_acquire)) != 0) {
+	    if(spins++ < GLN_PLAN_SPINS) {
+		cpu_yield();
+	    } else {
+		gln_futex_wait(&task->pending, pending, false, NULL);
+	    }
+	}
+
+	/* Somebody pulling from outside the plan may have gotten here
+	 * first; if so, wait for them. */
+	enum gln_node_state state = GLNN_READY;
+	if(atomic_compare_exchange_strong_explicit(&task->node->state, (int *) &state, GLNN_PENDING,
+						   memory_order_acq_rel, memory_order_acquire)) {
+	    gln_graph_run(plan->graph, task->node);
+	}
+	spins = 0;
+	while((state = atomic_load_explicit(&task->node->state, memory_order_acquire)) == GLNN_PENDING) {
+	    if(spins++ < GLN_WAIT_SPINS) {
+		GLN_PROBE1(wait_spin, task->node);
+		cpu_yield();
+	    } else {
+		gln_graph_wait(plan->graph, task->node, NULL);
+	    }
+	}
+	if(state == GLNN_ERROR) {
+	    r = -1;
+	}
+
+	for(j = 0; j < task->nsuccs; j++) {
+	    struct gln_plan_task *succ = &plan->tasks[task->succs[j]];
+	    if(atomic_fetch_sub_explicit(&succ->pending, 1, memory_order_release) == 1) {
+		gln_futex_wake(&succ->pending, 1, false);
+	    }
+	}
+    }
+    return r;
+}
+
+struct gln_node *gln_plan_get_node(struct gln_plan *plan, int thread, size_t index) {
+    if(thread < 0 || thread >= plan->nthreads
+       || index >= plan->thread_start[thread + 1] - plan->thread_start[thread]) {
+	return NULL;
+    }
+    return plan->tasks[plan->thread_start[thread] + index].node;
+}
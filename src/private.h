@@ -0,0 +1,187 @@
+/*
+ * private.h
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Interfaces shared between the library's source files. */
+
+#ifndef GLN_PRIVATE_H
+#define GLN_PRIVATE_H
+
+#include "graphline.h"
+
+#define GLN_BUFFER_OVERHEAD (offsetof(struct gln_buffer, data))
+
+/* Another reference to a region the caller already holds one to.
+ * atomickit only counts references held by its pointers, so this
+ * points one at the region and hands the caller the reference it
+ * took, leaving the pointer unreleased. */
+static inline struct arcp_region *gln_acquire(struct arcp_region *region) {
+    arcp_t ref;
+    arcp_init(&ref, region);
+    return arcp_load_phantom(&ref);
+}
+
+/* A view has no data of its own; it points into the buffer it keeps
+ * alive.  Views of views point into the original buffer. */
+struct gln_view_buffer {
+    struct gln_memstat *mem;
+    struct gln_buffer *parent;
+    uint8_t *data;
+    size_t length;
+    size_t stride;
+    struct gln_buffer buffer;
+};
+
+void __gln_view_buffer_destroy(struct gln_buffer *buffer);
+
+static inline struct gln_view_buffer *gln_buffer_view(struct gln_buffer *buffer) {
+    if(buffer->destroy != (void (*)(struct arcp_region *)) __gln_view_buffer_destroy) {
+	return NULL;
+    }
+    return (struct gln_view_buffer *) ((uint8_t *) buffer - offsetof(struct gln_view_buffer, buffer));
+}
+
+static inline uint8_t *gln_buffer_data(struct gln_buffer *buffer) {
+    struct gln_view_buffer *view = gln_buffer_view(buffer);
+    return view == NULL ? buffer->data : view->data;
+}
+
+/* A heap buffer of size bytes, with a reference */
+struct gln_buffer *gln_buffer_create(struct gln_memstat *mem, size_t size);
+/* Whether it came from gln_buffer_create */
+bool gln_buffer_heap(struct gln_buffer *buffer);
+
+/* An input's latency compensation (latency.c): in is replaced with
+ * itself delayed, or left if there's nothing to delay. */
+int gln_delay_apply(struct gln_socket *socket, struct gln_buffer **in);
+void gln_delay_destroy(struct gln_delay *delay);
+
+/* The index'th socket of a typed node or a node with ports, or
+ * NULL */
+struct gln_socket *gln_node_socket(struct gln_node *node, int index);
+/* The function that does the node's work: process, or for a node
+ * from gln_node_create_ext, the binding's own */
+uintptr_t gln_node_transform(struct gln_node *node);
+
+/* The socket's buffer, or for an input of an owned graph that hasn't
+ * kept one, its output's.  Doesn't take a reference. */
+struct gln_buffer *gln_socket_buffer(struct gln_socket *socket);
+
+#define GLN_CACHE_LINE 64
+/* How much of each input to prefetch for a consumer */
+#define GLN_PREFETCH_BYTES 1024
+
+static inline void gln_prefetch_buffer(struct gln_buffer *buffer) {
+    struct gln_view_buffer *view = gln_buffer_view(buffer);
+    uint8_t *data = buffer->data;
+    size_t size = buffer->size - GLN_BUFFER_OVERHEAD;
+    size_t offset;
+    if(view != NULL) {
+	/* Only the start of each element is certain to be there */
+	data = view->data;
+	size = (view->length - 1) * view->stride + 1;
+    }
+    if(size > GLN_PREFETCH_BYTES) {
+	size = GLN_PREFETCH_BYTES;
+    }
+    for(offset = 0; offset < size; offset += GLN_CACHE_LINE) {
+	__builtin_prefetch(data + offset, 0, 3);
+    }
+}
+
+/* Queue a node for processing, and let the graph's scheduler know. */
+int gln_graph_enqueue(struct gln_graph *graph, struct gln_node *node);
+/* Take a node off the processing queue, or NULL if there is none. */
+struct gln_node *gln_graph_dequeue(struct gln_graph *graph);
+/* Run a pending node's process function and set its final state. */
+void gln_node_run(struct gln_node *node);
+/* Run a dequeued node unless the cycle has been cancelled, and cancel
+ * it if the node fails. */
+void gln_graph_run(struct gln_graph *graph, struct gln_node *node);
+/* Spins before a waiting thread parks in gln_graph_wait */
+#define GLN_WAIT_SPINS 100
+/* Wakes any threads parked in gln_graph_wait. */
+void gln_graph_signal(struct gln_graph *graph);
+/* Blocks until node leaves GLNN_PENDING, something is queued, or the
+ * cycle is cancelled.  May return early.  Given a deadline (initially
+ * 0), fails with ETIMEDOUT and cancels the cycle once the graph's
+ * timeout has passed since the first call that parked. */
+int gln_graph_wait(struct gln_graph *graph, struct gln_node *node, uint64_t *deadline);
+/* CLOCK_MONOTONIC in ns */
+uint64_t gln_now(void);
+/* Set while the calling thread is in gln_graph_profile */
+extern __thread bool gln_profiling;
+
+/* memo.c */
+struct gln_memo_key {
+    bool valid;
+    uint64_t hash[2];
+};
+
+/* Pulls a memoized node's inputs and looks up what they hash to.  On
+ * a hit the cached buffers are set on the node's outputs.  On a miss
+ * the outputs are cleared, so that nothing cached gets written over,
+ * and the key is left for gln_memo_store. */
+bool gln_memo_lookup(struct gln_memo_cache *cache, struct gln_node *node, struct gln_memo_key *key);
+/* Caches the outputs the node just made */
+void gln_memo_store(struct gln_memo_cache *cache, struct gln_node *node, const struct gln_memo_key *key);
+
+/* memory.c */
+/* Rough sizes of atomickit allocations, for accounting */
+#define GLN_MEM_LIST_ENTRY sizeof(void *)
+#define GLN_MEM_WEAKREF (4 * sizeof(void *))
+
+/* Statistics charged to stat are also charged to its parent, which it
+ * keeps a reference to. */
+struct gln_memstat *gln_memstat_create(struct gln_memstat *parent);
+struct gln_memstat *gln_memstat_acquire(struct gln_memstat *stat);
+void gln_memstat_release(struct gln_memstat *stat);
+/* Fails with ENOMEM, charging nothing, if any budget would be
+ * exceeded. */
+int gln_mem_charge(struct gln_memstat *stat, enum gln_mem_class class, size_t size);
+void gln_mem_credit(struct gln_memstat *stat, enum gln_mem_class class, size_t size);
+size_t gln_mem_live(struct gln_memstat *stat, enum gln_mem_class class);
+
+/* registry.c */
+void gln_registry_init(struct gln_registry *registry);
+/* Releases everything still registered */
+void gln_registry_destroy(struct gln_registry *registry);
+/* Stores a reference to ref; returns its index, or -1. */
+ssize_t gln_registry_add(struct gln_registry *registry, struct arcp_region *ref);
+/* Frees the index if it still holds ref. */
+void gln_registry_remove(struct gln_registry *registry, size_t index, struct arcp_region *ref);
+/* Every index in use is below this */
+size_t gln_registry_end(struct gln_registry *registry);
+size_t gln_registry_count(struct gln_registry *registry);
+/* NULL for free indices */
+struct arcp_region *gln_registry_load(struct gln_registry *registry, size_t index);
+struct arcp_region *gln_registry_load_phantom(struct gln_registry *registry, size_t index);
+
+/* The node in the graph's index'th slot, with a reference, or NULL. */
+struct gln_node *gln_graph_load_node(struct gln_graph *graph, size_t index);
+
+/* snapshot.c */
+/* Where gln_graph_save, called just now, would put the socket. */
+int gln_snapshot_locate(struct gln_graph *graph, struct gln_socket *socket,
+			uint32_t *node_index, uint32_t *socket_index);
+
+/* scheduler.c */
+void gln_sched_bell_ring(struct gln_sched_bell *bell);
+
+#endif /* ! GLN_PRIVATE_H */
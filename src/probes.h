@@ -0,0 +1,57 @@
+/*
+ * probes.h
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GLN_PROBES_H
+#define GLN_PROBES_H
+
+/* Static tracing probes, in the "graphline" provider.  Built with
+ * GLN_SDT defined, these are USDT probes that perf and bpftrace can
+ * attach to; a disabled probe is a single nop.  Otherwise they
+ * compile to nothing.
+ *
+ * node_enqueue(graph, node)	node queued for processing
+ * node_dequeue(graph, node)	node taken off the queue
+ * process_begin(node)		process function about to run
+ * process_end(node, state)	process function done; final state
+ * graph_reset(graph)		nodes made ready for the next cycle
+ * buffer_alloc(socket, size)	gln_alloc_buffer allocated
+ * buffer_reuse(socket, size)	gln_alloc_buffer reused the last buffer
+ * connect_retry(socket)	connect transaction conflicted
+ * disconnect_retry(socket)	disconnect transaction conflicted
+ * pull_retry(count)		input transaction conflicted
+ * wait_spin(node)		spun waiting on another thread's node
+ * wait_park(node)		parked waiting on another thread's node
+ * memo_hit(node)		cached outputs used instead of processing */
+
+#ifdef GLN_SDT
+
+#include <sys/sdt.h>
+
+#define GLN_PROBE1(name, a) DTRACE_PROBE1(graphline, name, a)
+#define GLN_PROBE2(name, a, b) DTRACE_PROBE2(graphline, name, a, b)
+
+#else
+
+#define GLN_PROBE1(name, a) ((void) 0)
+#define GLN_PROBE2(name, a, b) ((void) 0)
+
+#endif
+
+#endif /* ! GLN_PROBES_H */
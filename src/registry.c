@@ -0,0 +1,209 @@
+/*
+ * registry.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomickit/atomic.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+
+/* Slots live in chunks that double in size, so a slot never moves
+ * and nothing is ever copied as the registry grows.  Free slots are
+ * kept on a stack threaded through the slots themselves; the top of
+ * the stack carries a tag against ABA. */
+struct gln_registry_slot {
+    arcp_t ref;
+    volatile atomic_size_t next_free;
+};
+
+#define GLN_REGISTRY_FREE_INDEX(head) ((size_t) ((head) & 0xffffffffull))
+#define GLN_REGISTRY_FREE_TAG(head) ((head) >> 32)
+#define GLN_REGISTRY_MAX 0xffffffffull
+
+static inline size_t gln_registry_chunk_size(int chunk) {
+    return (size_t) GLN_REGISTRY_FIRST << chunk;
+}
+
+static inline int gln_registry_chunk(size_t index, size_t *offset) {
+    unsigned long long n = index / GLN_REGISTRY_FIRST + 1;
+    int chunk = 63 - __builtin_clzll(n);
+    *offset = index - GLN_REGISTRY_FIRST * (((size_t) 1 << chunk) - 1);
+    return chunk;
+}
+
+/* The slot, or NULL if its chunk isn't there yet. */
+static struct gln_registry_slot *gln_registry_slot(struct gln_registry *registry, size_t index) {
+    size_t offset;
+    int chunk = gln_registry_chunk(index, &offset);
+    struct gln_registry_slot *slots = (struct gln_registry_slot *) atomic_load_explicit(&registry->chunks[chunk], memory_order_acquire);
+    return slots == NULL ? NULL : &slots[offset];
+}
+
+static struct gln_registry_slot *gln_registry_slot_alloc(struct gln_registry *registry, size_t index) {
+    size_t offset;
+    size_t i;
+    int chunk = gln_registry_chunk(index, &offset);
+    if(chunk >= GLN_REGISTRY_CHUNKS) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    struct gln_registry_slot *slots = (struct gln_registry_slot *) atomic_load_explicit(&registry->chunks[chunk], memory_order_acquire);
+    if(slots != NULL) {
+	return &slots[offset];
+    }
+    size_t size = gln_registry_chunk_size(chunk);
+    slots = amalloc(sizeof(struct gln_registry_slot) * size);
+    if(slots == NULL) {
+	return NULL;
+    }
+    for(i = 0; i < size; i++) {
+	arcp_init(&slots[i].ref, NULL);
+	atomic_init(&slots[i].next_free, 0);
+    }
+    uintptr_t expected = 0;
+    if(!atomic_compare_exchange_strong_explicit(&registry->chunks[chunk], &expected, (uintptr_t) slots,
+						memory_order_acq_rel, memory_order_acquire)) {
+	/* Somebody else got there first */
+	afree(slots, sizeof(struct gln_registry_slot) * size);
+	slots = (struct gln_registry_slot *) expected;
+    }
+    return &slots[offset];
+}
+
+void gln_registry_init(struct gln_registry *registry) {
+    int i;
+    for(i = 0; i < GLN_REGISTRY_CHUNKS; i++) {
+	atomic_init(&registry->chunks[i], 0);
+    }
+    atomic_init(&registry->end, 0);
+    atomic_init(&registry->count, 0);
+    atomic_init(&registry->free, 0);
+}
+
+void gln_registry_destroy(struct gln_registry *registry) {
+    int i;
+    size_t j;
+    for(i = 0; i < GLN_REGISTRY_CHUNKS; i++) {
+	struct gln_registry_slot *slots = (struct gln_registry_slot *) atomic_load(&registry->chunks[i]);
+	if(slots == NULL) {
+	    continue;
+	}
+	for(j = 0; j < gln_registry_chunk_size(i); j++) {
+	    arcp_store(&slots[j].ref, NULL);
+	}
+	afree(slots, sizeof(struct gln_registry_slot) * gln_registry_chunk_size(i));
+	atomic_store(&registry->chunks[i], 0);
+    }
+    atomic_store(&registry->end, 0);
+    atomic_store(&registry->count, 0);
+    atomic_store(&registry->free, 0);
+}
+
+/* Index + 1 of a free slot, or 0 */
+static size_t gln_registry_pop_free(struct gln_registry *registry) {
+    unsigned long long head = atomic_load_explicit(&registry->free, memory_order_acquire);
+    for(;;) {
+	size_t top = GLN_REGISTRY_FREE_INDEX(head);
+	if(top == 0) {
+	    return 0;
+	}
+	/* Slots are never freed, so this is safe to read even if
+	 * somebody else has taken it meanwhile; the tag catches
+	 * that. */
+	size_t next = atomic_load_explicit(&gln_registry_slot(registry, top - 1)->next_free, memory_order_relaxed);
+	unsigned long long new_head = ((GLN_REGISTRY_FREE_TAG(head) + 1) << 32) | next;
+	if(atomic_compare_exchange_weak_explicit(&registry->free, &head, new_head,
+						 memory_order_acq_rel, memory_order_acquire)) {
+	    return top;
+	}
+    }
+}
+
+static void gln_registry_push_free(struct gln_registry *registry, size_t index) {
+    struct gln_registry_slot *slot = gln_registry_slot(registry, index);
+    unsigned long long head = atomic_load_explicit(&registry->free, memory_order_relaxed);
+    unsigned long long new_head;
+    do {
+	atomic_store_explicit(&slot->next_free, GLN_REGISTRY_FREE_INDEX(head), memory_order_relaxed);
+	new_head = ((GLN_REGISTRY_FREE_TAG(head) + 1) << 32) | (index + 1);
+    } while(!atomic_compare_exchange_weak_explicit(&registry->free, &head, new_head,
+						   memory_order_release, memory_order_relaxed));
+}
+
+ssize_t gln_registry_add(struct gln_registry *registry, struct arcp_region *ref) {
+    struct gln_registry_slot *slot;
+    size_t index = gln_registry_pop_free(registry);
+    if(index != 0) {
+	index--;
+	slot = gln_registry_slot(registry, index);
+    } else {
+	index = atomic_fetch_add_explicit(&registry->end, 1, memory_order_relaxed);
+	if(index >= GLN_REGISTRY_MAX) {
+	    atomic_fetch_sub_explicit(&registry->end, 1, memory_order_relaxed);
+	    errno = ENOMEM;
+	    return -1;
+	}
+	slot = gln_registry_slot_alloc(registry, index);
+	if(slot == NULL) {
+	    /* The index is lost to everybody else too, which is
+	     * fine: it just reads as empty. */
+	    return -1;
+	}
+    }
+    arcp_store(&slot->ref, ref);
+    atomic_fetch_add_explicit(&registry->count, 1, memory_order_relaxed);
+    return index;
+}
+
+void gln_registry_remove(struct gln_registry *registry, size_t index, struct arcp_region *ref) {
+    struct gln_registry_slot *slot = gln_registry_slot(registry, index);
+    if(slot == NULL) {
+	return;
+    }
+    struct arcp_region *current = arcp_load(&slot->ref);
+    if(current != ref) {
+	/* Already removed */
+	arcp_release(current);
+	return;
+    }
+    if(arcp_compare_store_release(&slot->ref, current, NULL)) {
+	atomic_fetch_sub_explicit(&registry->count, 1, memory_order_relaxed);
+	gln_registry_push_free(registry, index);
+    }
+}
+
+size_t gln_registry_end(struct gln_registry *registry) {
+    return atomic_load_explicit(&registry->end, memory_order_acquire);
+}
+
+size_t gln_registry_count(struct gln_registry *registry) {
+    return atomic_load_explicit(&registry->count, memory_order_relaxed);
+}
+
+struct arcp_region *gln_registry_load(struct gln_registry *registry, size_t index) {
+    struct gln_registry_slot *slot = gln_registry_slot(registry, index);
+    return slot == NULL ? NULL : arcp_load(&slot->ref);
+}
+
+struct arcp_region *gln_registry_load_phantom(struct gln_registry *registry, size_t index) {
+    struct gln_registry_slot *slot = gln_registry_slot(registry, index);
+    return slot == NULL ? NULL : arcp_load_phantom(&slot->ref);
+}
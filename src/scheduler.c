@@ -0,0 +1,372 @@
+/*
+ * scheduler.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomickit/atomic-array.h>
+#include <atomickit/atomic-queue.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+#include "futex.h"
+
+/* Nodes handed to a worker by the others, under affinity, go in its
+ * mailbox, which it empties before looking for other work. */
+struct gln_worker {
+    struct gln_scheduler *scheduler;
+    int index;
+    volatile atomic_bool busy;
+    aqueue_t mailbox;
+};
+
+static uint64_t gln_thread_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void gln_sched_bell_ring(struct gln_sched_bell *bell) {
+    atomic_fetch_add(&bell->work_seq, 1);
+    if(atomic_load(&bell->sleepers) != 0) {
+	gln_futex_wake(&bell->work_seq, 1, false);
+    }
+}
+
+static void __gln_sched_bell_destroy(struct gln_sched_bell *bell) {
+    afree(bell, sizeof(struct gln_sched_bell));
+}
+
+/* The graph with queued work in the highest class with the lowest
+ * virtual runtime, or NULL. */
+static struct gln_graph *gln_scheduler_pick(struct aary *graphs) {
+    struct gln_graph *best = NULL;
+    unsigned long long best_vruntime = 0;
+    size_t i;
+    for(i = 0; i < aary_length(graphs); i++) {
+	struct gln_graph *graph = (struct gln_graph *) aary_load_phantom(graphs, i);
+	if(atomic_load_explicit(&graph->sched.queued, memory_order_relaxed) <= 0) {
+	    continue;
+	}
+	unsigned long long vruntime = atomic_load_explicit(&graph->sched.vruntime, memory_order_relaxed);
+	if(best == NULL
+	   || graph->sched.class > best->sched.class
+	   || (graph->sched.class == best->sched.class && vruntime < best_vruntime)) {
+	    best = graph;
+	    best_vruntime = vruntime;
+	}
+    }
+    return best;
+}
+
+static void gln_scheduler_account(struct gln_scheduler *scheduler, struct gln_graph *graph, uint64_t elapsed) {
+    atomic_fetch_add_explicit(&graph->sched.cpu_time, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&graph->sched.nodes_run, 1, memory_order_relaxed);
+    uint64_t delta = elapsed * GLN_SCHED_WEIGHT_DEFAULT / graph->sched.weight;
+    uint64_t vruntime = atomic_fetch_add_explicit(&graph->sched.vruntime, delta, memory_order_relaxed) + delta;
+    atomic_store_explicit(&scheduler->vclock, vruntime, memory_order_relaxed);
+}
+
+static void gln_worker_run(struct gln_worker *worker, struct gln_graph *graph, struct gln_node *node) {
+    int last = atomic_exchange_explicit(&node->worker, worker->index, memory_order_relaxed);
+    if(last == worker->index) {
+	atomic_fetch_add_explicit(&graph->sched.affinity_hits, 1, memory_order_relaxed);
+    } else if(last >= 0) {
+	atomic_fetch_add_explicit(&graph->sched.affinity_misses, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&worker->busy, true, memory_order_relaxed);
+    uint64_t start = gln_thread_time();
+    gln_graph_run(graph, node);
+    gln_scheduler_account(worker->scheduler, graph, gln_thread_time() - start);
+    atomic_store_explicit(&worker->busy, false, memory_order_relaxed);
+}
+
+/* Gives the node back to the worker that ran it last, if that's
+ * somebody else and they're free to take it. */
+static bool gln_worker_hand_off(struct gln_worker *worker, struct gln_node *node) {
+    struct gln_scheduler *scheduler = worker->scheduler;
+    int last = atomic_load_explicit(&node->worker, memory_order_relaxed);
+    if(last < 0 || last == worker->index || last >= scheduler->nthreads
+       || atomic_load_explicit(&scheduler->workers[last].busy, memory_order_relaxed)
+       || aqueue_enq(&scheduler->workers[last].mailbox, node) != 0) {
+	return false;
+    }
+    /* Sleepers all share one futex, so wake them all to be sure of
+     * waking the one it's for. */
+    atomic_fetch_add(&scheduler->bell->work_seq, 1);
+    if(atomic_load(&scheduler->bell->sleepers) != 0) {
+	gln_futex_wake(&scheduler->bell->work_seq, INT_MAX, false);
+    }
+    return true;
+}
+
+static void *gln_scheduler_worker(struct gln_worker *worker) {
+    struct gln_scheduler *scheduler = worker->scheduler;
+    while(atomic_load_explicit(&scheduler->running, memory_order_acquire)) {
+	unsigned int seq = atomic_load(&scheduler->bell->work_seq);
+	struct gln_node *node = (struct gln_node *) aqueue_deq(&worker->mailbox);
+	if(node != NULL) {
+	    struct gln_graph *graph = (struct gln_graph *) arcp_weakref_load(node->graph);
+	    if(graph != NULL) {
+		gln_worker_run(worker, graph, node);
+		arcp_release(graph);
+	    }
+	    arcp_release(node);
+	    continue;
+	}
+	struct aary *graphs = (struct aary *) arcp_load(&scheduler->graphs);
+	struct gln_graph *graph = gln_scheduler_pick(graphs);
+	if(graph != NULL) {
+	    node = gln_graph_dequeue(graph);
+	    if(node != NULL) {
+		if(!atomic_load_explicit(&scheduler->affinity, memory_order_relaxed)
+		   || !gln_worker_hand_off(worker, node)) {
+		    gln_worker_run(worker, graph, node);
+		}
+		arcp_release(node);
+	    }
+	    arcp_release(graphs);
+	    continue;
+	}
+	arcp_release(graphs);
+
+	/* Nothing to do; sleep until something is queued. */
+	atomic_fetch_add(&scheduler->bell->sleepers, 1);
+	if(atomic_load(&scheduler->bell->work_seq) == seq
+	   && atomic_load(&scheduler->running)) {
+	    gln_futex_wait(&scheduler->bell->work_seq, seq, false, NULL);
+	}
+	atomic_fetch_sub(&scheduler->bell->sleepers, 1);
+    }
+    return NULL;
+}
+
+static void __gln_scheduler_destroy(struct gln_scheduler *scheduler) {
+    int i;
+    size_t j;
+    atomic_store(&scheduler->running, false);
+    atomic_fetch_add(&scheduler->bell->work_seq, 1);
+    gln_futex_wake(&scheduler->bell->work_seq, INT_MAX, false);
+    for(i = 0; i < scheduler->nthreads; i++) {
+	pthread_join(scheduler->threads[i], NULL);
+    }
+    for(i = 0; i < scheduler->nthreads; i++) {
+	/* Whatever was handed over and not run goes back to its graph
+	 * for the pulling threads */
+	struct gln_node *node;
+	while((node = (struct gln_node *) aqueue_deq(&scheduler->workers[i].mailbox)) != NULL) {
+	    struct gln_graph *graph = (struct gln_graph *) arcp_weakref_load(node->graph);
+	    if(graph != NULL) {
+		atomic_store_explicit(&graph->sched.scheduler, 0, memory_order_release);
+		arcp_store(&graph->sched.bell, NULL);
+		if(gln_graph_enqueue(graph, node) != 0) {
+		    atomic_store_explicit(&node->state, GLNN_ERROR, memory_order_release);
+		    gln_graph_cancel(graph);
+		}
+		arcp_release(graph);
+	    }
+	    arcp_release(node);
+	}
+	aqueue_destroy(&scheduler->workers[i].mailbox);
+    }
+    struct aary *graphs = (struct aary *) arcp_load(&scheduler->graphs);
+    for(j = 0; j < aary_length(graphs); j++) {
+	struct gln_graph *graph = (struct gln_graph *) aary_load_phantom(graphs, j);
+	atomic_store_explicit(&graph->sched.scheduler, 0, memory_order_release);
+	arcp_store(&graph->sched.bell, NULL);
+    }
+    arcp_release(graphs);
+    arcp_store(&scheduler->graphs, NULL);
+    arcp_release(scheduler->bell);
+    free(scheduler->workers);
+    free(scheduler->threads);
+    afree(scheduler, sizeof(struct gln_scheduler));
+}
+
+struct gln_scheduler *gln_scheduler_create(int nthreads) {
+    int i;
+    if(nthreads <= 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    struct gln_scheduler *scheduler = amalloc(sizeof(struct gln_scheduler));
+    if(scheduler == NULL) {
+	goto undo0;
+    }
+    struct aary *empty_array = aary_create(0);
+    if(empty_array == NULL) {
+	goto undo1;
+    }
+    scheduler->threads = malloc(sizeof(pthread_t) * nthreads);
+    if(scheduler->threads == NULL) {
+	goto undo2;
+    }
+    scheduler->workers = malloc(sizeof(struct gln_worker) * nthreads);
+    if(scheduler->workers == NULL) {
+	goto undo3;
+    }
+    scheduler->bell = amalloc(sizeof(struct gln_sched_bell));
+    if(scheduler->bell == NULL) {
+	goto undo4;
+    }
+    for(i = 0; i < nthreads; i++) {
+	scheduler->workers[i].scheduler = scheduler;
+	scheduler->workers[i].index = i;
+	atomic_init(&scheduler->workers[i].busy, false);
+	if(aqueue_init(&scheduler->workers[i].mailbox) != 0) {
+	    goto undo5;
+	}
+    }
+    atomic_init(&scheduler->bell->work_seq, 0);
+    atomic_init(&scheduler->bell->sleepers, 0);
+    arcp_region_init(scheduler->bell, (void (*)(struct arcp_region *)) __gln_sched_bell_destroy);
+    arcp_init(&scheduler->graphs, empty_array);
+    arcp_release(empty_array);
+    atomic_init(&scheduler->running, true);
+    atomic_init(&scheduler->affinity, false);
+    atomic_init(&scheduler->load, 0);
+    atomic_init(&scheduler->vclock, 0);
+    scheduler->nthreads = 0;
+    arcp_region_init(scheduler, (void (*)(struct arcp_region *)) __gln_scheduler_destroy);
+
+    for(i = 0; i < nthreads; i++) {
+	errno = pthread_create(&scheduler->threads[i], NULL,
+			       (void *(*)(void *)) gln_scheduler_worker, &scheduler->workers[i]);
+	if(errno != 0) {
+	    /* Only the workers that started are cleaned up with the
+	     * scheduler */
+	    int j;
+	    for(j = i; j < nthreads; j++) {
+		aqueue_destroy(&scheduler->workers[j].mailbox);
+	    }
+	    arcp_release(scheduler);
+	    return NULL;
+	}
+	scheduler->nthreads++;
+    }
+    return scheduler;
+
+undo5:
+    while(i-- > 0) {
+	aqueue_destroy(&scheduler->workers[i].mailbox);
+    }
+    afree(scheduler->bell, sizeof(struct gln_sched_bell));
+undo4:
+    free(scheduler->workers);
+undo3:
+    free(scheduler->threads);
+undo2:
+    arcp_release(empty_array);
+undo1:
+    afree(scheduler, sizeof(struct gln_scheduler));
+undo0:
+    return NULL;
+}
+
+int gln_scheduler_attach(struct gln_scheduler *scheduler, struct gln_graph *graph,
+			 const struct gln_sched_params *params) {
+    unsigned int load = params == NULL ? 0 : params->load;
+
+    if(graph->flags & GLN_GRAPH_SINGLE_THREADED) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    /* Admission control */
+    if(load != 0) {
+	unsigned int total = atomic_fetch_add(&scheduler->load, load) + load;
+	if(total > (unsigned int) scheduler->nthreads * 1000) {
+	    atomic_fetch_sub(&scheduler->load, load);
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
+
+    uintptr_t expected = 0;
+    if(!atomic_compare_exchange_strong(&graph->sched.scheduler, &expected, (uintptr_t) scheduler)) {
+	atomic_fetch_sub(&scheduler->load, load);
+	errno = EBUSY;
+	return -1;
+    }
+    arcp_store(&graph->sched.bell, scheduler->bell);
+    graph->sched.class = params == NULL ? GLN_SCHED_NORMAL : params->class;
+    graph->sched.weight = (params == NULL || params->weight == 0) ? GLN_SCHED_WEIGHT_DEFAULT : params->weight;
+    graph->sched.load = load;
+    /* Start level with whoever ran last, rather than owed all the
+     * time the other graphs have had. */
+    atomic_store_explicit(&graph->sched.vruntime,
+			  atomic_load_explicit(&scheduler->vclock, memory_order_relaxed),
+			  memory_order_relaxed);
+
+    struct aary *graphs;
+    struct aary *new_graphs;
+    do {
+	graphs = (struct aary *) arcp_load(&scheduler->graphs);
+	new_graphs = aary_dup_set_add(graphs, graph);
+	if(new_graphs == NULL) {
+	    arcp_release(graphs);
+	    arcp_store(&graph->sched.bell, NULL);
+	    atomic_store(&graph->sched.scheduler, 0);
+	    atomic_fetch_sub(&scheduler->load, load);
+	    return -1;
+	}
+    } while(!arcp_compare_store_release(&scheduler->graphs, graphs, new_graphs));
+
+    /* Anything already queued is now ours to run. */
+    gln_sched_bell_ring(scheduler->bell);
+    return 0;
+}
+
+int gln_scheduler_detach(struct gln_scheduler *scheduler, struct gln_graph *graph) {
+    if(atomic_load(&graph->sched.scheduler) != (uintptr_t) scheduler) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    struct aary *graphs;
+    struct aary *new_graphs;
+    do {
+	graphs = (struct aary *) arcp_load(&scheduler->graphs);
+	new_graphs = aary_dup_set_remove(graphs, graph);
+	if(new_graphs == NULL) {
+	    arcp_release(graphs);
+	    return -1;
+	}
+    } while(!arcp_compare_store_release(&scheduler->graphs, graphs, new_graphs));
+
+    atomic_fetch_sub(&scheduler->load, graph->sched.load);
+    graph->sched.load = 0;
+    arcp_store(&graph->sched.bell, NULL);
+    atomic_store(&graph->sched.scheduler, 0);
+    return 0;
+}
+
+void gln_graph_sched_stats(struct gln_graph *graph, struct gln_sched_stats *stats) {
+    stats->cpu_time = atomic_load_explicit(&graph->sched.cpu_time, memory_order_relaxed);
+    stats->nodes_run = atomic_load_explicit(&graph->sched.nodes_run, memory_order_relaxed);
+    stats->vruntime = atomic_load_explicit(&graph->sched.vruntime, memory_order_relaxed);
+    stats->affinity_hits = atomic_load_explicit(&graph->sched.affinity_hits, memory_order_relaxed);
+    stats->affinity_misses = atomic_load_explicit(&graph->sched.affinity_misses, memory_order_relaxed);
+}
+
+void gln_scheduler_set_affinity(struct gln_scheduler *scheduler, bool affinity) {
+    atomic_store_explicit(&scheduler->affinity, affinity, memory_order_relaxed);
+}
@@ -0,0 +1,470 @@
+/*
+ * shm.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomickit/atomic.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+#include "futex.h"
+
+/* The memfd starts with the control area, which is followed by the
+ * data of each slot.  Every process maps each slot's data directly
+ * after a private page, and keeps its own struct gln_buffer header at
+ * the end of that page, so the same data can be a gln_buffer in any
+ * number of processes at once.  The shared refcount of a slot counts
+ * processes (or queued handoffs) holding it, not local references. */
+
+#define GLN_SHM_MAGIC 0x736e6c67
+#define GLN_SHM_VERSION 1
+#define GLN_SHM_NONE UINT32_MAX
+
+#define GLN_SHM_UNCLAIMED 0
+#define GLN_SHM_SENDER 1
+#define GLN_SHM_RECEIVER 2
+
+struct gln_shm_slot {
+    volatile atomic_uint refcount;
+    volatile atomic_uint next_free;
+    uint64_t length;
+};
+
+struct gln_shm_control {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t ring_size;
+    uint64_t slot_size;
+    uint64_t control_size;
+    /* free slot stack; ABA tag in the high word */
+    volatile atomic_ullong free_head;
+    volatile atomic_uint head;
+    volatile atomic_uint tail;
+    volatile atomic_uint receiver_waiting;
+    volatile atomic_uint sender_waiting;
+    struct gln_shm_slot slots[];
+    /* uint32_t ring[ring_size]; */
+};
+
+struct gln_shm_buffer {
+    arcp_t arena;
+    uint32_t slot;
+    struct gln_buffer buffer;
+};
+
+static inline uint32_t *gln_shm_ring(struct gln_shm_control *control) {
+    return (uint32_t *) &control->slots[control->nslots];
+}
+
+static inline uint8_t *gln_shm_slot_data(struct gln_shm_arena *arena, uint32_t slot) {
+    return arena->slots + arena->stride * slot + (arena->stride - arena->slot_size);
+}
+
+static inline struct gln_shm_buffer *gln_shm_slot_buffer(struct gln_shm_arena *arena, uint32_t slot) {
+    return (struct gln_shm_buffer *) (gln_shm_slot_data(arena, slot)
+				      - offsetof(struct gln_shm_buffer, buffer.data));
+}
+
+static uint32_t gln_shm_slot_pop(struct gln_shm_control *control) {
+    unsigned long long head = atomic_load_explicit(&control->free_head, memory_order_acquire);
+    for(;;) {
+	uint32_t slot = (uint32_t) head;
+	if(slot == GLN_SHM_NONE) {
+	    return GLN_SHM_NONE;
+	}
+	uint32_t next = atomic_load_explicit(&control->slots[slot].next_free, memory_order_relaxed);
+	unsigned long long new_head = (((head >> 32) + 1) << 32) | next;
+	if(atomic_compare_exchange_weak_explicit(&control->free_head, &head, new_head,
+						 memory_order_acq_rel, memory_order_acquire)) {
+	    return slot;
+	}
+    }
+}
+
+static void gln_shm_slot_push(struct gln_shm_control *control, uint32_t slot) {
+    unsigned long long head = atomic_load_explicit(&control->free_head, memory_order_relaxed);
+    unsigned long long new_head;
+    do {
+	atomic_store_explicit(&control->slots[slot].next_free, (uint32_t) head, memory_order_relaxed);
+	new_head = (((head >> 32) + 1) << 32) | slot;
+    } while(!atomic_compare_exchange_weak_explicit(&control->free_head, &head, new_head,
+						   memory_order_release, memory_order_relaxed));
+}
+
+static void gln_shm_slot_release(struct gln_shm_control *control, uint32_t slot) {
+    if(atomic_fetch_sub_explicit(&control->slots[slot].refcount, 1, memory_order_acq_rel) == 1) {
+	gln_shm_slot_push(control, slot);
+    }
+}
+
+static void __gln_shm_buffer_destroy(struct gln_buffer *buffer) {
+    struct gln_shm_buffer *shmbuf = (struct gln_shm_buffer *) ((uint8_t *) buffer - offsetof(struct gln_shm_buffer, buffer));
+    struct gln_shm_arena *arena = (struct gln_shm_arena *) arcp_load(&shmbuf->arena);
+    uint32_t slot = shmbuf->slot;
+    /* Once the slot is released, this header may be reinitialized. */
+    arcp_store(&shmbuf->arena, NULL);
+    gln_shm_slot_release(arena->control, slot);
+    arcp_release(arena);
+}
+
+/* Sets up this process's header for a slot whose shared reference we
+ * already hold. */
+static struct gln_shm_buffer *gln_shm_buffer_init(struct gln_shm_arena *arena, uint32_t slot, size_t size) {
+    struct gln_shm_buffer *shmbuf = gln_shm_slot_buffer(arena, slot);
+    arcp_init(&shmbuf->arena, arena);
+    shmbuf->slot = slot;
+    shmbuf->buffer.size = size + GLN_BUFFER_OVERHEAD;
+    arcp_region_init(&shmbuf->buffer, (void (*)(struct arcp_region *)) __gln_shm_buffer_destroy);
+    return shmbuf;
+}
+
+/* Dedicates the mapping to one side, the first time it's used. */
+static int gln_shm_arena_claim(struct gln_shm_arena *arena, int role) {
+    int current = atomic_load_explicit(&arena->role, memory_order_relaxed);
+    if(current == GLN_SHM_UNCLAIMED) {
+	atomic_compare_exchange_strong_explicit(&arena->role, &current, role,
+						memory_order_relaxed, memory_order_relaxed);
+	if(current == GLN_SHM_UNCLAIMED) {
+	    return 0;
+	}
+    }
+    if(current != role) {
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+static void __gln_shm_arena_destroy(struct gln_shm_arena *arena) {
+    munmap(arena->slots, arena->stride * arena->nslots);
+    munmap(arena->control, arena->control_size);
+    close(arena->fd);
+    afree(arena, sizeof(struct gln_shm_arena));
+}
+
+/* Maps the slots of an arena whose control area is already mapped. */
+static struct gln_shm_arena *gln_shm_arena_map(int fd, struct gln_shm_control *control) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t i;
+    struct gln_shm_arena *arena = amalloc(sizeof(struct gln_shm_arena));
+    if(arena == NULL) {
+	return NULL;
+    }
+    arena->fd = fd;
+    arena->control = control;
+    arena->control_size = control->control_size;
+    arena->slot_size = control->slot_size;
+    arena->stride = page + arena->slot_size;
+    arena->nslots = control->nslots;
+    atomic_init(&arena->role, GLN_SHM_UNCLAIMED);
+    arena->slots = mmap(NULL, arena->stride * arena->nslots, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena->slots == MAP_FAILED) {
+	afree(arena, sizeof(struct gln_shm_arena));
+	return NULL;
+    }
+    for(i = 0; i < arena->nslots; i++) {
+	void *data = mmap(gln_shm_slot_data(arena, i), arena->slot_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_FIXED, fd, arena->control_size + arena->slot_size * i);
+	if(data == MAP_FAILED) {
+	    munmap(arena->slots, arena->stride * arena->nslots);
+	    afree(arena, sizeof(struct gln_shm_arena));
+	    return NULL;
+	}
+    }
+    arcp_region_init(arena, (void (*)(struct arcp_region *)) __gln_shm_arena_destroy);
+    return arena;
+}
+
+struct gln_shm_arena *gln_shm_arena_create(size_t nslots, size_t slot_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t i;
+    if(nslots == 0 || nslots >= GLN_SHM_NONE || slot_size == 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    slot_size = (slot_size + page - 1) & ~(page - 1);
+    size_t ring_size = 2;
+    while(ring_size < nslots) {
+	ring_size <<= 1;
+    }
+    size_t control_size = sizeof(struct gln_shm_control)
+	+ sizeof(struct gln_shm_slot) * nslots
+	+ sizeof(uint32_t) * ring_size;
+    control_size = (control_size + page - 1) & ~(page - 1);
+
+    int fd = memfd_create("graphline", MFD_CLOEXEC);
+    if(fd < 0) {
+	return NULL;
+    }
+    if(ftruncate(fd, control_size + slot_size * nslots) != 0) {
+	goto undo0;
+    }
+    struct gln_shm_control *control = mmap(NULL, control_size, PROT_READ | PROT_WRITE,
+					   MAP_SHARED, fd, 0);
+    if(control == MAP_FAILED) {
+	goto undo0;
+    }
+    control->magic = GLN_SHM_MAGIC;
+    control->version = GLN_SHM_VERSION;
+    control->nslots = nslots;
+    control->ring_size = ring_size;
+    control->slot_size = slot_size;
+    control->control_size = control_size;
+    for(i = 0; i < nslots; i++) {
+	atomic_init(&control->slots[i].refcount, 0);
+	atomic_init(&control->slots[i].next_free, i + 1 < nslots ? i + 1 : GLN_SHM_NONE);
+	control->slots[i].length = 0;
+    }
+    atomic_init(&control->free_head, 0);
+    atomic_init(&control->head, 0);
+    atomic_init(&control->tail, 0);
+    atomic_init(&control->receiver_waiting, 0);
+    atomic_init(&control->sender_waiting, 0);
+
+    struct gln_shm_arena *arena = gln_shm_arena_map(fd, control);
+    if(arena == NULL) {
+	goto undo1;
+    }
+    return arena;
+
+undo1:
+    munmap(control, control_size);
+undo0:
+    close(fd);
+    return NULL;
+}
+
+struct gln_shm_arena *gln_shm_arena_open(int fd) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(fd < 0) {
+	return NULL;
+    }
+    if(fstat(fd, &st) != 0) {
+	goto undo0;
+    }
+    if((size_t) st.st_size < page) {
+	errno = EINVAL;
+	goto undo0;
+    }
+    struct gln_shm_control *control = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if(control == MAP_FAILED) {
+	goto undo0;
+    }
+    if(control->magic != GLN_SHM_MAGIC || control->version != GLN_SHM_VERSION
+       || control->control_size + control->slot_size * control->nslots != (uint64_t) st.st_size) {
+	munmap(control, page);
+	errno = EINVAL;
+	goto undo0;
+    }
+    size_t control_size = control->control_size;
+    munmap(control, page);
+    control = mmap(NULL, control_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(control == MAP_FAILED) {
+	goto undo0;
+    }
+
+    struct gln_shm_arena *arena = gln_shm_arena_map(fd, control);
+    if(arena == NULL) {
+	munmap(control, control_size);
+	goto undo0;
+    }
+    return arena;
+
+undo0:
+    close(fd);
+    return NULL;
+}
+
+void *gln_shm_alloc_buffer(struct gln_socket *socket, struct gln_shm_arena *arena, size_t size) {
+    if(gln_shm_arena_claim(arena, GLN_SHM_SENDER) != 0) {
+	return NULL;
+    }
+    if(size > arena->slot_size) {
+	errno = EMSGSIZE;
+	return NULL;
+    }
+    uint32_t slot = gln_shm_slot_pop(arena->control);
+    if(slot == GLN_SHM_NONE) {
+	errno = ENOBUFS;
+	return NULL;
+    }
+    atomic_store_explicit(&arena->control->slots[slot].refcount, 1, memory_order_relaxed);
+    struct gln_shm_buffer *shmbuf = gln_shm_buffer_init(arena, slot, size);
+    arcp_store(&socket->buffer, &shmbuf->buffer);
+    arcp_release(&shmbuf->buffer);
+    return shmbuf->buffer.data;
+}
+
+int gln_shm_send(struct gln_shm_arena *arena, struct gln_socket *socket) {
+    struct gln_shm_control *control = arena->control;
+    uint32_t slot = GLN_SHM_NONE;
+    void *data;
+    int r;
+
+    r = gln_shm_arena_claim(arena, GLN_SHM_SENDER);
+    if(r != 0) {
+	return r;
+    }
+
+    r = gln_get_buffer_list(1, &socket, &data);
+    if(r != 0) {
+	return r;
+    }
+
+    if(data != NULL) {
+	struct gln_buffer *buffer = gln_socket_buffer(socket);
+	size_t length = buffer->size - GLN_BUFFER_OVERHEAD;
+	struct gln_view_buffer *view = gln_buffer_view(buffer);
+	if(view != NULL) {
+	    /* Contiguous views are copied like any other buffer */
+	    if(view->stride != 1) {
+		errno = EINVAL;
+		return -1;
+	    }
+	    length = view->length;
+	} else if(buffer->destroy == (void (*)(struct arcp_region *)) __gln_shm_buffer_destroy) {
+	    struct gln_shm_buffer *shmbuf = (struct gln_shm_buffer *) ((uint8_t *) buffer - offsetof(struct gln_shm_buffer, buffer));
+	    /* Only share slots nobody else holds, so the receiver never
+	     * finds its header for the slot still in use. */
+	    unsigned int refcount = 1;
+	    if(arcp_load_phantom(&shmbuf->arena) == (struct arcp_region *) arena
+	       && atomic_compare_exchange_strong_explicit(&control->slots[shmbuf->slot].refcount, &refcount, 2,
+							  memory_order_acq_rel, memory_order_relaxed)) {
+		slot = shmbuf->slot;
+	    }
+	}
+	if(slot == GLN_SHM_NONE) {
+	    if(length > arena->slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	    }
+	    slot = gln_shm_slot_pop(control);
+	    if(slot == GLN_SHM_NONE) {
+		errno = ENOBUFS;
+		return -1;
+	    }
+	    atomic_store_explicit(&control->slots[slot].refcount, 1, memory_order_relaxed);
+	    memcpy(gln_shm_slot_data(arena, slot), data, length);
+	}
+	control->slots[slot].length = length;
+    }
+
+    /* Wait for room, then publish */
+    unsigned int tail = atomic_load_explicit(&control->tail, memory_order_relaxed);
+    for(;;) {
+	unsigned int head = atomic_load_explicit(&control->head, memory_order_acquire);
+	if(tail - head < control->ring_size) {
+	    break;
+	}
+	atomic_store(&control->sender_waiting, 1);
+	if(atomic_load(&control->head) == head) {
+	    gln_futex_wait(&control->head, head, true, NULL);
+	}
+	atomic_store(&control->sender_waiting, 0);
+    }
+    gln_shm_ring(control)[tail & (control->ring_size - 1)] = slot;
+    atomic_store(&control->tail, tail + 1);
+    if(atomic_load(&control->receiver_waiting)) {
+	gln_futex_wake(&control->tail, 1, true);
+    }
+    return 0;
+}
+
+static int gln_shm_receiver_process(struct gln_shm_receiver *self) {
+    struct gln_shm_arena *arena = (struct gln_shm_arena *) arcp_load_phantom(&self->arena);
+    struct gln_shm_control *control = arena->control;
+
+    unsigned int head = atomic_load_explicit(&control->head, memory_order_relaxed);
+    for(;;) {
+	unsigned int tail = atomic_load_explicit(&control->tail, memory_order_acquire);
+	if(tail != head) {
+	    break;
+	}
+	atomic_store(&control->receiver_waiting, 1);
+	if(atomic_load(&control->tail) == tail) {
+	    gln_futex_wait(&control->tail, tail, true, NULL);
+	}
+	atomic_store(&control->receiver_waiting, 0);
+    }
+    uint32_t slot = gln_shm_ring(control)[head & (control->ring_size - 1)];
+    atomic_store(&control->head, head + 1);
+    if(atomic_load(&control->sender_waiting)) {
+	gln_futex_wake(&control->head, 1, true);
+    }
+
+    if(slot == GLN_SHM_NONE) {
+	arcp_store(&self->out->buffer, NULL);
+	return 0;
+    }
+    if(slot >= arena->nslots) {
+	errno = EPROTO;
+	return -1;
+    }
+    struct gln_shm_buffer *shmbuf = gln_shm_buffer_init(arena, slot, control->slots[slot].length);
+    arcp_store(&self->out->buffer, &shmbuf->buffer);
+    arcp_release(&shmbuf->buffer);
+    return 0;
+}
+
+static void __gln_shm_receiver_destroy(struct gln_shm_receiver *self) {
+    arcp_release(self->out);
+    arcp_store(&self->arena, NULL);
+    gln_node_destroy(self);
+    afree(self, sizeof(struct gln_shm_receiver));
+}
+
+struct gln_shm_receiver *gln_shm_receiver_create(struct gln_graph *graph, struct gln_shm_arena *arena) {
+    int r;
+
+    r = gln_shm_arena_claim(arena, GLN_SHM_RECEIVER);
+    if(r != 0) {
+	return NULL;
+    }
+
+    struct gln_shm_receiver *ret = amalloc(sizeof(struct gln_shm_receiver));
+    if(ret == NULL) {
+	return NULL;
+    }
+    ret->out = NULL;
+    arcp_init(&ret->arena, arena);
+
+    r = gln_node_init(ret, graph, (gln_process_fp_t) gln_shm_receiver_process,
+		      (void (*)(struct gln_node *)) __gln_shm_receiver_destroy);
+    if(r != 0) {
+	arcp_store(&ret->arena, NULL);
+	afree(ret, sizeof(struct gln_shm_receiver));
+	return NULL;
+    }
+
+    ret->out = gln_socket_create(ret, GLNS_OUTPUT);
+    if(ret->out == NULL) {
+	arcp_release(ret);
+	return NULL;
+    }
+    return ret;
+}
@@ -0,0 +1,675 @@
+/*
+ * snapshot.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomickit/atomic-array.h>
+#include <atomickit/atomic-rcp.h>
+#include <atomickit/atomic-txn.h>
+#include "graphline.h"
+#include "private.h"
+
+/* Snapshot layout.  All offsets are from the start of the file, and
+ * every section starts on a GLN_BUFFER_ALIGN boundary:
+ *
+ *   header
+ *   type table        uint64_t[ntypes], offsets of NUL-terminated names
+ *   node records      struct gln_snapshot_node[nnodes]
+ *   connections       struct gln_snapshot_connection[nconnections]
+ *   plan              uint32_t[nnodes], node indices in dependency order
+ *   node parameters
+ *   type names
+ */
+
+#define GLN_SNAPSHOT_MAGIC "GLNSNAP"
+#define GLN_SNAPSHOT_VERSION 1
+#define GLN_SNAPSHOT_BYTEORDER 0x01020304
+
+struct gln_snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint64_t size;
+    uint32_t ntypes;
+    uint32_t nnodes;
+    uint32_t nconnections;
+    uint32_t reserved;
+    uint64_t types_offset;
+    uint64_t nodes_offset;
+    uint64_t connections_offset;
+    uint64_t plan_offset;
+};
+
+struct gln_snapshot_node {
+    uint32_t type;
+    uint32_t nsockets;
+    uint64_t params_offset;
+    uint64_t params_size;
+};
+
+struct gln_snapshot_connection {
+    uint32_t out_node;
+    uint32_t out_socket;
+    uint32_t in_node;
+    uint32_t in_socket;
+};
+
+#define ALIGN_UP(x) (((x) + GLN_BUFFER_ALIGN - 1) & ~((uint64_t) GLN_BUFFER_ALIGN - 1))
+
+/* Node types */
+
+static volatile atomic_uintptr_t gln_node_types;
+
+struct gln_node_type *gln_node_type_find(const char *name) {
+    struct gln_node_type *type;
+    for(type = (struct gln_node_type *) atomic_load_explicit(&gln_node_types, memory_order_acquire);
+	type != NULL;
+	type = type->next) {
+	if(strcmp(type->name, name) == 0) {
+	    return type;
+	}
+    }
+    return NULL;
+}
+
+int gln_node_type_register(struct gln_node_type *type) {
+    uintptr_t head = atomic_load_explicit(&gln_node_types, memory_order_acquire);
+    do {
+	struct gln_node_type *other;
+	for(other = (struct gln_node_type *) head; other != NULL; other = other->next) {
+	    if(other == type) {
+		return 0;
+	    }
+	    if(strcmp(other->name, type->name) == 0) {
+		errno = EEXIST;
+		return -1;
+	    }
+	}
+	type->next = (struct gln_node_type *) head;
+    } while(!atomic_compare_exchange_weak_explicit(&gln_node_types, &head, (uintptr_t) type,
+						   memory_order_acq_rel, memory_order_acquire));
+    return 0;
+}
+
+struct gln_node *gln_node_create_typed(struct gln_graph *graph, const char *name,
+				       const void *params, size_t size) {
+    struct gln_node_type *type = gln_node_type_find(name);
+    if(type == NULL) {
+	errno = ENOENT;
+	return NULL;
+    }
+    struct gln_node *node = type->create(graph, params, size);
+    if(node == NULL) {
+	return NULL;
+    }
+    node->type = type;
+    return node;
+}
+
+/* Nodes owned by a loaded graph */
+
+struct gln_snapshot_nodes {
+    struct arcp_region;
+    size_t count;
+    struct gln_node *nodes[];
+};
+
+static void __gln_snapshot_nodes_destroy(struct gln_snapshot_nodes *list) {
+    size_t i;
+    for(i = 0; i < list->count; i++) {
+	arcp_release(list->nodes[i]);
+    }
+    afree(list, sizeof(struct gln_snapshot_nodes) + sizeof(struct gln_node *) * list->count);
+}
+
+struct gln_node *gln_graph_get_node(struct gln_graph *graph, size_t index) {
+    struct gln_snapshot_nodes *list = (struct gln_snapshot_nodes *) arcp_load(&graph->loaded);
+    if(list == NULL) {
+	return NULL;
+    }
+    struct gln_node *node = NULL;
+    if(index < list->count) {
+	node = (struct gln_node *) gln_acquire(list->nodes[index]);
+    }
+    arcp_release(list);
+    return node;
+}
+
+/* Saving */
+
+struct gln_snapshot_entry {
+    struct gln_node *node;
+    uint32_t index;
+};
+
+static int gln_snapshot_entry_cmp(const void *a, const void *b) {
+    const struct gln_node *na = ((const struct gln_snapshot_entry *) a)->node;
+    const struct gln_node *nb = ((const struct gln_snapshot_entry *) b)->node;
+    return (na > nb) - (na < nb);
+}
+
+static int gln_snapshot_index(struct gln_snapshot_entry *entries, size_t count, struct gln_node *node) {
+    struct gln_snapshot_entry key = { .node = node };
+    struct gln_snapshot_entry *entry = bsearch(&key, entries, count, sizeof(struct gln_snapshot_entry),
+					       gln_snapshot_entry_cmp);
+    if(entry == NULL) {
+	return -1;
+    }
+    return entry->index;
+}
+
+static int gln_socket_index(struct gln_node *node, struct gln_socket *socket) {
+    int i;
+    struct gln_socket *s;
+    for(i = 0; (s = node->type->socket(node, i)) != NULL; i++) {
+	if(s == socket) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* Appends the connections of one output socket to *connections.  */
+static int gln_snapshot_connections(struct gln_socket *socket, uint32_t out_node, uint32_t out_socket,
+				    struct gln_snapshot_entry *entries, size_t nnodes,
+				    struct gln_snapshot_connection **connections,
+				    size_t *nconnections, size_t *capacity) {
+    struct atxn_handle *handle;
+    struct aary *connection_list;
+    enum atxn_status status;
+    size_t i;
+
+retry_load:
+    handle = atxn_start();
+    if(handle == NULL) {
+	return -1;
+    }
+    status = atxn_load(handle, &socket->other, (struct arcp_region **) &connection_list);
+    if(status == ATXN_FAILURE) {
+	atxn_abort(handle);
+	goto retry_load;
+    } else if(status != ATXN_SUCCESS) {
+	atxn_abort(handle);
+	return -1;
+    }
+
+    for(i = 0; i < aary_length(connection_list); i++) {
+	struct gln_socket *other = (struct gln_socket *) arcp_weakref_load((struct arcp_weakref *) aary_load_phantom(connection_list, i));
+	if(other == NULL) {
+	    continue;
+	}
+	struct gln_node *node = (struct gln_node *) arcp_weakref_load(other->node);
+	if(node == NULL) {
+	    arcp_release(other);
+	    continue;
+	}
+	int in_node = gln_snapshot_index(entries, nnodes, node);
+	int in_socket = in_node < 0 ? -1 : gln_socket_index(node, other);
+	arcp_release(node);
+	arcp_release(other);
+	if(in_socket < 0) {
+	    /* Connected to an untyped node */
+	    continue;
+	}
+	if(*nconnections == *capacity) {
+	    size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+	    struct gln_snapshot_connection *new_connections
+		= realloc(*connections, sizeof(struct gln_snapshot_connection) * new_capacity);
+	    if(new_connections == NULL) {
+		atxn_abort(handle);
+		return -1;
+	    }
+	    *connections = new_connections;
+	    *capacity = new_capacity;
+	}
+	struct gln_snapshot_connection *c = &(*connections)[(*nconnections)++];
+	c->out_node = out_node;
+	c->out_socket = out_socket;
+	c->in_node = in_node;
+	c->in_socket = in_socket;
+    }
+    atxn_abort(handle);
+    return 0;
+}
+
+/* Topological sort of the nodes along the connections; producers come
+ * before their consumers. */
+static int gln_snapshot_plan(size_t nnodes, struct gln_snapshot_connection *connections,
+			     size_t nconnections, uint32_t *plan) {
+    size_t *first = calloc(nnodes + 1, sizeof(size_t));
+    uint32_t *edges = malloc(sizeof(uint32_t) * (nconnections + 1));
+    uint32_t *indegree = calloc(nnodes + 1, sizeof(uint32_t));
+    if(first == NULL || edges == NULL || indegree == NULL) {
+	free(first);
+	free(edges);
+	free(indegree);
+	return -1;
+    }
+    size_t i, j;
+    for(i = 0; i < nconnections; i++) {
+	first[connections[i].out_node + 1]++;
+	indegree[connections[i].in_node]++;
+    }
+    for(i = 0; i < nnodes; i++) {
+	first[i + 1] += first[i];
+    }
+    size_t *fill = calloc(nnodes + 1, sizeof(size_t));
+    if(fill == NULL) {
+	free(first);
+	free(edges);
+	free(indegree);
+	return -1;
+    }
+    for(i = 0; i < nconnections; i++) {
+	uint32_t out = connections[i].out_node;
+	edges[first[out] + fill[out]++] = connections[i].in_node;
+    }
+    free(fill);
+
+    size_t head = 0, tail = 0;
+    for(i = 0; i < nnodes; i++) {
+	if(indegree[i] == 0) {
+	    plan[tail++] = i;
+	}
+    }
+    while(head < tail) {
+	uint32_t n = plan[head++];
+	for(j = first[n]; j < first[n + 1]; j++) {
+	    if(--indegree[edges[j]] == 0) {
+		plan[tail++] = edges[j];
+	    }
+	}
+    }
+    if(tail < nnodes) {
+	/* Shouldn't happen in an acyclic graph; keep whatever's left in
+	 * index order so the plan is still a permutation. */
+	for(i = 0; i < nnodes; i++) {
+	    if(indegree[i] != 0) {
+		plan[tail++] = i;
+	    }
+	}
+    }
+
+    free(first);
+    free(edges);
+    free(indegree);
+    return 0;
+}
+
+int gln_graph_save(struct gln_graph *graph, const char *path) {
+    int r = -1;
+    size_t i, j;
+    size_t end = gln_registry_end(&graph->nodes);
+    size_t nnodes = 0;
+    size_t ntypes = 0;
+    size_t nconnections = 0, connections_capacity = 0;
+    struct gln_node **nodes = malloc(sizeof(struct gln_node *) * (end + 1));
+    struct gln_snapshot_entry *entries = malloc(sizeof(struct gln_snapshot_entry) * (end + 1));
+    const struct gln_node_type **types = malloc(sizeof(struct gln_node_type *) * (end + 1));
+    struct gln_snapshot_node *records = malloc(sizeof(struct gln_snapshot_node) * (end + 1));
+    struct gln_snapshot_connection *connections = NULL;
+    uint32_t *plan = NULL;
+    uint8_t *image = NULL;
+    FILE *file = NULL;
+
+    if(nodes == NULL || entries == NULL || types == NULL || records == NULL) {
+	goto undo;
+    }
+
+    /* Collect the live, typed nodes. */
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node == NULL) {
+	    continue;
+	}
+	if(node->type == NULL) {
+	    arcp_release(node);
+	    continue;
+	}
+	nodes[nnodes] = node;
+	entries[nnodes].node = node;
+	entries[nnodes].index = nnodes;
+	nnodes++;
+    }
+    qsort(entries, nnodes, sizeof(struct gln_snapshot_entry), gln_snapshot_entry_cmp);
+
+    /* Types, parameter sizes, sockets and connections */
+    uint64_t params_size = 0;
+    for(i = 0; i < nnodes; i++) {
+	struct gln_node *node = nodes[i];
+	for(j = 0; j < ntypes; j++) {
+	    if(types[j] == node->type) {
+		break;
+	    }
+	}
+	if(j == ntypes) {
+	    types[ntypes++] = node->type;
+	}
+	records[i].type = j;
+
+	ssize_t size = node->type->save(node, NULL, 0);
+	if(size < 0) {
+	    goto undo;
+	}
+	records[i].params_size = size;
+	params_size += ALIGN_UP((uint64_t) size);
+
+	int k;
+	struct gln_socket *socket;
+	for(k = 0; (socket = node->type->socket(node, k)) != NULL; k++) {
+	    if(socket->direction != GLNS_OUTPUT) {
+		continue;
+	    }
+	    if(gln_snapshot_connections(socket, i, k, entries, nnodes, &connections,
+					&nconnections, &connections_capacity) != 0) {
+		goto undo;
+	    }
+	}
+	records[i].nsockets = k;
+    }
+
+    plan = malloc(sizeof(uint32_t) * (nnodes + 1));
+    if(plan == NULL) {
+	goto undo;
+    }
+    if(gln_snapshot_plan(nnodes, connections, nconnections, plan) != 0) {
+	goto undo;
+    }
+
+    /* Lay out the image */
+    struct gln_snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GLN_SNAPSHOT_MAGIC, sizeof(GLN_SNAPSHOT_MAGIC));
+    header.version = GLN_SNAPSHOT_VERSION;
+    header.byteorder = GLN_SNAPSHOT_BYTEORDER;
+    header.ntypes = ntypes;
+    header.nnodes = nnodes;
+    header.nconnections = nconnections;
+    header.types_offset = ALIGN_UP(sizeof(struct gln_snapshot_header));
+    header.nodes_offset = ALIGN_UP(header.types_offset + sizeof(uint64_t) * ntypes);
+    header.connections_offset = ALIGN_UP(header.nodes_offset + sizeof(struct gln_snapshot_node) * nnodes);
+    header.plan_offset = ALIGN_UP(header.connections_offset + sizeof(struct gln_snapshot_connection) * nconnections);
+    uint64_t params_offset = ALIGN_UP(header.plan_offset + sizeof(uint32_t) * nnodes);
+    uint64_t names_offset = params_offset + params_size;
+    header.size = names_offset;
+    for(i = 0; i < ntypes; i++) {
+	header.size += strlen(types[i]->name) + 1;
+    }
+
+    image = calloc(1, header.size);
+    if(image == NULL) {
+	goto undo;
+    }
+    memcpy(image, &header, sizeof(header));
+
+    uint64_t *type_offsets = (uint64_t *) (image + header.types_offset);
+    uint64_t offset = names_offset;
+    for(i = 0; i < ntypes; i++) {
+	size_t len = strlen(types[i]->name) + 1;
+	type_offsets[i] = offset;
+	memcpy(image + offset, types[i]->name, len);
+	offset += len;
+    }
+
+    offset = params_offset;
+    for(i = 0; i < nnodes; i++) {
+	records[i].params_offset = offset;
+	if(records[i].params_size != 0) {
+	    ssize_t size = nodes[i]->type->save(nodes[i], image + offset, records[i].params_size);
+	    if(size < 0 || (uint64_t) size != records[i].params_size) {
+		/* Parameters changed between calls */
+		errno = EAGAIN;
+		goto undo;
+	    }
+	}
+	offset += ALIGN_UP(records[i].params_size);
+    }
+    memcpy(image + header.nodes_offset, records, sizeof(struct gln_snapshot_node) * nnodes);
+    memcpy(image + header.connections_offset, connections, sizeof(struct gln_snapshot_connection) * nconnections);
+    memcpy(image + header.plan_offset, plan, sizeof(uint32_t) * nnodes);
+
+    file = fopen(path, "wb");
+    if(file == NULL) {
+	goto undo;
+    }
+    if(fwrite(image, 1, header.size, file) != header.size) {
+	fclose(file);
+	goto undo;
+    }
+    if(fclose(file) != 0) {
+	goto undo;
+    }
+    r = 0;
+
+undo:
+    if(nodes != NULL) {
+	for(i = 0; i < nnodes; i++) {
+	    arcp_release(nodes[i]);
+	}
+    }
+    free(image);
+    free(plan);
+    free(connections);
+    free(records);
+    free(types);
+    free(entries);
+    free(nodes);
+    return r;
+}
+
+int gln_snapshot_locate(struct gln_graph *graph, struct gln_socket *socket,
+			uint32_t *node_index, uint32_t *socket_index) {
+    /* Same order as gln_graph_save */
+    size_t end = gln_registry_end(&graph->nodes);
+    size_t i;
+    uint32_t n = 0;
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node == NULL) {
+	    continue;
+	}
+	if(node->type == NULL) {
+	    arcp_release(node);
+	    continue;
+	}
+	int k = gln_socket_index(node, socket);
+	arcp_release(node);
+	if(k >= 0) {
+	    *node_index = n;
+	    *socket_index = k;
+	    return 0;
+	}
+	n++;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/* Loading */
+
+static bool gln_snapshot_in_bounds(uint64_t size, uint64_t offset, uint64_t length) {
+    return offset <= size && length <= size - offset;
+}
+
+/* Sections are cast in place, so they must be aligned as written */
+static bool gln_snapshot_aligned(uint64_t offset) {
+    return ALIGN_UP(offset) == offset;
+}
+
+struct gln_graph *gln_graph_load_mmap(const char *path) {
+    struct gln_graph *graph = NULL;
+    struct gln_snapshot_nodes *list = NULL;
+    struct gln_node_type **types = NULL;
+    size_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+	return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+	close(fd);
+	return NULL;
+    }
+    uint64_t size = st.st_size;
+    if(size < sizeof(struct gln_snapshot_header)) {
+	close(fd);
+	errno = EINVAL;
+	return NULL;
+    }
+    const uint8_t *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED) {
+	return NULL;
+    }
+
+    const struct gln_snapshot_header *header = (const struct gln_snapshot_header *) image;
+    if(memcmp(header->magic, GLN_SNAPSHOT_MAGIC, sizeof(GLN_SNAPSHOT_MAGIC)) != 0
+       || header->byteorder != GLN_SNAPSHOT_BYTEORDER
+       || header->size != size
+       || !gln_snapshot_aligned(header->types_offset)
+       || !gln_snapshot_aligned(header->nodes_offset)
+       || !gln_snapshot_aligned(header->connections_offset)
+       || !gln_snapshot_aligned(header->plan_offset)
+       || !gln_snapshot_in_bounds(size, header->types_offset, sizeof(uint64_t) * (uint64_t) header->ntypes)
+       || !gln_snapshot_in_bounds(size, header->nodes_offset, sizeof(struct gln_snapshot_node) * (uint64_t) header->nnodes)
+       || !gln_snapshot_in_bounds(size, header->connections_offset, sizeof(struct gln_snapshot_connection) * (uint64_t) header->nconnections)
+       || !gln_snapshot_in_bounds(size, header->plan_offset, sizeof(uint32_t) * (uint64_t) header->nnodes)) {
+	errno = EINVAL;
+	goto undo;
+    }
+    if(header->version != GLN_SNAPSHOT_VERSION) {
+	errno = ENOTSUP;
+	goto undo;
+    }
+
+    /* Resolve types */
+    const uint64_t *type_offsets = (const uint64_t *) (image + header->types_offset);
+    types = malloc(sizeof(struct gln_node_type *) * (header->ntypes + 1));
+    if(types == NULL) {
+	goto undo;
+    }
+    for(i = 0; i < header->ntypes; i++) {
+	if(type_offsets[i] >= size
+	   || memchr(image + type_offsets[i], '\0', size - type_offsets[i]) == NULL) {
+	    errno = EINVAL;
+	    goto undo;
+	}
+	types[i] = gln_node_type_find((const char *) image + type_offsets[i]);
+	if(types[i] == NULL) {
+	    errno = ENOENT;
+	    goto undo;
+	}
+    }
+
+    const struct gln_snapshot_node *records = (const struct gln_snapshot_node *) (image + header->nodes_offset);
+    const struct gln_snapshot_connection *connections = (const struct gln_snapshot_connection *) (image + header->connections_offset);
+    const uint32_t *plan = (const uint32_t *) (image + header->plan_offset);
+    for(i = 0; i < header->nnodes; i++) {
+	if(records[i].type >= header->ntypes
+	   || !gln_snapshot_aligned(records[i].params_offset)
+	   || !gln_snapshot_in_bounds(size, records[i].params_offset, records[i].params_size)
+	   || plan[i] >= header->nnodes) {
+	    errno = EINVAL;
+	    goto undo;
+	}
+    }
+    for(i = 0; i < header->nconnections; i++) {
+	if(connections[i].out_node >= header->nnodes
+	   || connections[i].in_node >= header->nnodes
+	   || connections[i].out_socket >= records[connections[i].out_node].nsockets
+	   || connections[i].in_socket >= records[connections[i].in_node].nsockets) {
+	    errno = EINVAL;
+	    goto undo;
+	}
+    }
+
+    graph = gln_graph_create();
+    if(graph == NULL) {
+	goto undo;
+    }
+    size_t list_size = sizeof(struct gln_snapshot_nodes) + sizeof(struct gln_node *) * header->nnodes;
+    list = amalloc(list_size);
+    if(list == NULL) {
+	goto undo;
+    }
+    list->count = header->nnodes;
+    memset(list->nodes, 0, sizeof(struct gln_node *) * header->nnodes);
+    arcp_region_init(list, (void (*)(struct arcp_region *)) __gln_snapshot_nodes_destroy);
+
+    /* Create nodes, producers first */
+    for(i = 0; i < header->nnodes; i++) {
+	uint32_t n = plan[i];
+	const struct gln_snapshot_node *record = &records[n];
+	if(list->nodes[n] != NULL) {
+	    /* Not a permutation */
+	    errno = EINVAL;
+	    goto undo;
+	}
+	struct gln_node *node = types[record->type]->create(graph, image + record->params_offset,
+							    record->params_size);
+	if(node == NULL) {
+	    goto undo;
+	}
+	node->type = types[record->type];
+	list->nodes[n] = node;
+    }
+
+    /* Connect them */
+    for(i = 0; i < header->nconnections; i++) {
+	const struct gln_snapshot_connection *c = &connections[i];
+	struct gln_node *out_node = list->nodes[c->out_node];
+	struct gln_node *in_node = list->nodes[c->in_node];
+	struct gln_socket *out = out_node->type->socket(out_node, c->out_socket);
+	struct gln_socket *in = in_node->type->socket(in_node, c->in_socket);
+	if(out == NULL || in == NULL) {
+	    errno = EINVAL;
+	    goto undo;
+	}
+	if(gln_socket_connect(out, in) != 0) {
+	    goto undo;
+	}
+    }
+
+    arcp_store(&graph->loaded, list);
+    arcp_release(list);
+    free(types);
+    munmap((void *) image, size);
+    return graph;
+
+undo:
+    fd = errno;
+    if(list != NULL) {
+	arcp_release(list);
+    }
+    if(graph != NULL) {
+	arcp_release(graph);
+    }
+    free(types);
+    munmap((void *) image, size);
+    errno = fd;
+    return NULL;
+}
@@ -0,0 +1,418 @@
+/*
+ * stress.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Stress test and benchmark for topology edits under load.
+ *
+ * A driver thread runs processing cycles back to back, pulling one
+ * input per lane; the producers connected to the lanes are run by a
+ * scheduler's worker threads.  Editor threads reconnect lanes to
+ * random producers, or disconnect them, at a fixed rate.  The run has
+ * two phases of the same length, without and then with edits, and
+ * reports cycle and edit latencies and transaction retries.
+ *
+ * Producers fill every buffer with their id.  The driver checks that
+ * each input it gets is whole, and at the end that every lane
+ * delivers whatever its editor last connected it to.
+ *
+ * Build with "make graphline-stress".  Adding -fsanitize=address or
+ * -fsanitize=thread to CFLAGS checks for memory and ordering errors
+ * as well. */
+
+#include <graphline.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int nworkers = 2;
+static int nproducers = 8;
+static int nlanes = 16;
+static int neditors = 1;
+static int edit_rate = 1000;
+static int seconds = 2;
+static size_t words = 256;
+
+static volatile atomic_bool stop;
+static volatile atomic_bool editing;
+
+struct producer {
+    struct gln_node;
+    struct gln_socket *out;
+    uint32_t id;
+};
+
+static struct producer **producers;
+static struct gln_socket **lanes;
+/* producer each lane should deliver at the end, or -1 */
+static volatile atomic_int *expected;
+
+static int producer_f(struct producer *self) {
+    uint32_t *buffer = gln_alloc_buffer(self->out, sizeof(uint32_t) * words);
+    if(buffer == NULL) {
+	return -1;
+    }
+    size_t i;
+    for(i = 0; i < words; i++) {
+	buffer[i] = self->id;
+    }
+    return 0;
+}
+
+static void producer_destroy(struct producer *self) {
+    arcp_release(self->out);
+    gln_node_destroy(self);
+    free(self);
+}
+
+static struct producer *producer_create(struct gln_graph *graph, uint32_t id) {
+    struct producer *self = malloc(sizeof(struct producer));
+    if(self == NULL) {
+	return NULL;
+    }
+    if(gln_node_init(self, graph, (gln_process_fp_t) producer_f, (void (*)(struct gln_node *)) producer_destroy) != 0) {
+	free(self);
+	return NULL;
+    }
+    self->id = id;
+    self->out = gln_socket_create(self, GLNS_OUTPUT);
+    if(self->out == NULL) {
+	arcp_release(self);
+	return NULL;
+    }
+    return self;
+}
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct samples {
+    uint64_t *v;
+    size_t n;
+    size_t size;
+};
+
+static void samples_add(struct samples *samples, uint64_t value) {
+    if(samples->n == samples->size) {
+	size_t size = samples->size == 0 ? 1024 : samples->size * 2;
+	uint64_t *v = realloc(samples->v, sizeof(uint64_t) * size);
+	if(v == NULL) {
+	    return;
+	}
+	samples->v = v;
+	samples->size = size;
+    }
+    samples->v[samples->n++] = value;
+}
+
+static int uint64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void samples_report(const char *name, struct samples *samples) {
+    if(samples->n == 0) {
+	printf("%-10s %10d\n", name, 0);
+	return;
+    }
+    qsort(samples->v, samples->n, sizeof(uint64_t), uint64_cmp);
+    printf("%-10s %10zu %10.1f %10.1f %10.1f\n", name, samples->n,
+	   samples->v[samples->n / 2] / 1000.0,
+	   samples->v[samples->n * 99 / 100] / 1000.0,
+	   samples->v[samples->n - 1] / 1000.0);
+}
+
+struct driver {
+    struct gln_graph *graph;
+    struct samples baseline;
+    struct samples edited;
+    unsigned long failures;
+    unsigned long corrupt;
+};
+
+/* Returns the number of lanes whose input was not whole. */
+static unsigned long check_buffers(void **buffers) {
+    unsigned long corrupt = 0;
+    int l;
+    size_t i;
+    for(l = 0; l < nlanes; l++) {
+	uint32_t *buffer = buffers[l];
+	if(buffer == NULL) {
+	    continue;
+	}
+	if(buffer[0] >= (uint32_t) nproducers) {
+	    corrupt++;
+	    continue;
+	}
+	for(i = 1; i < words; i++) {
+	    if(buffer[i] != buffer[0]) {
+		corrupt++;
+		break;
+	    }
+	}
+    }
+    return corrupt;
+}
+
+static void *driver_f(struct driver *driver) {
+    void **buffers = malloc(sizeof(void *) * nlanes);
+    if(buffers == NULL) {
+	return NULL;
+    }
+    while(!atomic_load(&stop)) {
+	bool edits = atomic_load(&editing);
+	uint64_t start = now();
+	if(gln_get_buffer_list(nlanes, lanes, buffers) != 0) {
+	    driver->failures++;
+	} else {
+	    driver->corrupt += check_buffers(buffers);
+	}
+	gln_graph_reset(driver->graph);
+	samples_add(edits ? &driver->edited : &driver->baseline, now() - start);
+    }
+    free(buffers);
+    return NULL;
+}
+
+struct editor {
+    int index;
+    unsigned int seed;
+    struct samples latency;
+    unsigned long failures;
+};
+
+static void *editor_f(struct editor *editor) {
+    int mine = (nlanes - editor->index + neditors - 1) / neditors;
+    if(mine == 0) {
+	return NULL;
+    }
+    uint64_t period = 1000000000ull / edit_rate;
+    uint64_t next = now();
+    while(!atomic_load(&stop)) {
+	int l = editor->index + neditors * (rand_r(&editor->seed) % mine);
+	int p = rand_r(&editor->seed) % (nproducers + 1);
+	int r;
+	uint64_t start = now();
+	if(p == nproducers) {
+	    r = gln_socket_disconnect(lanes[l]);
+	    p = -1;
+	} else {
+	    r = gln_socket_connect(producers[p]->out, lanes[l]);
+	}
+	samples_add(&editor->latency, now() - start);
+	if(r != 0) {
+	    editor->failures++;
+	} else {
+	    atomic_store(&expected[l], p);
+	}
+
+	next += period;
+	uint64_t t = now();
+	if(next > t) {
+	    struct timespec ts = { next / 1000000000, next % 1000000000 };
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	} else {
+	    next = t;
+	}
+    }
+    return NULL;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t workers] [-p producers] [-l lanes] [-e editors]\n"
+	    "\t[-r edits per second per editor] [-d seconds per phase] [-w words per buffer]\n", name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    int i;
+    while((opt = getopt(argc, argv, "t:p:l:e:r:d:w:")) != -1) {
+	switch(opt) {
+	case 't':
+	    nworkers = atoi(optarg);
+	    break;
+	case 'p':
+	    nproducers = atoi(optarg);
+	    break;
+	case 'l':
+	    nlanes = atoi(optarg);
+	    break;
+	case 'e':
+	    neditors = atoi(optarg);
+	    break;
+	case 'r':
+	    edit_rate = atoi(optarg);
+	    break;
+	case 'd':
+	    seconds = atoi(optarg);
+	    break;
+	case 'w':
+	    words = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if(nworkers < 0 || nproducers <= 0 || nlanes <= 0 || neditors <= 0
+       || edit_rate <= 0 || seconds <= 0 || words == 0) {
+	usage(argv[0]);
+    }
+
+    struct gln_graph *graph = gln_graph_create();
+    producers = calloc(nproducers, sizeof(struct producer *));
+    lanes = calloc(nlanes, sizeof(struct gln_socket *));
+    expected = calloc(nlanes, sizeof(atomic_int));
+    struct editor *editors = calloc(neditors, sizeof(struct editor));
+    pthread_t *editor_threads = calloc(neditors, sizeof(pthread_t));
+    if(graph == NULL || producers == NULL || lanes == NULL || expected == NULL
+       || editors == NULL || editor_threads == NULL) {
+	perror("setup");
+	return 1;
+    }
+    for(i = 0; i < nproducers; i++) {
+	producers[i] = producer_create(graph, i);
+	if(producers[i] == NULL) {
+	    perror("producer_create");
+	    return 1;
+	}
+    }
+    struct gln_node *sink = gln_node_create(graph, NULL);
+    if(sink == NULL) {
+	perror("gln_node_create");
+	return 1;
+    }
+    for(i = 0; i < nlanes; i++) {
+	lanes[i] = gln_socket_create(sink, GLNS_INPUT);
+	if(lanes[i] == NULL
+	   || gln_socket_connect(producers[i % nproducers]->out, lanes[i]) != 0) {
+	    perror("lane");
+	    return 1;
+	}
+	atomic_init(&expected[i], i % nproducers);
+    }
+    struct gln_scheduler *scheduler = NULL;
+    if(nworkers > 0) {
+	scheduler = gln_scheduler_create(nworkers);
+	if(scheduler == NULL || gln_scheduler_attach(scheduler, graph, NULL) != 0) {
+	    perror("scheduler");
+	    return 1;
+	}
+    }
+
+    atomic_init(&stop, false);
+    atomic_init(&editing, false);
+    struct driver driver;
+    memset(&driver, 0, sizeof(struct driver));
+    driver.graph = graph;
+    pthread_t driver_thread;
+    if((errno = pthread_create(&driver_thread, NULL, (void *(*)(void *)) driver_f, &driver)) != 0) {
+	perror("pthread_create");
+	return 1;
+    }
+    sleep(seconds);
+
+    struct gln_txn_stats before;
+    gln_txn_stats(&before);
+    atomic_store(&editing, true);
+    for(i = 0; i < neditors; i++) {
+	editors[i].index = i;
+	editors[i].seed = i + 1;
+	if((errno = pthread_create(&editor_threads[i], NULL, (void *(*)(void *)) editor_f, &editors[i])) != 0) {
+	    perror("pthread_create");
+	    return 1;
+	}
+    }
+    sleep(seconds);
+    atomic_store(&stop, true);
+    for(i = 0; i < neditors; i++) {
+	pthread_join(editor_threads[i], NULL);
+    }
+    pthread_join(driver_thread, NULL);
+    struct gln_txn_stats after;
+    gln_txn_stats(&after);
+
+    /* One last cycle, with the topology settled */
+    unsigned long lost = 0;
+    void **buffers = malloc(sizeof(void *) * nlanes);
+    if(buffers == NULL || gln_get_buffer_list(nlanes, lanes, buffers) != 0) {
+	perror("final cycle");
+	return 1;
+    }
+    driver.corrupt += check_buffers(buffers);
+    for(i = 0; i < nlanes; i++) {
+	int p = atomic_load(&expected[i]);
+	uint32_t *buffer = buffers[i];
+	if(p < 0 ? buffer != NULL : (buffer == NULL || buffer[0] != (uint32_t) p)) {
+	    lost++;
+	}
+    }
+    free(buffers);
+
+    printf("%-10s %10s %10s %10s %10s\n", "", "count", "p50 us", "p99 us", "max us");
+    samples_report("baseline", &driver.baseline);
+    samples_report("edited", &driver.edited);
+    struct samples edits;
+    memset(&edits, 0, sizeof(struct samples));
+    unsigned long edit_failures = 0;
+    for(i = 0; i < neditors; i++) {
+	size_t j;
+	for(j = 0; j < editors[i].latency.n; j++) {
+	    samples_add(&edits, editors[i].latency.v[j]);
+	}
+	edit_failures += editors[i].failures;
+	free(editors[i].latency.v);
+    }
+    samples_report("edits", &edits);
+    printf("retries: connect %llu, disconnect %llu, pull %llu\n",
+	   (unsigned long long) (after.connect_retries - before.connect_retries),
+	   (unsigned long long) (after.disconnect_retries - before.disconnect_retries),
+	   (unsigned long long) (after.pull_retries - before.pull_retries));
+    printf("errors: failed cycles %lu, failed edits %lu, corrupt inputs %lu, lost connections %lu\n",
+	   driver.failures, edit_failures, driver.corrupt, lost);
+
+    if(scheduler != NULL) {
+	gln_scheduler_detach(scheduler, graph);
+	arcp_release(scheduler);
+    }
+    for(i = 0; i < nlanes; i++) {
+	arcp_release(lanes[i]);
+    }
+    arcp_release(sink);
+    for(i = 0; i < nproducers; i++) {
+	arcp_release(producers[i]);
+    }
+    arcp_release(graph);
+    free(driver.baseline.v);
+    free(driver.edited.v);
+    free(edits.v);
+    free(producers);
+    free(lanes);
+    free((void *) expected);
+    free(editors);
+    free(editor_threads);
+
+    return (driver.failures || edit_failures || driver.corrupt || lost) ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * test-cxx.cpp
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <graphline.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#define CHECKING(what)				\
+    printf("Checking " #what "...")
+
+#define OK()					\
+    printf("OK\n")
+
+#define CHECK(cond)				\
+    do {					\
+	if(!(cond)) {				\
+	    perror("Error: " #cond);		\
+	    exit(1);				\
+	}					\
+    } while(0)
+
+static int destroyed;
+
+struct Ramp : gln::Node<Ramp, gln::Inputs<>, gln::Outputs<float>> {
+    int process() {
+	float *out = output<0>().alloc(4);
+	if(out == nullptr) {
+	    return -1;
+	}
+	for(int i = 0; i < 4; i++) {
+	    out[i] = i;
+	}
+	return 0;
+    }
+    ~Ramp() { destroyed++; }
+};
+
+struct Gain : gln::Node<Gain, gln::Inputs<float, float>, gln::Outputs<float>> {
+    float gain;
+    explicit Gain(float gain) : gain(gain) {}
+    /* offset is unconnected, so NULL */
+    int process(const float *in, const float *offset) {
+	size_t n = input<0>().size();
+	float *out = output<0>().alloc(n);
+	if(out == nullptr) {
+	    return -1;
+	}
+	for(size_t i = 0; i < n; i++) {
+	    out[i] = in[i] * gain + (offset == nullptr ? 0 : offset[i]);
+	}
+	return 0;
+    }
+    ~Gain() { destroyed++; }
+};
+
+struct Sink : gln::Node<Sink, gln::Inputs<float>, gln::Outputs<>> {
+    int process(const float *) {
+	return 0;
+    }
+    ~Sink() { destroyed++; }
+};
+
+struct Thrower : gln::Node<Thrower, gln::Inputs<>, gln::Outputs<float>> {
+    int process() {
+	throw std::runtime_error("thrown");
+    }
+};
+
+/* Every other element of the input, as a strided view */
+struct Decimate : gln::Node<Decimate, gln::Inputs<float>, gln::Outputs<float>> {
+    int process(const float *) {
+	return gln_set_buffer_view(output<0>().socket(), input<0>().socket(), 0, 2, 2 * sizeof(float));
+    }
+};
+
+int main() {
+    CHECKING(gln::Node::create);
+    struct gln_graph *graph = gln_graph_create();
+    CHECK(graph != nullptr);
+    auto ramp = Ramp::create(graph);
+    auto gain = Gain::create(graph, 0.5f);
+    auto sink = Sink::create(graph);
+    CHECK(ramp && gain && sink);
+    CHECK(gain->gain == 0.5f);
+    OK();
+
+    CHECKING(gln::connect);
+    CHECK(gln::connect(ramp->output<0>(), gain->input<0>()) == 0);
+    CHECK(gln::connect(gain->output<0>(), sink->input<0>()) == 0);
+    OK();
+
+    CHECKING(gln::pull);
+    for(int cycle = 0; cycle < 3; cycle++) {
+	std::tuple<const float *> buffers;
+	CHECK(gln::pull(buffers, sink->input<0>()) == 0);
+	const float *result = std::get<0>(buffers);
+	CHECK(result != nullptr && sink->input<0>().size() == 4);
+	for(int i = 0; i < 4; i++) {
+	    CHECK(result[i] == i * 0.5f);
+	}
+	gln_graph_reset(graph);
+    }
+    OK();
+
+    CHECKING(gln::Ref::reset);
+    ramp.reset();
+    gain.reset();
+    sink.reset();
+    CHECK(destroyed == 3);
+    gln_graph_release(graph);
+    OK();
+
+    CHECKING(exceptions from process);
+    graph = gln_graph_create();
+    CHECK(graph != nullptr);
+    auto thrower = Thrower::create(graph);
+    auto catcher = Sink::create(graph);
+    CHECK(thrower && catcher);
+    CHECK(gln::connect(thrower->output<0>(), catcher->input<0>()) == 0);
+    std::tuple<const float *> buffers;
+    CHECK(gln::pull(buffers, catcher->input<0>()) != 0 && errno == ECANCELED);
+    thrower.reset();
+    catcher.reset();
+    gln_graph_release(graph);
+    OK();
+
+    CHECKING(strided inputs);
+    graph = gln_graph_create();
+    CHECK(graph != nullptr);
+    ramp = Ramp::create(graph);
+    auto decimate = Decimate::create(graph);
+    gain = Gain::create(graph, 1.0f);
+    sink = Sink::create(graph);
+    CHECK(ramp && decimate && gain && sink);
+    CHECK(gln::connect(ramp->output<0>(), decimate->input<0>()) == 0);
+    CHECK(gln::connect(decimate->output<0>(), sink->input<0>()) == 0);
+    CHECK(gln::pull(buffers, sink->input<0>()) != 0 && errno == EINVAL);
+    gln_graph_reset(graph);
+    /* and as a node's input */
+    CHECK(gln::connect(decimate->output<0>(), gain->input<0>()) == 0);
+    CHECK(gln::connect(gain->output<0>(), sink->input<0>()) == 0);
+    CHECK(gln::pull(buffers, sink->input<0>()) != 0 && errno == EINVAL);
+    ramp.reset();
+    decimate.reset();
+    gain.reset();
+    sink.reset();
+    gln_graph_release(graph);
+    OK();
+
+    return 0;
+}
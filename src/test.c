@@ -18,11 +18,19 @@
  * along with Cshellsynth.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <graphline.h>
+/* Checks the C++ header's copies of the declarations against ours */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wredundant-decls"
+#include <graphline.hpp>
+#pragma GCC diagnostic pop
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 
 #define MYBUFSIZ 80
 
@@ -157,6 +165,393 @@ static int interpolate_f(struct interpolator *self) {
     return 0;
 }
 
+struct shmgenerator {
+    struct gln_node;
+    struct gln_socket *out;
+    struct gln_shm_arena *arena;
+};
+
+static void shmgenerator_destroy(struct shmgenerator *self) {
+    arcp_release(self->out);
+    gln_node_destroy(self);
+}
+
+static int shmgenerator_f(struct shmgenerator *self) {
+    char *out_buffer = (char *) gln_shm_alloc_buffer(self->out, self->arena, MYBUFSIZ + 1);
+    if(out_buffer == NULL)
+	return -1;
+
+    size_t i;
+    for(i = 0; i < MYBUFSIZ; i++) {
+	out_buffer[i] = 'a' + (i % 26);
+    }
+    out_buffer[i] = '\0';
+    return 0;
+}
+
+struct lanecounter {
+    struct gln_node;
+    struct gln_socket *out;
+};
+
+static void lanecounter_destroy(struct lanecounter *self) {
+    arcp_release(self->out);
+    gln_node_destroy(self);
+}
+
+static int lanecounter_f(struct lanecounter *self) {
+    char *out_buffer = (char *) gln_alloc_lanes(self->out, 1, self->instances);
+    if(out_buffer == NULL)
+	return -1;
+
+    unsigned int k;
+    for(k = 0; k < self->instances; k++) {
+	int *count = (int *) gln_node_state(self, k);
+	*(char *) gln_lane(out_buffer, 1, k) = 'a' + k + (*count)++;
+    }
+    return 0;
+}
+
+struct splitter {
+    struct gln_node;
+    struct gln_socket *in;
+    struct gln_socket *even;
+    struct gln_socket *odd;
+    struct gln_socket *window;
+};
+
+static void splitter_destroy(struct splitter *self) {
+    arcp_release(self->in);
+    arcp_release(self->even);
+    arcp_release(self->odd);
+    arcp_release(self->window);
+    gln_node_destroy(self);
+}
+
+static int splitter_f(struct splitter *self) {
+    char *in_buffer;
+    int r = gln_get_buffers(1, self->in, &in_buffer);
+    if(r != 0) {
+	return r;
+    }
+    r = gln_set_buffer_view(self->even, self->in, 0, MYBUFSIZ / 2, 2);
+    if(r != 0) {
+	return r;
+    }
+    r = gln_set_buffer_view(self->odd, self->in, 1, MYBUFSIZ / 2, 2);
+    if(r != 0) {
+	return r;
+    }
+    return gln_set_buffer_view(self->window, self->even, 1, 3, 2);
+}
+
+static void *event_poster_f(struct gln_node *node) {
+    uint64_t t;
+    for(t = 0; t < 1000; t += 2) {
+	if(gln_node_post(node, t, &t, sizeof(uint64_t)) != 0) {
+	    return node;
+	}
+    }
+    return NULL;
+}
+
+static int ported_interpolate_f(struct gln_node *self) {
+    char *in[2];
+    int r = gln_node_get_inputs(self, (void **) in);
+    if(r != 0) {
+	return r;
+    }
+    char *out_buffer = (char *) gln_alloc_buffer(gln_node_output(self, 0), MYBUFSIZ + 1);
+    if(out_buffer == NULL) {
+	return -1;
+    }
+    size_t i;
+    for(i = 0; i < MYBUFSIZ; i++) {
+	out_buffer[i] = in[i % 2] == NULL ? '\0' : in[i % 2][i / 2];
+    }
+    out_buffer[MYBUFSIZ] = '\0';
+    return 0;
+}
+
+static int ext_process_f(void *data) {
+    (*(int *) data)++;
+    return 0;
+}
+
+static int ext_finalized;
+
+static void ext_finalize_f(void *data) {
+    ext_finalized = *(int *) data;
+}
+
+static int sleeper_runs;
+
+static int sleeper_f(struct gln_node *self) {
+    sleeper_runs++;
+    usleep(20000);
+    return gln_alloc_buffer(gln_node_output(self, 0), 1) == NULL ? -1 : 0;
+}
+
+static struct gln_node *order_ran[2];
+static int order_runs;
+
+static int order_f(struct gln_node *self) {
+    order_ran[order_runs++] = self;
+    return gln_alloc_buffer(gln_node_output(self, 0), 1) == NULL ? -1 : 0;
+}
+
+static int hang_f(struct gln_node *self __attribute__((unused))) {
+    usleep(100000);
+    return 0;
+}
+
+static void *hang_puller_f(struct gln_socket *in) {
+    char *buffer;
+    gln_get_buffers(1, in, &buffer);
+    return NULL;
+}
+
+struct overrun_count {
+    volatile atomic_int running;
+    volatile atomic_int finished;
+};
+
+static void overrun_f(struct gln_node *node __attribute__((unused)), uint64_t elapsed __attribute__((unused)),
+		      bool running, struct overrun_count *count) {
+    atomic_fetch_add(running ? &count->running : &count->finished, 1);
+}
+
+static int failing_f(struct gln_node *self __attribute__((unused))) {
+    errno = EIO;
+    return -1;
+}
+
+static ssize_t noparams_save(struct gln_node *node __attribute__((unused)),
+			     void *params __attribute__((unused)),
+			     size_t size __attribute__((unused))) {
+    return 0;
+}
+
+static void __alphabetgenerator_destroy(struct alphabetgenerator *self) {
+    alphabetgenerator_destroy(self);
+    free(self);
+}
+
+static struct gln_node *alphabetgenerator_create(struct gln_graph *graph,
+						 const void *params __attribute__((unused)),
+						 size_t size __attribute__((unused))) {
+    struct alphabetgenerator *self = malloc(sizeof(struct alphabetgenerator));
+    if(self == NULL) {
+	return NULL;
+    }
+    if(gln_node_init(self, graph, (gln_process_fp_t) alphabetgenerator_f, (void (*)(struct gln_node *)) __alphabetgenerator_destroy) != 0) {
+	free(self);
+	return NULL;
+    }
+    self->out = gln_socket_create(self, GLNS_OUTPUT);
+    if(self->out == NULL) {
+	arcp_release(self);
+	return NULL;
+    }
+    return self;
+}
+
+static struct gln_socket *alphabetgenerator_socket(struct alphabetgenerator *self, int index) {
+    return index == 0 ? self->out : NULL;
+}
+
+static struct gln_node_type alphabetgenerator_type = {
+    .name = "alphabetgenerator",
+    .create = alphabetgenerator_create,
+    .save = noparams_save,
+    .socket = (struct gln_socket *(*)(struct gln_node *, int)) alphabetgenerator_socket
+};
+
+static void __uppercaser_destroy(struct uppercaser *self) {
+    uppercaser_destroy(self);
+    free(self);
+}
+
+static struct gln_node *uppercaser_create(struct gln_graph *graph,
+					  const void *params __attribute__((unused)),
+					  size_t size __attribute__((unused))) {
+    struct uppercaser *self = malloc(sizeof(struct uppercaser));
+    if(self == NULL) {
+	return NULL;
+    }
+    if(gln_node_init(self, graph, (gln_process_fp_t) uppercaser_f, (void (*)(struct gln_node *)) __uppercaser_destroy) != 0) {
+	free(self);
+	return NULL;
+    }
+    self->in = gln_socket_create(self, GLNS_INPUT);
+    self->out = gln_socket_create(self, GLNS_OUTPUT);
+    if(self->in == NULL || self->out == NULL) {
+	arcp_release(self);
+	return NULL;
+    }
+    return self;
+}
+
+static struct gln_socket *uppercaser_socket(struct uppercaser *self, int index) {
+    switch(index) {
+    case 0:
+	return self->in;
+    case 1:
+	return self->out;
+    default:
+	return NULL;
+    }
+}
+
+static struct gln_node_type uppercaser_type = {
+    .name = "uppercaser",
+    .create = uppercaser_create,
+    .save = noparams_save,
+    .socket = (struct gln_socket *(*)(struct gln_node *, int)) uppercaser_socket
+};
+
+static void __interpolator_destroy(struct interpolator *self) {
+    interpolator_destroy(self);
+    free(self);
+}
+
+static struct gln_node *interpolator_create(struct gln_graph *graph,
+					    const void *params __attribute__((unused)),
+					    size_t size __attribute__((unused))) {
+    struct interpolator *self = malloc(sizeof(struct interpolator));
+    if(self == NULL) {
+	return NULL;
+    }
+    if(gln_node_init(self, graph, (gln_process_fp_t) interpolate_f, (void (*)(struct gln_node *)) __interpolator_destroy) != 0) {
+	free(self);
+	return NULL;
+    }
+    self->in1 = gln_socket_create(self, GLNS_INPUT);
+    self->in2 = gln_socket_create(self, GLNS_INPUT);
+    self->out = gln_socket_create(self, GLNS_OUTPUT);
+    if(self->in1 == NULL || self->in2 == NULL || self->out == NULL) {
+	arcp_release(self);
+	return NULL;
+    }
+    return self;
+}
+
+static struct gln_socket *interpolator_socket(struct interpolator *self, int index) {
+    switch(index) {
+    case 0:
+	return self->in1;
+    case 1:
+	return self->in2;
+    case 2:
+	return self->out;
+    default:
+	return NULL;
+    }
+}
+
+static struct gln_node_type interpolator_type = {
+    .name = "interpolator",
+    .create = interpolator_create,
+    .save = noparams_save,
+    .socket = (struct gln_socket *(*)(struct gln_node *, int)) interpolator_socket
+};
+
+struct shifter {
+    struct gln_node;
+    struct gln_socket *in;
+    struct gln_socket *out;
+    char shift;
+};
+
+static int shifter_runs;
+static bool shifter_save_fails;
+
+static int shifter_f(struct shifter *self) {
+    char *in_buffer;
+    shifter_runs++;
+    int r = gln_get_buffers(1, self->in, &in_buffer);
+    if(r != 0) {
+	return r;
+    }
+    char *out_buffer = (char *) gln_alloc_buffer(self->out, MYBUFSIZ + 1);
+    if(out_buffer == NULL) {
+	return -1;
+    }
+    size_t i;
+    for(i = 0; i < MYBUFSIZ; i++) {
+	out_buffer[i] = in_buffer == NULL ? '\0' : in_buffer[i] + self->shift;
+    }
+    out_buffer[MYBUFSIZ] = '\0';
+    return 0;
+}
+
+static void __shifter_destroy(struct shifter *self) {
+    arcp_release(self->in);
+    arcp_release(self->out);
+    gln_node_destroy(self);
+    free(self);
+}
+
+static struct gln_node *shifter_create(struct gln_graph *graph, const void *params, size_t size) {
+    if(size != 1) {
+	errno = EINVAL;
+	return NULL;
+    }
+    struct shifter *self = malloc(sizeof(struct shifter));
+    if(self == NULL) {
+	return NULL;
+    }
+    if(gln_node_init(self, graph, (gln_process_fp_t) shifter_f, (void (*)(struct gln_node *)) __shifter_destroy) != 0) {
+	free(self);
+	return NULL;
+    }
+    self->shift = *(const char *) params;
+    self->in = gln_socket_create(self, GLNS_INPUT);
+    self->out = gln_socket_create(self, GLNS_OUTPUT);
+    if(self->in == NULL || self->out == NULL) {
+	arcp_release(self);
+	return NULL;
+    }
+    return self;
+}
+
+static ssize_t shifter_save(struct shifter *self, void *params, size_t size) {
+    if(shifter_save_fails) {
+	errno = EIO;
+	return -1;
+    }
+    if(params != NULL && size >= 1) {
+	*(char *) params = self->shift;
+    }
+    return 1;
+}
+
+static struct gln_socket *shifter_socket(struct shifter *self, int index) {
+    switch(index) {
+    case 0:
+	return self->in;
+    case 1:
+	return self->out;
+    default:
+	return NULL;
+    }
+}
+
+static struct gln_node_type shifter_type = {
+    .name = "shifter",
+    .create = shifter_create,
+    .save = (ssize_t (*)(struct gln_node *, void *, size_t)) shifter_save,
+    .socket = (struct gln_socket *(*)(struct gln_node *, int)) shifter_socket
+};
+
+static void *plan_thread_f(struct gln_plan *plan) {
+    if(gln_plan_run(plan, 1) != 0) {
+	printf("Error: gln_plan_run failed\n");
+	exit(1);
+    }
+    return NULL;
+}
+
 int main(int argc __attribute__((unused)), char **argv __attribute__((unused))) {
     struct gln_graph *graph;
     int r;
@@ -267,6 +662,1160 @@ int main(int argc __attribute__((unused)), char **argv __attribute__((unused)))
     r = gln_socket_connect(ag.out, itp.in1);
     CHECK_R();
 
+    CHECKING(gln_graph_save);
+    r = gln_node_type_register(&alphabetgenerator_type);
+    CHECK_R();
+    r = gln_node_type_register(&uppercaser_type);
+    CHECK_R();
+    r = gln_node_type_register(&interpolator_type);
+    CHECK_R();
+    struct gln_graph *typed_graph = gln_graph_create();
+    CHECK_NULL(typed_graph);
+    struct alphabetgenerator *tag = (struct alphabetgenerator *) gln_node_create_typed(typed_graph, "alphabetgenerator", NULL, 0);
+    CHECK_NULL(tag);
+    struct uppercaser *tuc = (struct uppercaser *) gln_node_create_typed(typed_graph, "uppercaser", NULL, 0);
+    CHECK_NULL(tuc);
+    struct interpolator *titp = (struct interpolator *) gln_node_create_typed(typed_graph, "interpolator", NULL, 0);
+    CHECK_NULL(titp);
+    r = gln_socket_connect(tag->out, tuc->in);
+    CHECK_R();
+    r = gln_socket_connect(tag->out, titp->in1);
+    CHECK_R();
+    r = gln_socket_connect(tuc->out, titp->in2);
+    CHECK_R();
+    char snapshot_path[] = "/tmp/graphline-test-XXXXXX";
+    int snapshot_fd = mkstemp(snapshot_path);
+    if(snapshot_fd < 0) {
+	perror("Error: ");
+	exit(1);
+    }
+    close(snapshot_fd);
+    r = gln_graph_save(typed_graph, snapshot_path);
+    CHECK_R();
+    arcp_release(titp);
+    arcp_release(tuc);
+    arcp_release(tag);
+    arcp_release(typed_graph);
+    OK();
+
+    CHECKING(gln_graph_load_mmap);
+    typed_graph = gln_graph_load_mmap(snapshot_path);
+    CHECK_NULL(typed_graph);
+    struct gln_node *loaded = NULL;
+    size_t k;
+    for(k = 0; (loaded = gln_graph_get_node(typed_graph, k)) != NULL; k++) {
+	if(loaded->type == &interpolator_type) {
+	    break;
+	}
+	arcp_release(loaded);
+    }
+    CHECK_NULL(loaded);
+    struct gln_node *typed_self = gln_node_create(typed_graph, NULL);
+    CHECK_NULL(typed_self);
+    struct gln_socket *typed_in = gln_socket_create(typed_self, GLNS_INPUT);
+    CHECK_NULL(typed_in);
+    r = gln_socket_connect(((struct interpolator *) loaded)->out, typed_in);
+    CHECK_R();
+    r = gln_get_buffers(1, typed_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    arcp_release(typed_in);
+    arcp_release(typed_self);
+    arcp_release(loaded);
+    arcp_release(typed_graph);
+    /* move the node records 4 bytes into their padding; the header
+     * puts nnodes at byte 28 and nodes_offset at byte 48 */
+    snapshot_fd = open(snapshot_path, O_RDWR);
+    uint32_t nnodes;
+    uint64_t nodes_offset;
+    char records[3 * 24];
+    if(snapshot_fd < 0
+       || pread(snapshot_fd, &nnodes, sizeof(nnodes), 28) != sizeof(nnodes)
+       || pread(snapshot_fd, &nodes_offset, sizeof(nodes_offset), 48) != sizeof(nodes_offset)
+       || nnodes != 3
+       || pread(snapshot_fd, records, sizeof(records), nodes_offset) != sizeof(records)) {
+	perror("Error: ");
+	exit(1);
+    }
+    nodes_offset += 4;
+    if(pwrite(snapshot_fd, records, sizeof(records), nodes_offset) != sizeof(records)
+       || pwrite(snapshot_fd, &nodes_offset, sizeof(nodes_offset), 48) != sizeof(nodes_offset)) {
+	perror("Error: ");
+	exit(1);
+    }
+    close(snapshot_fd);
+    if(gln_graph_load_mmap(snapshot_path) != NULL || errno != EINVAL) {
+	printf("Error: loaded a misaligned snapshot\n");
+	exit(1);
+    }
+    unlink(snapshot_path);
+    OK();
+
+    CHECKING(gln_shm_send);
+    struct gln_shm_arena *arena = gln_shm_arena_create(4, MYBUFSIZ + 1);
+    CHECK_NULL(arena);
+    /* stands in for the mapping in another process */
+    struct gln_shm_arena *remote_arena = gln_shm_arena_open(arena->fd);
+    CHECK_NULL(remote_arena);
+    struct gln_graph *remote_graph = gln_graph_create();
+    CHECK_NULL(remote_graph);
+    struct gln_shm_receiver *receiver = gln_shm_receiver_create(remote_graph, remote_arena);
+    CHECK_NULL(receiver);
+    struct gln_node *remote_self = gln_node_create(remote_graph, NULL);
+    CHECK_NULL(remote_self);
+    struct gln_socket *remote_in = gln_socket_create(remote_self, GLNS_INPUT);
+    CHECK_NULL(remote_in);
+    r = gln_socket_connect(receiver->out, remote_in);
+    CHECK_R();
+
+    gln_graph_reset(graph);
+    r = gln_shm_send(arena, in);
+    CHECK_R();
+    r = gln_get_buffers(1, remote_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    gln_graph_reset(remote_graph);
+
+    struct shmgenerator sg;
+    sg.arena = arena;
+    r = gln_node_init(&sg, graph, (gln_process_fp_t) shmgenerator_f, (void (*)(struct gln_node *)) shmgenerator_destroy);
+    CHECK_R();
+    sg.out = gln_socket_create(&sg, GLNS_OUTPUT);
+    CHECK_NULL(sg.out);
+    struct gln_socket *shm_in = gln_socket_create(self, GLNS_INPUT);
+    CHECK_NULL(shm_in);
+    r = gln_socket_connect(sg.out, shm_in);
+    CHECK_R();
+    r = gln_shm_send(arena, shm_in);
+    CHECK_R();
+    r = gln_get_buffers(1, remote_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "abcdefghij", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    gln_graph_reset(remote_graph);
+    gln_graph_reset(graph);
+    /* Each mapping is one side only */
+    if(gln_shm_receiver_create(remote_graph, arena) != NULL || errno != EINVAL) {
+	printf("Error: received on the sending mapping\n");
+	exit(1);
+    }
+    if(gln_shm_send(remote_arena, in) == 0 || errno != EINVAL) {
+	printf("Error: sent on the receiving mapping\n");
+	exit(1);
+    }
+
+    arcp_release(remote_in);
+    arcp_release(remote_self);
+    arcp_release(receiver);
+    arcp_release(remote_graph);
+    arcp_release(remote_arena);
+    OK();
+
+    CHECKING(gln_scheduler_attach);
+    struct gln_scheduler *scheduler = gln_scheduler_create(2);
+    CHECK_NULL(scheduler);
+    struct gln_sched_params sched_params = { .class = GLN_SCHED_REALTIME, .weight = 0, .load = 1500 };
+    r = gln_scheduler_attach(scheduler, graph, &sched_params);
+    CHECK_R();
+    sched_params.class = GLN_SCHED_NORMAL;
+    sched_params.load = 1000;
+    struct gln_graph *other_graph = gln_graph_create();
+    CHECK_NULL(other_graph);
+    r = gln_scheduler_attach(scheduler, other_graph, &sched_params);
+    if(r == 0 || errno != EAGAIN) {
+	printf("Error: admission control did not refuse overload\n");
+	exit(1);
+    }
+    gln_graph_reset(graph);
+    r = gln_get_buffers(1, in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    gln_graph_reset(graph);
+    gln_scheduler_set_affinity(scheduler, true);
+    int affinity_cycle;
+    for(affinity_cycle = 0; affinity_cycle < 10; affinity_cycle++) {
+	r = gln_get_buffers(1, in, &result);
+	CHECK_R();
+	CHECK_NULL(result);
+	if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	    printf("Error: unexpected result: %.10s\n", result);
+	    exit(1);
+	}
+	gln_graph_reset(graph);
+    }
+    struct gln_sched_stats affinity_stats;
+    gln_graph_sched_stats(graph, &affinity_stats);
+    if(affinity_stats.affinity_hits + affinity_stats.affinity_misses > affinity_stats.nodes_run) {
+	printf("Error: more affinity hits and misses than nodes run\n");
+	exit(1);
+    }
+    r = gln_scheduler_detach(scheduler, graph);
+    CHECK_R();
+    arcp_release(other_graph);
+    arcp_release(scheduler);
+    /* A scheduler going away leaves its graphs to their own threads */
+    scheduler = gln_scheduler_create(1);
+    CHECK_NULL(scheduler);
+    r = gln_scheduler_attach(scheduler, graph, NULL);
+    CHECK_R();
+    arcp_release(scheduler);
+    r = gln_get_buffers(1, in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    gln_graph_reset(graph);
+    OK();
+
+    CHECKING(gln_graph_set_instances);
+    struct gln_graph *instanced_graph = gln_graph_create();
+    CHECK_NULL(instanced_graph);
+    r = gln_graph_set_instances(instanced_graph, 3);
+    CHECK_R();
+    struct lanecounter lc;
+    r = gln_node_init(&lc, instanced_graph, (gln_process_fp_t) lanecounter_f, (void (*)(struct gln_node *)) lanecounter_destroy);
+    CHECK_R();
+    r = gln_node_set_state_size(&lc, sizeof(int));
+    CHECK_R();
+    lc.out = gln_socket_create(&lc, GLNS_OUTPUT);
+    CHECK_NULL(lc.out);
+    struct gln_node *instanced_self = gln_node_create(instanced_graph, NULL);
+    CHECK_NULL(instanced_self);
+    struct gln_socket *instanced_in = gln_socket_create(instanced_self, GLNS_INPUT);
+    CHECK_NULL(instanced_in);
+    r = gln_socket_connect(lc.out, instanced_in);
+    CHECK_R();
+    r = gln_get_buffers(1, instanced_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(*(char *) gln_lane(result, 1, 0) != 'a'
+       || *(char *) gln_lane(result, 1, 1) != 'b'
+       || *(char *) gln_lane(result, 1, 2) != 'c') {
+	printf("Error: unexpected lanes\n");
+	exit(1);
+    }
+    gln_graph_reset(instanced_graph);
+    r = gln_graph_set_instances(instanced_graph, 4);
+    CHECK_R();
+    r = gln_get_buffers(1, instanced_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(*(char *) gln_lane(result, 1, 0) != 'b'
+       || *(char *) gln_lane(result, 1, 2) != 'd'
+       || *(char *) gln_lane(result, 1, 3) != 'd') {
+	printf("Error: unexpected lanes\n");
+	exit(1);
+    }
+    arcp_release(instanced_in);
+    arcp_release(instanced_self);
+    OK();
+
+    CHECKING(gln_plan_run);
+    struct gln_graph *plan_graph = gln_graph_create();
+    CHECK_NULL(plan_graph);
+    struct alphabetgenerator *plan_ag = (struct alphabetgenerator *) alphabetgenerator_create(plan_graph, NULL, 0);
+    CHECK_NULL(plan_ag);
+    struct uppercaser *plan_uc = (struct uppercaser *) uppercaser_create(plan_graph, NULL, 0);
+    CHECK_NULL(plan_uc);
+    struct interpolator *plan_itp = (struct interpolator *) interpolator_create(plan_graph, NULL, 0);
+    CHECK_NULL(plan_itp);
+    struct gln_node *plan_self = gln_node_create(plan_graph, NULL);
+    CHECK_NULL(plan_self);
+    struct gln_socket *plan_in = gln_socket_create(plan_self, GLNS_INPUT);
+    CHECK_NULL(plan_in);
+    r = gln_socket_connect(plan_ag->out, plan_uc->in);
+    CHECK_R();
+    r = gln_socket_connect(plan_ag->out, plan_itp->in1);
+    CHECK_R();
+    r = gln_socket_connect(plan_uc->out, plan_itp->in2);
+    CHECK_R();
+    r = gln_socket_connect(plan_itp->out, plan_in);
+    CHECK_R();
+    r = gln_graph_profile(plan_graph, 1, &plan_in, 3);
+    CHECK_R();
+    struct gln_plan *plan = gln_plan_create(plan_graph, 2);
+    CHECK_NULL(plan);
+    size_t planned = 0;
+    while(gln_plan_get_node(plan, 0, planned) != NULL) {
+	planned++;
+    }
+    size_t index = 0;
+    while(gln_plan_get_node(plan, 1, index) != NULL) {
+	index++;
+    }
+    if(planned + index != 3) {
+	printf("Error: %zu nodes planned\n", planned + index);
+	exit(1);
+    }
+    int cycle;
+    for(cycle = 0; cycle < 3; cycle++) {
+	pthread_t plan_thread;
+	r = pthread_create(&plan_thread, NULL, (void *(*)(void *)) plan_thread_f, plan);
+	CHECK_R();
+	r = gln_plan_run(plan, 0);
+	CHECK_R();
+	pthread_join(plan_thread, NULL);
+	r = gln_get_buffers(1, plan_in, &result);
+	CHECK_R();
+	CHECK_NULL(result);
+	if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	    printf("Error: unexpected result: %.10s\n", result);
+	    exit(1);
+	}
+    }
+    arcp_release(plan);
+    arcp_release(plan_in);
+    arcp_release(plan_self);
+    arcp_release(plan_itp);
+    arcp_release(plan_uc);
+    arcp_release(plan_ag);
+    arcp_release(plan_graph);
+    OK();
+
+    CHECKING(gln_graph_set_flags);
+    struct gln_graph *owned_graph = gln_graph_create();
+    CHECK_NULL(owned_graph);
+    r = gln_graph_set_flags(owned_graph, GLN_GRAPH_OWNED);
+    CHECK_R();
+    struct alphabetgenerator *owned_ag = (struct alphabetgenerator *) alphabetgenerator_create(owned_graph, NULL, 0);
+    CHECK_NULL(owned_ag);
+    struct uppercaser *owned_uc = (struct uppercaser *) uppercaser_create(owned_graph, NULL, 0);
+    CHECK_NULL(owned_uc);
+    struct interpolator *owned_itp = (struct interpolator *) interpolator_create(owned_graph, NULL, 0);
+    CHECK_NULL(owned_itp);
+    struct gln_node *owned_self = gln_node_create(owned_graph, NULL);
+    CHECK_NULL(owned_self);
+    struct gln_socket *owned_in = gln_socket_create(owned_self, GLNS_INPUT);
+    CHECK_NULL(owned_in);
+    if(gln_graph_set_flags(owned_graph, 0) == 0 || errno != EBUSY) {
+	printf("Error: flags changed on a graph with nodes\n");
+	exit(1);
+    }
+    r = gln_socket_connect(owned_ag->out, owned_uc->in);
+    CHECK_R();
+    r = gln_socket_connect(owned_ag->out, owned_itp->in1);
+    CHECK_R();
+    r = gln_socket_connect(owned_uc->out, owned_itp->in2);
+    CHECK_R();
+    r = gln_socket_connect(owned_itp->out, owned_in);
+    CHECK_R();
+    /* The graph keeps them alive */
+    arcp_release(owned_ag);
+    arcp_release(owned_uc);
+    arcp_release(owned_itp);
+    for(cycle = 0; cycle < 2; cycle++) {
+	r = gln_get_buffers(1, owned_in, &result);
+	CHECK_R();
+	CHECK_NULL(result);
+	if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	    printf("Error: unexpected result: %.10s\n", result);
+	    exit(1);
+	}
+	gln_graph_reset(owned_graph);
+    }
+    r = gln_socket_disconnect(owned_uc->out);
+    CHECK_R();
+    r = gln_graph_remove_node(owned_graph, owned_uc);
+    CHECK_R();
+    r = gln_graph_remove_node(owned_graph, owned_uc);
+    CHECK_R();
+    gln_graph_reset(owned_graph);
+    r = gln_get_buffers(1, owned_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "a\0a\0a\0a\0a\0", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    arcp_release(owned_in);
+    arcp_release(owned_self);
+    arcp_release(owned_graph);
+    OK();
+
+    CHECKING(GLN_GRAPH_SINGLE_THREADED);
+    struct gln_graph *single_graph = gln_graph_create();
+    CHECK_NULL(single_graph);
+    r = gln_graph_set_flags(single_graph, GLN_GRAPH_SINGLE_THREADED);
+    CHECK_R();
+    struct alphabetgenerator *single_ag = (struct alphabetgenerator *) alphabetgenerator_create(single_graph, NULL, 0);
+    CHECK_NULL(single_ag);
+    struct uppercaser *single_uc = (struct uppercaser *) uppercaser_create(single_graph, NULL, 0);
+    CHECK_NULL(single_uc);
+    struct interpolator *single_itp = (struct interpolator *) interpolator_create(single_graph, NULL, 0);
+    CHECK_NULL(single_itp);
+    struct gln_node *single_self = gln_node_create(single_graph, NULL);
+    CHECK_NULL(single_self);
+    struct gln_socket *single_in = gln_socket_create(single_self, GLNS_INPUT);
+    CHECK_NULL(single_in);
+    r = gln_socket_connect(single_ag->out, single_uc->in);
+    CHECK_R();
+    r = gln_socket_connect(single_ag->out, single_itp->in1);
+    CHECK_R();
+    r = gln_socket_connect(single_uc->out, single_itp->in2);
+    CHECK_R();
+    r = gln_socket_connect(single_itp->out, single_in);
+    CHECK_R();
+    for(cycle = 0; cycle < 2; cycle++) {
+	r = gln_get_buffers(1, single_in, &result);
+	CHECK_R();
+	CHECK_NULL(result);
+	if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	    printf("Error: unexpected result: %.10s\n", result);
+	    exit(1);
+	}
+	gln_graph_reset(single_graph);
+    }
+    struct gln_scheduler *single_scheduler = gln_scheduler_create(1);
+    CHECK_NULL(single_scheduler);
+    if(gln_scheduler_attach(single_scheduler, single_graph, NULL) == 0 || errno != EINVAL) {
+	printf("Error: single-threaded graph attached to a scheduler\n");
+	exit(1);
+    }
+    arcp_release(single_scheduler);
+    arcp_release(single_in);
+    arcp_release(single_self);
+    arcp_release(single_itp);
+    arcp_release(single_uc);
+    arcp_release(single_ag);
+    arcp_release(single_graph);
+    OK();
+
+    CHECKING(gln_graph_cancel);
+    struct gln_graph *failing_graph = gln_graph_create();
+    CHECK_NULL(failing_graph);
+    struct gln_node *failing = gln_node_create(failing_graph, failing_f);
+    CHECK_NULL(failing);
+    struct gln_socket *failing_out = gln_socket_create(failing, GLNS_OUTPUT);
+    CHECK_NULL(failing_out);
+    struct uppercaser *failing_uc = (struct uppercaser *) uppercaser_create(failing_graph, NULL, 0);
+    CHECK_NULL(failing_uc);
+    struct gln_node *failing_self = gln_node_create(failing_graph, NULL);
+    CHECK_NULL(failing_self);
+    struct gln_socket *failing_in = gln_socket_create(failing_self, GLNS_INPUT);
+    CHECK_NULL(failing_in);
+    r = gln_socket_connect(failing_out, failing_uc->in);
+    CHECK_R();
+    r = gln_socket_connect(failing_uc->out, failing_in);
+    CHECK_R();
+    if(gln_get_buffers(1, failing_in, &result) == 0) {
+	printf("Error: failure not propagated\n");
+	exit(1);
+    }
+    int error = 0;
+    struct gln_node *failed = gln_graph_failed_node(failing_graph, &error);
+    if(failed != failing || error != EIO) {
+	printf("Error: failure not reported\n");
+	exit(1);
+    }
+    arcp_release(failed);
+    gln_graph_reset(failing_graph);
+    if(gln_graph_failed_node(failing_graph, NULL) != NULL) {
+	printf("Error: failure not cleared\n");
+	exit(1);
+    }
+    arcp_release(failing_in);
+    arcp_release(failing_self);
+    arcp_release(failing_uc);
+    arcp_release(failing_out);
+    arcp_release(failing);
+    arcp_release(failing_graph);
+    OK();
+
+    CHECKING(gln_graph_set_policy);
+    gln_graph_set_policy(graph, GLN_POLICY_DEPTH_FIRST);
+    gln_graph_reset(graph);
+    r = gln_get_buffers(1, in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    gln_graph_reset(graph);
+    gln_graph_set_policy(graph, GLN_POLICY_FIFO);
+    /* FIFO runs the producers in the order pulled; DEPTH_FIRST runs
+     * the last one first, on the pulling thread.  Owned graphs pull
+     * on a path of their own. */
+    int order_flags;
+    for(order_flags = 0; order_flags <= GLN_GRAPH_OWNED; order_flags += GLN_GRAPH_OWNED) {
+	struct gln_graph *order_graph = gln_graph_create();
+	CHECK_NULL(order_graph);
+	r = gln_graph_set_flags(order_graph, order_flags);
+	CHECK_R();
+	struct gln_node *order_first = gln_node_create(order_graph, order_f);
+	CHECK_NULL(order_first);
+	struct gln_node *order_last = gln_node_create(order_graph, order_f);
+	CHECK_NULL(order_last);
+	r = gln_node_set_ports(order_first, 0, 1);
+	CHECK_R();
+	r = gln_node_set_ports(order_last, 0, 1);
+	CHECK_R();
+	struct gln_node *order_self = gln_node_create(order_graph, NULL);
+	CHECK_NULL(order_self);
+	r = gln_node_set_ports(order_self, 2, 0);
+	CHECK_R();
+	r = gln_socket_connect(gln_node_output(order_first, 0), gln_node_input(order_self, 0));
+	CHECK_R();
+	r = gln_socket_connect(gln_node_output(order_last, 0), gln_node_input(order_self, 1));
+	CHECK_R();
+	void *order_buffers[2];
+	order_runs = 0;
+	r = gln_node_get_inputs(order_self, order_buffers);
+	CHECK_R();
+	if(order_runs != 2 || order_ran[0] != order_first || order_ran[1] != order_last) {
+	    printf("Error: FIFO ran producers out of order\n");
+	    exit(1);
+	}
+	gln_graph_set_policy(order_graph, GLN_POLICY_DEPTH_FIRST);
+	gln_graph_reset(order_graph);
+	order_runs = 0;
+	r = gln_node_get_inputs(order_self, order_buffers);
+	CHECK_R();
+	if(order_runs != 2 || order_ran[0] != order_last || order_ran[1] != order_first) {
+	    printf("Error: DEPTH_FIRST did not run the last producer first\n");
+	    exit(1);
+	}
+	/* and through a list of sockets */
+	gln_graph_reset(order_graph);
+	order_runs = 0;
+	r = gln_get_buffers(2, gln_node_input(order_self, 0), &order_buffers[0],
+			    gln_node_input(order_self, 1), &order_buffers[1]);
+	CHECK_R();
+	if(order_runs != 2 || order_ran[0] != order_last || order_ran[1] != order_first) {
+	    printf("Error: DEPTH_FIRST did not run the last producer first\n");
+	    exit(1);
+	}
+	arcp_release(order_self);
+	arcp_release(order_last);
+	arcp_release(order_first);
+	arcp_release(order_graph);
+    }
+    OK();
+
+    CHECKING(gln_graph_mem_usage);
+    struct gln_mem_usage usage;
+    struct gln_graph *mem_graph = gln_graph_create();
+    CHECK_NULL(mem_graph);
+    struct gln_node *mem_node = gln_node_create(mem_graph, NULL);
+    CHECK_NULL(mem_node);
+    struct gln_socket *mem_out = gln_socket_create(mem_node, GLNS_OUTPUT);
+    CHECK_NULL(mem_out);
+    struct gln_socket *mem_in = gln_socket_create(mem_node, GLNS_INPUT);
+    CHECK_NULL(mem_in);
+    gln_graph_mem_usage(mem_graph, &usage);
+    size_t topology = usage.live[GLN_MEM_TOPOLOGY];
+    r = gln_socket_connect(mem_out, mem_in);
+    CHECK_R();
+    gln_graph_mem_usage(mem_graph, &usage);
+    if(usage.live[GLN_MEM_TOPOLOGY] <= topology) {
+	printf("Error: connection not accounted\n");
+	exit(1);
+    }
+    r = gln_socket_disconnect(mem_out);
+    CHECK_R();
+    gln_graph_mem_usage(mem_graph, &usage);
+    if(usage.live[GLN_MEM_TOPOLOGY] != topology) {
+	printf("Error: disconnection not accounted\n");
+	exit(1);
+    }
+    CHECK_NULL(gln_alloc_buffer(mem_out, 1000));
+    gln_socket_mem_usage(mem_out, &usage);
+    if(usage.live[GLN_MEM_BUFFER] < 1000) {
+	printf("Error: buffer not accounted\n");
+	exit(1);
+    }
+    gln_node_mem_usage(mem_node, &usage);
+    if(usage.live[GLN_MEM_BUFFER] < 1000) {
+	printf("Error: buffer not accounted\n");
+	exit(1);
+    }
+    gln_graph_set_mem_budget(mem_graph, usage.total + 100);
+    if(gln_alloc_buffer(mem_out, 2000) != NULL || errno != ENOMEM) {
+	printf("Error: budget not enforced\n");
+	exit(1);
+    }
+    /* nor counted in the peaks below the graph */
+    gln_socket_mem_usage(mem_out, &usage);
+    if(usage.peak[GLN_MEM_BUFFER] >= 2000) {
+	printf("Error: rejected buffer counted in the socket's peak\n");
+	exit(1);
+    }
+    gln_node_mem_usage(mem_node, &usage);
+    if(usage.peak[GLN_MEM_BUFFER] >= 2000) {
+	printf("Error: rejected buffer counted in the node's peak\n");
+	exit(1);
+    }
+    gln_graph_set_mem_budget(mem_graph, 0);
+    arcp_release(mem_out);
+    gln_graph_mem_usage(mem_graph, &usage);
+    if(usage.live[GLN_MEM_BUFFER] != 0 || usage.peak[GLN_MEM_BUFFER] < 1000) {
+	printf("Error: buffer not released\n");
+	exit(1);
+    }
+    arcp_release(mem_in);
+    arcp_release(mem_node);
+    gln_graph_mem_usage(mem_graph, &usage);
+    if(usage.total != 0) {
+	printf("Error: %zu bytes still accounted\n", usage.total);
+	exit(1);
+    }
+    arcp_release(mem_graph);
+    OK();
+
+    CHECKING(gln_set_buffer_view);
+    struct gln_graph *view_graph = gln_graph_create();
+    CHECK_NULL(view_graph);
+    struct alphabetgenerator *view_ag = (struct alphabetgenerator *) alphabetgenerator_create(view_graph, NULL, 0);
+    CHECK_NULL(view_ag);
+    struct splitter view_split;
+    struct splitter *split = &view_split;
+    r = gln_node_init(split, view_graph, (gln_process_fp_t) splitter_f, (void (*)(struct gln_node *)) splitter_destroy);
+    CHECK_R();
+    split->in = gln_socket_create(split, GLNS_INPUT);
+    CHECK_NULL(split->in);
+    split->even = gln_socket_create(split, GLNS_OUTPUT);
+    CHECK_NULL(split->even);
+    split->odd = gln_socket_create(split, GLNS_OUTPUT);
+    CHECK_NULL(split->odd);
+    split->window = gln_socket_create(split, GLNS_OUTPUT);
+    CHECK_NULL(split->window);
+    r = gln_socket_connect(view_ag->out, split->in);
+    CHECK_R();
+    struct gln_node *view_sink = gln_node_create(view_graph, NULL);
+    CHECK_NULL(view_sink);
+    struct gln_socket *view_in[3];
+    char *view_buffers[3];
+    int i;
+    for(i = 0; i < 3; i++) {
+	view_in[i] = gln_socket_create(view_sink, GLNS_INPUT);
+	CHECK_NULL(view_in[i]);
+    }
+    r = gln_socket_connect(split->even, view_in[0]);
+    CHECK_R();
+    r = gln_socket_connect(split->odd, view_in[1]);
+    CHECK_R();
+    r = gln_socket_connect(split->window, view_in[2]);
+    CHECK_R();
+    r = gln_get_buffer_list(3, view_in, (void **) view_buffers);
+    CHECK_R();
+    size_t view_length, view_stride;
+    gln_get_buffer_shape(view_in[1], &view_length, &view_stride);
+    if(view_buffers[0][0] != 'a' || view_buffers[0][2] != 'c'
+       || view_buffers[1][0] != 'b' || view_buffers[1][2] != 'd'
+       || view_length != MYBUFSIZ / 2 || view_stride != 2) {
+	printf("Error: bad channel views\n");
+	exit(1);
+    }
+    gln_get_buffer_shape(view_in[2], &view_length, &view_stride);
+    if(view_buffers[2][0] != 'c' || view_buffers[2][4] != 'g' || view_buffers[2][8] != 'k'
+       || view_length != 3 || view_stride != 4) {
+	printf("Error: bad view of a view\n");
+	exit(1);
+    }
+    if(gln_set_buffer_view(split->window, split->in, 0, MYBUFSIZ, 2) == 0 || errno != EINVAL) {
+	printf("Error: oversized view allowed\n");
+	exit(1);
+    }
+    for(i = 0; i < 3; i++) {
+	arcp_release(view_in[i]);
+    }
+    arcp_release(view_sink);
+    arcp_release(split);
+    arcp_release(view_ag);
+    arcp_release(view_graph);
+    OK();
+
+    CHECKING(gln_node_create_list);
+    struct gln_graph *bulk_graph = gln_graph_create();
+    CHECK_NULL(bulk_graph);
+    size_t nbulk = 100000;
+    struct gln_node **bulk = malloc(sizeof(struct gln_node *) * nbulk);
+    CHECK_NULL(bulk);
+    r = gln_node_create_list(bulk_graph, nbulk, NULL, bulk);
+    CHECK_R();
+    gln_node_release_list(nbulk / 2, bulk);
+    r = gln_node_create_list(bulk_graph, nbulk / 2, NULL, bulk);
+    CHECK_R();
+    struct gln_socket *bulk_sockets[4];
+    r = gln_socket_create_list(bulk[0], GLNS_INPUT, 4, bulk_sockets);
+    CHECK_R();
+    gln_socket_release_list(4, bulk_sockets);
+    if(gln_graph_set_flags(bulk_graph, GLN_GRAPH_OWNED) == 0 || errno != EBUSY) {
+	printf("Error: nodes not registered\n");
+	exit(1);
+    }
+    gln_node_release_list(nbulk, bulk);
+    r = gln_graph_set_flags(bulk_graph, GLN_GRAPH_OWNED);
+    CHECK_R();
+    /* Removing owned nodes doesn't copy anything per node */
+    r = gln_node_create_list(bulk_graph, nbulk, NULL, bulk);
+    CHECK_R();
+    gln_node_release_list(nbulk, bulk);
+    gln_graph_reset(bulk_graph);
+    free(bulk);
+    arcp_release(bulk_graph);
+    OK();
+
+    CHECKING(gln_node_post);
+    struct gln_graph *event_graph = gln_graph_create();
+    CHECK_NULL(event_graph);
+    struct gln_node *event_node = gln_node_create(event_graph, NULL);
+    CHECK_NULL(event_node);
+    pthread_t poster;
+    r = pthread_create(&poster, NULL, (void *(*)(void *)) event_poster_f, event_node);
+    CHECK_R();
+    uint64_t t;
+    for(t = 999; t < 1000; t -= 2) {
+	r = gln_node_post(event_node, t, &t, sizeof(uint64_t));
+	CHECK_R();
+    }
+    void *poster_r;
+    pthread_join(poster, &poster_r);
+    if(poster_r != NULL) {
+	perror("Error: ");
+	exit(1);
+    }
+    struct gln_event *events = gln_node_events(event_node, 500);
+    struct gln_event *event;
+    t = 0;
+    for(event = events; event != NULL; event = event->next) {
+	if(event->time != t || *(uint64_t *) event->data != t) {
+	    printf("Error: event out of order\n");
+	    exit(1);
+	}
+	t++;
+    }
+    gln_event_release(event_node, events);
+    events = gln_node_events(event_node, 1000);
+    for(event = events; event != NULL; event = event->next) {
+	t++;
+    }
+    gln_event_release(event_node, events);
+    if(t != 1000) {
+	printf("Error: %d events lost\n", (int) (1000 - t));
+	exit(1);
+    }
+    arcp_release(event_node);
+    arcp_release(event_graph);
+    OK();
+
+    CHECKING(gln_replay);
+    struct gln_graph *capture_graph = gln_graph_create();
+    CHECK_NULL(capture_graph);
+    struct alphabetgenerator *cag = (struct alphabetgenerator *) gln_node_create_typed(capture_graph, "alphabetgenerator", NULL, 0);
+    CHECK_NULL(cag);
+    struct uppercaser *cuc = (struct uppercaser *) gln_node_create_typed(capture_graph, "uppercaser", NULL, 0);
+    CHECK_NULL(cuc);
+    r = gln_socket_connect(cag->out, cuc->in);
+    CHECK_R();
+    struct gln_node *capture_self = gln_node_create(capture_graph, NULL);
+    CHECK_NULL(capture_self);
+    struct gln_socket *capture_in = gln_socket_create(capture_self, GLNS_INPUT);
+    CHECK_NULL(capture_in);
+    r = gln_socket_connect(cuc->out, capture_in);
+    CHECK_R();
+    char capture_path[] = "/tmp/graphline-test-XXXXXX";
+    char capture_snapshot_path[] = "/tmp/graphline-test-XXXXXX";
+    int capture_fd = mkstemp(capture_path);
+    if(capture_fd < 0 || (snapshot_fd = mkstemp(capture_snapshot_path)) < 0) {
+	perror("Error: ");
+	exit(1);
+    }
+    close(capture_fd);
+    close(snapshot_fd);
+    struct gln_capture *capture = gln_capture_create(capture_graph, capture_snapshot_path, capture_path,
+						     1, &cag->out, 1, &cuc->out);
+    CHECK_NULL(capture);
+    for(i = 0; i < 3; i++) {
+	/* Idle time between pulls isn't recorded */
+	usleep(20000);
+	gln_capture_begin(capture);
+	r = gln_get_buffers(1, capture_in, &result);
+	CHECK_R();
+	r = gln_capture_cycle(capture);
+	CHECK_R();
+	gln_graph_reset(capture_graph);
+    }
+    if(gln_capture_cycle(capture) == 0 || errno != EINVAL) {
+	printf("Error: captured a cycle without a beginning\n");
+	exit(1);
+    }
+    r = gln_capture_close(capture);
+    CHECK_R();
+    struct gln_replay_stats replay_stats;
+    r = gln_replay(capture_snapshot_path, capture_path, 0, &replay_stats);
+    CHECK_R();
+    if(replay_stats.cycles != 3 || replay_stats.mismatches != 0) {
+	printf("Error: replayed %lu cycles, %lu mismatched\n", replay_stats.cycles, replay_stats.mismatches);
+	exit(1);
+    }
+    if(replay_stats.recorded_max_ns >= 20000000) {
+	printf("Error: recorded %llu ns for a pull\n", (unsigned long long) replay_stats.recorded_max_ns);
+	exit(1);
+    }
+    r = gln_replay(capture_snapshot_path, capture_path, 2, &replay_stats);
+    CHECK_R();
+    if(replay_stats.cycles != 3 || replay_stats.mismatches != 0) {
+	printf("Error: replayed %lu cycles, %lu mismatched\n", replay_stats.cycles, replay_stats.mismatches);
+	exit(1);
+    }
+    /* Against a graph without the recorded nodes */
+    struct gln_graph *empty_graph = gln_graph_create();
+    CHECK_NULL(empty_graph);
+    r = gln_graph_save(empty_graph, capture_snapshot_path);
+    CHECK_R();
+    arcp_release(empty_graph);
+    if(gln_replay(capture_snapshot_path, capture_path, 0, &replay_stats) == 0 || errno != EINVAL) {
+	printf("Error: replayed against the wrong graph\n");
+	exit(1);
+    }
+    unlink(capture_path);
+    unlink(capture_snapshot_path);
+    arcp_release(capture_in);
+    arcp_release(capture_self);
+    arcp_release(cuc);
+    arcp_release(cag);
+    arcp_release(capture_graph);
+    OK();
+
+    CHECKING(gln_node_set_budget);
+    struct gln_graph *budget_graph = gln_graph_create();
+    CHECK_NULL(budget_graph);
+    struct overrun_count overruns;
+    atomic_init(&overruns.running, 0);
+    atomic_init(&overruns.finished, 0);
+    gln_graph_set_overrun_handler(budget_graph, (gln_overrun_fp_t) overrun_f, &overruns, 1);
+    struct gln_node *sleeper = gln_node_create(budget_graph, sleeper_f);
+    CHECK_NULL(sleeper);
+    r = gln_node_set_ports(sleeper, 0, 1);
+    CHECK_R();
+    struct gln_socket *sleeper_out = gln_node_output(sleeper, 0);
+    struct gln_node *budget_self = gln_node_create(budget_graph, NULL);
+    CHECK_NULL(budget_self);
+    struct gln_socket *budget_in = gln_socket_create(budget_self, GLNS_INPUT);
+    CHECK_NULL(budget_in);
+    r = gln_socket_connect(sleeper_out, budget_in);
+    CHECK_R();
+    gln_node_set_budget(sleeper, 1000000);
+    struct gln_watchdog *watchdog = gln_watchdog_create(budget_graph, 1000000);
+    CHECK_NULL(watchdog);
+    for(i = 0; i < 2; i++) {
+	r = gln_get_buffers(1, budget_in, &result);
+	CHECK_R();
+	/* Quarantined the second time round, so nothing comes out */
+	if((result == NULL) != (i == 1)) {
+	    printf("Error: unexpected output on run %d\n", i);
+	    exit(1);
+	}
+	gln_graph_reset(budget_graph);
+    }
+    arcp_release(watchdog);
+    if(sleeper_runs != 1 || atomic_load(&overruns.finished) != 1
+       || atomic_load(&overruns.running) != 1 || !gln_node_quarantined(sleeper)) {
+	printf("Error: ran %d times, %d overruns (%d while running)\n", sleeper_runs,
+	       atomic_load(&overruns.finished), atomic_load(&overruns.running));
+	exit(1);
+    }
+    gln_node_set_budget(sleeper, 0);
+    if(gln_node_quarantined(sleeper)) {
+	printf("Error: still quarantined\n");
+	exit(1);
+    }
+    /* A plain node's outputs are cleared too */
+    struct alphabetgenerator *plain = (struct alphabetgenerator *) alphabetgenerator_create(budget_graph, NULL, 0);
+    CHECK_NULL(plain);
+    struct gln_socket *plain_in = gln_socket_create(budget_self, GLNS_INPUT);
+    CHECK_NULL(plain_in);
+    r = gln_socket_connect(plain->out, plain_in);
+    CHECK_R();
+    gln_node_set_budget(plain, 1);
+    for(i = 0; i < 2; i++) {
+	r = gln_get_buffers(1, plain_in, &result);
+	CHECK_R();
+	if((result == NULL) != (i == 1)) {
+	    printf("Error: unexpected output from a plain node on run %d\n", i);
+	    exit(1);
+	}
+	gln_graph_reset(budget_graph);
+    }
+    arcp_release(plain_in);
+    arcp_release(plain);
+    arcp_release(budget_in);
+    arcp_release(budget_self);
+    arcp_release(sleeper);
+    arcp_release(budget_graph);
+    OK();
+
+    CHECKING(gln_graph_set_timeout);
+    struct gln_graph *hang_graph = gln_graph_create();
+    CHECK_NULL(hang_graph);
+    gln_graph_set_timeout(hang_graph, 5000000);
+    struct gln_node *hang = gln_node_create(hang_graph, hang_f);
+    CHECK_NULL(hang);
+    struct gln_socket *hang_out = gln_socket_create(hang, GLNS_OUTPUT);
+    CHECK_NULL(hang_out);
+    struct gln_node *hang_self[2];
+    struct gln_socket *hang_in[2];
+    for(i = 0; i < 2; i++) {
+	hang_self[i] = gln_node_create(hang_graph, NULL);
+	CHECK_NULL(hang_self[i]);
+	hang_in[i] = gln_socket_create(hang_self[i], GLNS_INPUT);
+	CHECK_NULL(hang_in[i]);
+	r = gln_socket_connect(hang_out, hang_in[i]);
+	CHECK_R();
+    }
+    /* Another thread runs the node; we give up waiting for it */
+    pthread_t hang_thread;
+    r = pthread_create(&hang_thread, NULL, (void *(*)(void *)) hang_puller_f, hang_in[0]);
+    CHECK_R();
+    while(!atomic_load(&hang->running)) {
+	usleep(100);
+    }
+    if(gln_get_buffers(1, hang_in[1], &result) == 0 || errno != ETIMEDOUT) {
+	printf("Error: didn't time out\n");
+	exit(1);
+    }
+    /* Without a budget, it still isn't made ready while it runs */
+    gln_graph_reset(hang_graph);
+    if(atomic_load(&hang->state) == GLNN_READY) {
+	printf("Error: running node reset\n");
+	exit(1);
+    }
+    pthread_join(hang_thread, NULL);
+    gln_graph_reset(hang_graph);
+    if(atomic_load(&hang->state) != GLNN_READY) {
+	printf("Error: finished node not reset\n");
+	exit(1);
+    }
+    for(i = 0; i < 2; i++) {
+	arcp_release(hang_in[i]);
+	arcp_release(hang_self[i]);
+    }
+    arcp_release(hang_out);
+    arcp_release(hang);
+    arcp_release(hang_graph);
+    OK();
+
+    CHECKING(gln_node_set_ports);
+    struct gln_graph *ports_graph = gln_graph_create();
+    CHECK_NULL(ports_graph);
+    struct alphabetgenerator *ports_ag = (struct alphabetgenerator *) alphabetgenerator_create(ports_graph, NULL, 0);
+    CHECK_NULL(ports_ag);
+    struct uppercaser *ports_uc = (struct uppercaser *) uppercaser_create(ports_graph, NULL, 0);
+    CHECK_NULL(ports_uc);
+    struct gln_node *ports_itp = gln_node_create(ports_graph, ported_interpolate_f);
+    CHECK_NULL(ports_itp);
+    r = gln_node_set_ports(ports_itp, 2, 1);
+    CHECK_R();
+    if(gln_node_set_ports(ports_itp, 2, 1) == 0 || errno != EBUSY) {
+	printf("Error: ports declared twice\n");
+	exit(1);
+    }
+    if(gln_node_input(ports_itp, 2) != NULL || gln_node_output(ports_itp, 1) != NULL) {
+	printf("Error: port out of range\n");
+	exit(1);
+    }
+    struct gln_node *ports_self = gln_node_create(ports_graph, NULL);
+    CHECK_NULL(ports_self);
+    struct gln_socket *ports_in = gln_socket_create(ports_self, GLNS_INPUT);
+    CHECK_NULL(ports_in);
+    r = gln_socket_connect(ports_ag->out, ports_uc->in);
+    CHECK_R();
+    r = gln_socket_connect(ports_ag->out, gln_node_input(ports_itp, 0));
+    CHECK_R();
+    r = gln_socket_connect(ports_uc->out, gln_node_input(ports_itp, 1));
+    CHECK_R();
+    r = gln_socket_connect(gln_node_output(ports_itp, 0), ports_in);
+    CHECK_R();
+    r = gln_get_buffers(1, ports_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "aAbBcCdDeE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    OK();
+
+    CHECKING(gln_graph_update_latency);
+    gln_node_set_latency(ports_uc, 2);
+    r = gln_graph_update_latency(ports_graph, 1);
+    CHECK_R();
+    if(gln_socket_latency(ports_in) != 2 || gln_socket_latency(gln_node_input(ports_itp, 0)) != 2
+       || gln_socket_latency(ports_ag->out) != 0) {
+	printf("Error: unexpected latency %u\n", gln_socket_latency(ports_in));
+	exit(1);
+    }
+    gln_graph_reset(ports_graph);
+    r = gln_get_buffers(1, ports_in, &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "\0A\0BaCbDcE", 10) != 0) {
+	printf("Error: unexpected result: %.10s\n", result);
+	exit(1);
+    }
+    arcp_release(ports_in);
+    arcp_release(ports_self);
+    arcp_release(ports_itp);
+    arcp_release(ports_uc);
+    arcp_release(ports_ag);
+    arcp_release(ports_graph);
+    OK();
+
+    CHECKING(gln_node_set_memo);
+    r = gln_node_type_register(&shifter_type);
+    CHECK_R();
+    /* Room for one entry */
+    struct gln_memo_cache *memo = gln_memo_cache_create(256);
+    CHECK_NULL(memo);
+    struct gln_graph *memo_graph[2];
+    struct alphabetgenerator *memo_ag[2];
+    struct shifter *memo_sh[2];
+    struct gln_node *memo_self[2];
+    struct gln_socket *memo_in[2];
+    char memo_shift = 1;
+    for(i = 0; i < 2; i++) {
+	memo_graph[i] = gln_graph_create();
+	CHECK_NULL(memo_graph[i]);
+	memo_ag[i] = (struct alphabetgenerator *) alphabetgenerator_create(memo_graph[i], NULL, 0);
+	CHECK_NULL(memo_ag[i]);
+	memo_sh[i] = (struct shifter *) gln_node_create_typed(memo_graph[i], "shifter", &memo_shift, 1);
+	CHECK_NULL(memo_sh[i]);
+	r = gln_node_set_memo(memo_sh[i], memo);
+	CHECK_R();
+	memo_self[i] = gln_node_create(memo_graph[i], NULL);
+	CHECK_NULL(memo_self[i]);
+	if(gln_node_set_memo(memo_self[i], memo) == 0 || errno != EINVAL) {
+	    printf("Error: memoized an untyped node\n");
+	    exit(1);
+	}
+	memo_in[i] = gln_socket_create(memo_self[i], GLNS_INPUT);
+	CHECK_NULL(memo_in[i]);
+	r = gln_socket_connect(memo_ag[i]->out, memo_sh[i]->in);
+	CHECK_R();
+	r = gln_socket_connect(memo_sh[i]->out, memo_in[i]);
+	CHECK_R();
+    }
+    /* The second cycle, and the other graph, get the first's result */
+    char *memo_cached = NULL;
+    for(i = 0; i < 3; i++) {
+	int g = i < 2 ? 0 : 1;
+	r = gln_get_buffers(1, memo_in[g], &result);
+	CHECK_R();
+	CHECK_NULL(result);
+	if(memcmp(result, "bcdef", 5) != 0) {
+	    printf("Error: unexpected result: %.5s\n", result);
+	    exit(1);
+	}
+	memo_cached = result;
+	gln_graph_reset(memo_graph[g]);
+    }
+    struct gln_memo_stats memo_stats;
+    gln_memo_cache_stats(memo, &memo_stats);
+    if(shifter_runs != 1 || memo_stats.hits != 2 || memo_stats.misses != 1 || memo_stats.entries != 1) {
+	printf("Error: %d runs, %llu hits, %llu misses\n", shifter_runs,
+	       (unsigned long long) memo_stats.hits, (unsigned long long) memo_stats.misses);
+	exit(1);
+    }
+    /* A run that can't be keyed, after a hit, makes a new buffer
+     * rather than writing over the cached one; so does a run after
+     * the cache is taken away */
+    shifter_save_fails = true;
+    memo_sh[1]->shift = 2;
+    r = gln_get_buffers(1, memo_in[1], &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    shifter_save_fails = false;
+    gln_graph_reset(memo_graph[1]);
+    if(memcmp(result, "cdefg", 5) != 0 || memcmp(memo_cached, "bcdef", 5) != 0) {
+	printf("Error: unexpected results: %.5s, cached %.5s\n", result, memo_cached);
+	exit(1);
+    }
+    r = gln_get_buffers(1, memo_in[0], &result);
+    CHECK_R();
+    gln_graph_reset(memo_graph[0]);
+    r = gln_node_set_memo(memo_sh[0], NULL);
+    CHECK_R();
+    memo_sh[0]->shift = 2;
+    r = gln_get_buffers(1, memo_in[0], &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    gln_graph_reset(memo_graph[0]);
+    if(memcmp(result, "cdefg", 5) != 0 || memcmp(memo_cached, "bcdef", 5) != 0) {
+	printf("Error: unexpected results: %.5s, cached %.5s\n", result, memo_cached);
+	exit(1);
+    }
+    gln_memo_cache_stats(memo, &memo_stats);
+    if(shifter_runs != 3 || memo_stats.hits != 3 || memo_stats.bypassed != 1) {
+	printf("Error: %d runs, %llu hits, %llu bypassed\n", shifter_runs,
+	       (unsigned long long) memo_stats.hits, (unsigned long long) memo_stats.bypassed);
+	exit(1);
+    }
+    /* Different parameters miss, and push the first entry out */
+    r = gln_get_buffers(1, memo_in[1], &result);
+    CHECK_R();
+    CHECK_NULL(result);
+    if(memcmp(result, "cdefg", 5) != 0) {
+	printf("Error: unexpected result: %.5s\n", result);
+	exit(1);
+    }
+    gln_memo_cache_stats(memo, &memo_stats);
+    if(shifter_runs != 4 || memo_stats.misses != 2 || memo_stats.evictions != 1 || memo_stats.entries != 1) {
+	printf("Error: %d runs, %llu misses, %llu evictions\n", shifter_runs,
+	       (unsigned long long) memo_stats.misses, (unsigned long long) memo_stats.evictions);
+	exit(1);
+    }
+    for(i = 0; i < 2; i++) {
+	arcp_release(memo_in[i]);
+	arcp_release(memo_self[i]);
+	arcp_release(memo_sh[i]);
+	arcp_release(memo_ag[i]);
+	arcp_release(memo_graph[i]);
+    }
+    arcp_release(memo);
+    OK();
+
+    CHECKING(gln_node_create_ext);
+    struct gln_graph *ext_graph = gln_graph_create();
+    CHECK_NULL(ext_graph);
+    struct gln_node *ext_node = gln_node_create_ext(ext_graph, sizeof(int), ext_process_f, ext_finalize_f);
+    CHECK_NULL(ext_node);
+    struct gln_socket *ext_out = gln_socket_create(ext_node, GLNS_OUTPUT);
+    CHECK_NULL(ext_out);
+    struct gln_node *ext_self = gln_node_create(ext_graph, NULL);
+    CHECK_NULL(ext_self);
+    struct gln_socket *ext_in = gln_socket_create(ext_self, GLNS_INPUT);
+    CHECK_NULL(ext_in);
+    r = gln_socket_connect(ext_out, ext_in);
+    CHECK_R();
+    for(i = 0; i < 2; i++) {
+	r = gln_get_buffers(1, ext_in, &result);
+	CHECK_R();
+	gln_graph_reset(ext_graph);
+    }
+    arcp_release(ext_out);
+    arcp_release(ext_node);
+    if(ext_finalized != 2) {
+	printf("Error: finalized after %d runs\n", ext_finalized);
+	exit(1);
+    }
+    arcp_release(ext_in);
+    arcp_release(ext_self);
+    gln_graph_release(ext_graph);
+    OK();
+
     /* CHECKING(gln_socket_reset); */
 
     /* result = (char *) gln_socket_get_buffer(&in); */
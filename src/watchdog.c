@@ -0,0 +1,103 @@
+/*
+ * watchdog.c
+ *
+ * Copyright 2013 Evan Buswell
+ *
+ * This file is part of Graphline.
+ *
+ * Graphline is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, version 2.
+ *
+ * Graphline is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Graphline.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomickit/atomic-rcp.h>
+#include "graphline.h"
+#include "private.h"
+#include "futex.h"
+
+static void gln_watchdog_check(struct gln_graph *graph) {
+    size_t end = gln_registry_end(&graph->nodes);
+    size_t i;
+    uint64_t now = gln_now();
+    for(i = 0; i < end; i++) {
+	struct gln_node *node = gln_graph_load_node(graph, i);
+	if(node == NULL) {
+	    continue;
+	}
+	uint64_t started = atomic_load_explicit(&node->started, memory_order_acquire);
+	if(node->budget != 0 && started != 0 && now > started && now - started > node->budget
+	   && atomic_exchange_explicit(&node->reported, started, memory_order_relaxed) != started
+	   && graph->overrun != NULL) {
+	    graph->overrun(node, now - started, true, graph->overrun_arg);
+	}
+	arcp_release(node);
+    }
+}
+
+static void *gln_watchdog_thread(struct gln_watchdog *watchdog) {
+    struct timespec period = {
+	.tv_sec = watchdog->period / 1000000000,
+	.tv_nsec = watchdog->period % 1000000000
+    };
+    while(atomic_load_explicit(&watchdog->running, memory_order_acquire)) {
+	struct gln_graph *graph = (struct gln_graph *) arcp_weakref_load(watchdog->graph);
+	if(graph == NULL) {
+	    break;
+	}
+	gln_watchdog_check(graph);
+	arcp_release(graph);
+	gln_futex_wait(&watchdog->running, 1, false, &period);
+    }
+    return NULL;
+}
+
+static void __gln_watchdog_destroy(struct gln_watchdog *watchdog) {
+    atomic_store(&watchdog->running, 0);
+    gln_futex_wake(&watchdog->running, INT_MAX, false);
+    pthread_join(watchdog->thread, NULL);
+    arcp_release(watchdog->graph);
+    afree(watchdog, sizeof(struct gln_watchdog));
+}
+
+struct gln_watchdog *gln_watchdog_create(struct gln_graph *graph, uint64_t period) {
+    if(period == 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    struct gln_watchdog *watchdog = amalloc(sizeof(struct gln_watchdog));
+    if(watchdog == NULL) {
+	goto undo0;
+    }
+    watchdog->graph = arcp_weakref(graph);
+    if(watchdog->graph == NULL) {
+	goto undo1;
+    }
+    watchdog->period = period;
+    atomic_init(&watchdog->running, 1);
+    errno = pthread_create(&watchdog->thread, NULL,
+			   (void *(*)(void *)) gln_watchdog_thread, watchdog);
+    if(errno != 0) {
+	goto undo2;
+    }
+    arcp_region_init(watchdog, (void (*)(struct arcp_region *)) __gln_watchdog_destroy);
+    return watchdog;
+
+undo2:
+    arcp_release(watchdog->graph);
+undo1:
+    afree(watchdog, sizeof(struct gln_watchdog));
+undo0:
+    return NULL;
+}